@@ -64,6 +64,12 @@ uint64_t x64_lapic_reg_base = 0;
 uint32_t bsp_apic_init_done = 0;
 
 extern uint8_t smp_IMCRP;
+extern uint64_t calculate_lapic_frequency(void);
+extern uint64_t calculate_cpu_frequency(void);
+
+/* The LAPIC timer of each CPU, and whether it runs in TSC-deadline mode */
+static clockeventer_t lapic_clockeventers[CONFIG_NR_CPUS];
+static BOOL lapic_tsc_deadline[CONFIG_NR_CPUS];
 
 
 void lapic_write(uint32_t offset, uint32_t value)
@@ -127,21 +133,157 @@ static void lapic_timer_disable(void)
     lapic_write(LAPIC_LVT_TIMER, INTR_LAPIC_TIMER | LAPIC_LVT_MASKED);
     }
 
-static void lapic_timer_count_init(uint32_t ns)
+/* Convert nanoseconds to LAPIC timer counts, clamped to the counter range */
+static uint32_t lapic_timer_ns_to_count(uint64_t ns)
+    {
+    uint64_t count;
+
+    if (ns > NSECS_PER_SEC)
+        ns = NSECS_PER_SEC;
+
+    count = (kurrent_cpu->cpu_arch.apic_scale_factor * ns) >> 32;
+
+    if (count > 0xFFFFFFFF)
+        count = 0xFFFFFFFF;
+    
+    return (count == 0 && ns != 0) ? 1 : (uint32_t)count;
+    }
+
+/* 
+ * lapic_timer_periodic_start - (re)start the periodic timer of this CPU 
+ * with the specified period
+ */
+void lapic_timer_periodic_start(uint64_t period_ns)
     {
-    uint32_t count = (uint32_t)((kurrent_cpu->cpu_arch.apic_scale_factor * ns) >> 32);
+    lapic_timer_enable_periodic();
+    
+    lapic_write(LAPIC_TICR, lapic_timer_ns_to_count(period_ns));
+    }
 
-    printk("cpu%d - lapic_timer_count_init count %d, ns %d\n", 
-            this_cpu(), count, ns);
+/*
+ * lapic_timer_one_shot_start - program the timer of this CPU to fire once
+ * after the specified time (at most one second away); this also stops the
+ * periodic timer
+ */
+void lapic_timer_one_shot_start(uint64_t ns)
+    {
+    lapic_timer_enable_one_shot();
     
-    lapic_write(LAPIC_TICR, (count == 0 && ns != 0) ? 1 : count);
+    lapic_write(LAPIC_TICR, lapic_timer_ns_to_count(ns));
+    }
+
+/*
+ * lapic_timer_deadline_start - arm the timer of this CPU in TSC-deadline
+ * mode to fire once after the specified time
+ */
+static void lapic_timer_deadline_start(uint64_t ns)
+    {
+    uint64_t hz = kurrent_cpu->cpu_arch.tsc_freq_hz;
+
+    lapic_write(LAPIC_LVT_TIMER, INTR_LAPIC_TIMER | 
+                LAPIC_LVT_TIMER_TSC_DEADLINE);
+
+    /* The LVT write must be done before the deadline is armed */
+    memory_barrier();
+
+    /* Round up, firing early would only cost another interrupt */
+    write_msr(MSR_IA32_TSC_DEADLINE, 
+              rdtsc() + (ns * hz + NSECS_PER_SEC - 1) / NSECS_PER_SEC);
+    }
+
+static int lapic_clockeventer_start
+    (
+    struct clockeventer *   eventer,
+    int                     mode,
+    abstime_t               expire
+    )
+    {
+    if (eventer != &lapic_clockeventers[this_cpu()])
+        return EINVAL;
+
+    if (mode == CLOCK_EVENTER_MODE_PERIODIC)
+        lapic_timer_periodic_start(expire);
+    else if (lapic_tsc_deadline[this_cpu()])
+        lapic_timer_deadline_start(expire);
+    else
+        lapic_timer_one_shot_start(expire);
+
+    eventer->resolution = eventer->min_period_ns;
+
+    return OK;
+    }
+
+static int lapic_clockeventer_stop
+    (
+    struct clockeventer *   eventer
+    )
+    {
+    if (lapic_tsc_deadline[this_cpu()])
+        write_msr(MSR_IA32_TSC_DEADLINE, 0);
+
+    lapic_timer_disable();
+
+    return OK;
+    }
+
+/*
+ * Register the LAPIC timer of this CPU as its own clock eventer. The
+ * TSC-deadline mode is used when the CPUs have it: the deadline is
+ * absolute, so it neither drifts when re-armed nor depends on the bus
+ * frequency calibration.
+ */
+static clockeventer_t * lapic_clockeventer_announce(void)
+    {
+    clockeventer_t * eventer = &lapic_clockeventers[this_cpu()];
+    sched_cpu_arch_t * cpu_arch = &kurrent_cpu->cpu_arch;
+
+    memset(eventer, 0, sizeof(clockeventer_t));
+
+    eventer->name = "LAPIC";
+    eventer->flags = CLOCK_EVENTER_FLAGS_ONESHOT | CLOCK_EVENTER_FLAGS_PERCPU;
+    eventer->precedence = 1;
+
+    lapic_tsc_deadline[this_cpu()] = has_tsc_deadline() && 
+                                     cpu_arch->tsc_freq_hz;
+
+    if (lapic_tsc_deadline[this_cpu()])
+        {
+        eventer->name = "LAPIC-TSC-DEADLINE";
+        eventer->base_frequency = cpu_arch->tsc_freq_hz;
+        eventer->min_period_ns = NSECS_PER_SEC / cpu_arch->tsc_freq_hz;
+        }
+    else
+        {
+        eventer->flags |= CLOCK_EVENTER_FLAGS_PERIODIC;
+        eventer->base_frequency = 
+            (cpu_arch->apic_scale_factor * NSECS_PER_SEC) >> 32;
+        eventer->min_period_ns = cpu_arch->apic_period_ns;
+        }
+
+    if (!eventer->min_period_ns)
+        eventer->min_period_ns = 1;
+
+    /* lapic_timer_ns_to_count() clamps the count to one second */
+    eventer->max_period_ns = NSECS_PER_SEC;
+
+    eventer->resolution = eventer->min_period_ns;
+
+    eventer->start = lapic_clockeventer_start;
+    eventer->stop = lapic_clockeventer_stop;
+
+    clockeventer_add(eventer);
+
+    return eventer;
     }
 
 void lapic_timer_irq_handler(uint64_t stack_frame)
     {
+    clockeventer_t * eventer = &lapic_clockeventers[this_cpu()];
+
     lapic_eoi();
 
-    sched_tick((stack_frame_t *)stack_frame);
+    if (eventer->handler)
+        eventer->handler(eventer, eventer->arg);
     }
 
 void lapic_spurious_handler(uint64_t stack_frame)
@@ -159,6 +301,10 @@ void lapic_ipi_handler(uint64_t stack_frame)
 void lapic_reschedule_handler(uint64_t stack_frame)
     {
     lapic_eoi();
+
+    /* Let other CPUs send a new reschedule IPI from now on */
+    percpu_write(resched_pending, 0);
+
     reschedule();
     }
 
@@ -227,6 +373,7 @@ status_t lapic_common_init(void)
     uint32_t lvr;
     uint32_t maxlvt;
     uint64_t lapic_freq_hz = 0;
+    uint64_t tsc_freq_hz = 0;
     
     printk("MSR_FSB_FREQ %p\n", read_msr(MSR_FSB_FREQ));
         
@@ -281,9 +428,26 @@ status_t lapic_common_init(void)
     printk("done! lapic_freq_hz %lld, apic_period_ns %lld\n",
             lapic_freq_hz, kurrent_cpu->cpu_arch.apic_period_ns);
 
-    lapic_timer_count_init(NSECS_PER_SEC/CONFIG_HZ);
+    /* 
+     * The TSC is used to account the running time of threads. The APs
+     * reuse the TSC clock counter calibration once the BSP has done it,
+     * tsc_counter_enable() updates the BSP itself.
+     */
+    tsc_freq_hz = clockcounter_tsc.counter_frequency_hz;
 
-    lapic_timer_enable_periodic();
+    if (!tsc_freq_hz)
+        {
+        printk("cpu%d - calculate tsc frequency...", this_cpu());
+
+        tsc_freq_hz = calculate_cpu_frequency();
+
+        printk("done! tsc_freq_hz %lld\n", tsc_freq_hz);
+        }
+
+    sched_cpu_arch_tsc_freq_set(&kurrent_cpu->cpu_arch, tsc_freq_hz);
+
+    /* The tick and the timers of this CPU are driven by its LAPIC timer */
+    tick_percpu_eventer_init(lapic_clockeventer_announce());
 
     //disable_pit_intr();
 
@@ -375,6 +539,10 @@ status_t lapic_bsp_pre_init(void)
                  "LAPIC_RESCHEDULE",
                  (addr_t)lapic_reschedule_handler);
 
+    irq_register(INTR_LAPIC_TLB,
+                 "LAPIC_TLB",
+                 (addr_t)tlb_shootdown_handler);
+
     return OK;
     }
 
@@ -5,6 +5,7 @@
 #include <os.h>
 #include <os/acpi.h>
 #include <sys/time.h>
+#include <os/seqlock.h>
 
 static list_t clockcounter_list;
 static spinlock_t clockcounter_list_lock;
@@ -15,18 +16,43 @@ static spinlock_t clockcounter_list_lock;
     spinlock_unlock(&clockcounter_list_lock)
 
 struct clockcounter * global_clockcounter = NULL;
-timespec_t real_wall_time;
 
-/* Add a clock counter to the global clock list */
+/*
+ * The timekeeping snapshot: CLOCK_MONOTONIC and the offset of the wall 
+ * clock from it, as of the counter value cycle_last. The tick and the
+ * counter switches update it under the sequence lock, with interrupts 
+ * disabled. Clocks are read from any CPU by adding the counter cycles
+ * elapsed since cycle_last, without writing any shared state.
+ */
+static struct timekeeper
+    {
+    seqlock_t               lock;
+    struct clockcounter *   counter;
+    cycle_t                 cycle_last;
+
+    /* CLOCK_MONOTONIC at cycle_last, plus a nanosecond fraction shifted
+     * by the counter_shift of the counter */
+    abstime_t               mono_ns;
+    uint64_t                mono_snsec;
+
+    /* CLOCK_REALTIME - CLOCK_MONOTONIC */
+    abstime_t               wall_offset;
+    } timekeeper;
+
+/* Add a clock counter to the global clock list if it can be enabled */
 status_t clockcounter_add(struct clockcounter *counter)
     {
+    if (counter->counter_enable && (counter->counter_enable() != OK))
+        {
+        printk("clock counter %s is not usable\n", counter->counter_name);
+
+        return ERROR;
+        }
+
     CLOCK_COUNTER_LIST_LOCK();
 
     list_append(&clockcounter_list, &counter->node);
     
-    if (counter->counter_enable)
-        counter->counter_enable();
-    
     CLOCK_COUNTER_LIST_UNLOCK();
 
     return OK;
@@ -44,6 +70,47 @@ status_t clockcounter_remove(struct clockcounter *counter)
     return OK;
     }
 
+/*
+ * clockcounter_calc_mult_shift - compute the fixed point factors which
+ * convert from 'from' Hz to 'to' Hz
+ *
+ * The largest shift is used for precision, as long as a delta of up to 
+ * max_secs seconds multiplied by the factor still fits 64 bits.
+ */
+void clockcounter_calc_mult_shift
+    (
+    uint32_t *  mult,
+    uint32_t *  shift,
+    uint64_t    from,
+    uint64_t    to,
+    uint64_t    max_secs
+    )
+    {
+    uint64_t tmp;
+    uint32_t sft, sftacc = 32;
+
+    /* Bits left for the factor once the largest delta is accounted */
+    tmp = (max_secs * from) >> 32;
+
+    while (tmp)
+        {
+        tmp >>= 1;
+        sftacc--;
+        }
+
+    for (sft = 32; sft > 0; sft--)
+        {
+        tmp = (to << sft) + from / 2;
+        tmp /= from;
+
+        if ((tmp >> sftacc) == 0)
+            break;
+        }
+
+    *mult = (uint32_t)tmp;
+    *shift = sft;
+    }
+
 struct clockcounter clockcounter_pm_timer;
 
 status_t pm_timer_enable(void)
@@ -70,6 +137,12 @@ status_t pm_timer_enable(void)
      */
      
     clockcounter_pm_timer.counter_fixup_period = 2 * NSECS_PER_SEC;
+
+    clockcounter_calc_mult_shift(&clockcounter_pm_timer.counter_mult,
+                                 &clockcounter_pm_timer.counter_shift,
+                                 PM_TIMER_FREQUENCY, NSECS_PER_SEC,
+                                 clockcounter_pm_timer.counter_fixup_period /
+                                 NSECS_PER_SEC);
     
     return OK;
     }
@@ -99,16 +172,8 @@ cycle_t pm_timer_counter_read(void)
 
 abstime_t pm_timer_counter_time_elapsed(cycle_t t1, cycle_t t2)
     {
-    uint32_t time_us = 0;
-    
-    if (AcpiGetTimerDuration((uint32_t)t1, (uint32_t)t2, &time_us) != AE_OK)
-        {
-        printk("pm_timer_counter_time_elapsed - AcpiGetTimerDuration fail\n");
-               
-        return 0;
-        }
-
-    return (abstime_t) (time_us * 1000);
+    return clockcounter_cyc2ns(&clockcounter_pm_timer,
+                    clockcounter_delta(&clockcounter_pm_timer, t1, t2));
     }
 
 struct clockcounter clockcounter_pm_timer = 
@@ -120,40 +185,159 @@ struct clockcounter clockcounter_pm_timer =
     .counter_time_elapsed = pm_timer_counter_time_elapsed,
     };
 
+/* Fold the time elapsed since the snapshot in, called with the lock held */
+static void timekeeping_accumulate(void)
+    {
+    struct clockcounter * counter = timekeeper.counter;
+    cycle_t now;
+
+    if (counter == NULL)
+        return;
+
+    now = counter->counter_read();
+
+    timekeeper.mono_snsec += 
+        clockcounter_delta(counter, timekeeper.cycle_last, now) *
+        counter->counter_mult;
+
+    timekeeper.mono_ns += timekeeper.mono_snsec >> counter->counter_shift;
+    timekeeper.mono_snsec &= (1ULL << counter->counter_shift) - 1;
+
+    timekeeper.cycle_last = now;
+    }
+
+/* 
+ * Read CLOCK_MONOTONIC, and the wall clock offset if asked for, retrying
+ * if the snapshot was updated meanwhile
+ */
+static abstime_t timekeeping_read
+    (
+    abstime_t * wall_offset
+    )
+    {
+    struct clockcounter * counter;
+    unsigned int seq;
+    abstime_t ns;
+
+    do
+        {
+        seq = read_seqbegin(&timekeeper.lock);
+
+        counter = timekeeper.counter;
+        ns = timekeeper.mono_ns;
+
+        if (counter)
+            ns += (timekeeper.mono_snsec +
+                   clockcounter_delta(counter, timekeeper.cycle_last,
+                                      counter->counter_read()) *
+                   counter->counter_mult) >> counter->counter_shift;
+
+        if (wall_offset)
+            *wall_offset = timekeeper.wall_offset;
+        }
+    while (read_seqretry(&timekeeper.lock, seq));
+
+    return ns;
+    }
+
+/* Switch the snapshot over to another counter */
+static void timekeeping_set_counter
+    (
+    struct clockcounter *   counter
+    )
+    {
+    ipl_t ipl = interrupts_disable();
+
+    write_seqlock(&timekeeper.lock);
+
+    timekeeping_accumulate();
+
+    /* The fraction does not carry over, round it up not to go back */
+    if (timekeeper.mono_snsec)
+        {
+        timekeeper.mono_ns++;
+        timekeeper.mono_snsec = 0;
+        }
+
+    timekeeper.counter = counter;
+    timekeeper.cycle_last = counter->counter_read();
+
+    write_sequnlock(&timekeeper.lock);
+
+    interrupts_restore(ipl);
+    }
+
 struct clockcounter * select_global_clockcounter(void)
     {
-    struct clockcounter * best;
-    if (global_clockcounter && 
-        global_clockcounter->counter_disable)
-        global_clockcounter->counter_disable();
+    struct clockcounter * best = &clockcounter_pm_timer;
+    struct clockcounter * old = global_clockcounter;
+    struct clockcounter * counter;
 
     CLOCK_COUNTER_LIST_LOCK();
 
-    global_clockcounter = &clockcounter_pm_timer;
-
     LIST_FOREACH(&clockcounter_list, iter)
         {
-        best = LIST_ENTRY(iter, struct clockcounter, node);
+        counter = LIST_ENTRY(iter, struct clockcounter, node);
 
-        if (best && 
-            (best->counter_resolution_ns < 
-            global_clockcounter->counter_resolution_ns))
-            global_clockcounter = best;
+        if (!counter->counter_unstable &&
+            (counter->counter_resolution_ns < best->counter_resolution_ns))
+            best = counter;
         }
     
     CLOCK_COUNTER_LIST_UNLOCK();
+
+    if (best == old)
+        return best;
     
-    global_clockcounter->counter_enable();
+    best->counter_enable();
+
+    timekeeping_set_counter(best);
+
+    global_clockcounter = best;
+
+    if (old && old->counter_disable)
+        old->counter_disable();
+
+    printk("clock counter %s selected\n", best->counter_name);
     
-    return global_clockcounter;
+    return best;
+    }
+
+/*
+ * clockcounter_mark_unstable - stop using a clock counter found unreliable
+ *
+ * If it is the global counter, the best remaining counter takes over from
+ * the time accounted so far.
+ */
+void clockcounter_mark_unstable
+    (
+    struct clockcounter *   counter,
+    const char *            reason
+    )
+    {
+    if (counter->counter_unstable)
+        return;
+
+    counter->counter_unstable = 1;
+
+    printk("clock counter %s is unstable: %s\n", 
+           counter->counter_name, reason);
+
+    if (global_clockcounter == counter)
+        select_global_clockcounter();
     }
 
 void clockcounter_subsystem_init(void)
     {
     list_init(&clockcounter_list);
     spinlock_init(&clockcounter_list_lock);
+
+    seqlock_init(&timekeeper.lock);
     
     clockcounter_add(&clockcounter_pm_timer);
+
+    /* Calibrated against the PM timer, which must be added first */
+    clockcounter_add(&clockcounter_tsc);
     
 #ifdef CONFIG_VMWARE_CLIENT
     clockcounter_add(&clockcounter_pm_counter);
@@ -162,31 +346,35 @@ void clockcounter_subsystem_init(void)
     select_global_clockcounter();
     }
 
+/* Start the wall clock from the RTC */
 void real_wall_time_init(void)
     {
-    real_wall_time.tv_sec = rtc_get_utc_time();
-    real_wall_time.tv_nsec = 0;
-    }
+    abstime_t wall = (abstime_t)rtc_get_utc_time() * NSECS_PER_SEC;
+    ipl_t ipl = interrupts_disable();
 
-void real_wall_time_regular_update(void)
-    {
-    cycle_t last_read;
-    abstime_t eplased;
+    write_seqlock(&timekeeper.lock);
 
-    struct clockcounter * timecounter = global_clockcounter;
+    timekeeping_accumulate();
 
-    if (timecounter == NULL)
-        return;
+    timekeeper.wall_offset = wall - timekeeper.mono_ns;
 
-    last_read = timecounter->counter_latest_read;
+    write_sequnlock(&timekeeper.lock);
 
-    timecounter->counter_latest_read = timecounter->counter_read();
+    interrupts_restore(ipl);
+    }
 
-    eplased = timecounter->counter_time_elapsed(last_read,
-                                        timecounter->counter_latest_read);
+/* Called from the tick, often enough for the counter not to wrap */
+void real_wall_time_regular_update(void)
+    {
+    ipl_t ipl = interrupts_disable();
+
+    write_seqlock(&timekeeper.lock);
+
+    timekeeping_accumulate();
 
-    timespec_add_ns(&real_wall_time, eplased);
+    write_sequnlock(&timekeeper.lock);
 
+    interrupts_restore(ipl);
     }
 
 /*
@@ -217,72 +405,116 @@ void real_wall_time_regular_update(void)
 
 int gettimeofday(struct timeval * tp, void * tzp)
     {
-    cycle_t last;
-    abstime_t eplased;
-    
-    struct clockcounter * timecounter = global_clockcounter;
+    abstime_t offset, now;
 
-    if (timecounter == NULL)
+    if (global_clockcounter == NULL)
         return ENODEV;
+
+    now = timekeeping_read(&offset) + offset;
+
+    tp->tv_sec = now / NSECS_PER_SEC;
+    tp->tv_usec = (now % NSECS_PER_SEC) / 1000;
     
-    last = timecounter->counter_latest_read;
+    return OK;
+    }
 
-    timecounter->counter_latest_read = timecounter->counter_read();
+int getnstimeofday(struct timespec * tp, void * tzp)
+    {
+    abstime_t offset, now;
 
-    eplased = timecounter->counter_time_elapsed(last, 
-                                timecounter->counter_latest_read);
+    if (global_clockcounter == NULL)
+        return ENODEV;
 
-    timespec_add_ns(&real_wall_time, eplased);
+    now = timekeeping_read(&offset) + offset;
 
-    tp->tv_sec = real_wall_time.tv_sec;
-    tp->tv_usec = real_wall_time.tv_nsec / 1000;
+    abstime_to_timespec(now, tp);
     
     return OK;
     }
 
-int getnstimeofday(struct timespec * tp, void * tzp)
+/*
+ * clock_gettime - read CLOCK_REALTIME, CLOCK_MONOTONIC or 
+ * CLOCK_MONOTONIC_RAW
+ *
+ * Nothing slews the counter rate here, so both monotonic clocks follow
+ * the raw counters and only differ from the wall clock by its offset.
+ */
+int clock_gettime(clockid_t clock_id, struct timespec * tp)
     {
-    cycle_t last;
-    abstime_t eplased;
-    
-    struct clockcounter * timecounter = global_clockcounter;
+    abstime_t offset, now;
 
-    if (timecounter == NULL)
+    if (global_clockcounter == NULL)
         return ENODEV;
 
-    last = timecounter->counter_latest_read;
+    switch (clock_id)
+        {
+        case CLOCK_REALTIME:
+            now = timekeeping_read(&offset) + offset;
+            break;
 
-    timecounter->counter_latest_read = timecounter->counter_read();
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_RAW:
+            now = timekeeping_read(NULL);
+            break;
 
-    eplased = timecounter->counter_time_elapsed(last, 
-                                timecounter->counter_latest_read);
+        default:
+            return EINVAL;
+        }
 
-    timespec_add_ns(&real_wall_time, eplased);
+    abstime_to_timespec(now, tp);
+
+    return OK;
+    }
+
+int clock_getres(clockid_t clock_id, struct timespec * res)
+    {
+    if ((clock_id != CLOCK_REALTIME) && (clock_id != CLOCK_MONOTONIC) &&
+        (clock_id != CLOCK_MONOTONIC_RAW))
+        return EINVAL;
+
+    if (global_clockcounter == NULL)
+        return ENODEV;
+
+    if (res)
+        abstime_to_timespec(global_clockcounter->counter_resolution_ns, res);
 
-    tp->tv_sec = real_wall_time.tv_sec;
-    tp->tv_nsec = real_wall_time.tv_nsec;
-    
     return OK;
     }
 
 abstime_t get_now_nanosecond(void)
     {
-    struct timespec now;
-    
-    getnstimeofday(&now, NULL);
+    abstime_t offset;
 
-    return timespec_to_abstime(&now);
+    return timekeeping_read(&offset) + offset;
+    }
+
+/* CLOCK_MONOTONIC in nanoseconds */
+abstime_t get_monotonic_nanosecond(void)
+    {
+    return timekeeping_read(NULL);
+    }
+
+/* CLOCK_REALTIME minus CLOCK_MONOTONIC, in nanoseconds */
+abstime_t get_wall_offset_nanosecond(void)
+    {
+    abstime_t offset;
+
+    timekeeping_read(&offset);
+
+    return offset;
     }
 
 int do_time (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
     {
     struct timeval timev;
     struct timespec times;
+    struct timespec mono;
     
     ipl_t ipl = interrupts_disable();
     
     gettimeofday(&timev, NULL);
     getnstimeofday(&times, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
 
     interrupts_restore(ipl);
 
@@ -291,6 +523,9 @@ int do_time (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
 
     printk("Time in Nano Senconds  (%lld sec: %ld nsec)\n", 
         times.tv_sec, times.tv_nsec);
+
+    printk("Monotonic time         (%lld sec: %ld nsec)\n", 
+        mono.tv_sec, mono.tv_nsec);
     
     return 0;
     }
@@ -299,5 +534,6 @@ CELL_OS_CMD(
     time,   1,        1,    do_time,
     "show current time",
     "show current time (in both nanosecond and microsecond resolution)\n"
+    "and the monotonic time since boot\n"
     );
 
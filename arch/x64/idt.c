@@ -60,6 +60,7 @@ extern void _x64_isr240(void);
 extern void _x64_isr241(void);
 extern void _x64_isr242(void);
 extern void _x64_isr243(void);
+extern void _x64_isr244(void);
 
 extern void _x64_isr_reserved(void);
 void x64_idt_remap_pic(void);
@@ -358,6 +359,7 @@ void x64_idt_init(void)
     x64_idt_set_entry(0xf1,(uint64_t)&_x64_isr241,GDT_SEL_KERNEL_CS,INTR_GATE_FLAGS);
     x64_idt_set_entry(0xf2,(uint64_t)&_x64_isr242,GDT_SEL_KERNEL_CS,INTR_GATE_FLAGS);
     x64_idt_set_entry(0xf3,(uint64_t)&_x64_isr243,GDT_SEL_KERNEL_CS,INTR_GATE_FLAGS);
+    x64_idt_set_entry(0xf4,(uint64_t)&_x64_isr244,GDT_SEL_KERNEL_CS,INTR_GATE_FLAGS);
 
 
     x64_idt_remap_pic();
@@ -2,6 +2,7 @@
 #include <arch.h>
 #include <os.h>
 #include <os/elf.h>
+#include <os/mm_region.h>
 
 static multiboot_info_t *mb_info;
 static multiboot_memmap_t *mb_mmap;
@@ -124,8 +125,8 @@ void mb_parse_kernel_image(void)
     }
 
 /*
- * Scan through the multi boot memory map and return the biggest free map!
- * This is a hack for now that we only support one free area to be used!
+ * Register every range of the multi boot memory map in the physical memory
+ * map and return the biggest free range, or NULL if there is none.
  */
 
 multiboot_memmap_t * mboot_init
@@ -150,6 +151,19 @@ multiboot_memmap_t * mboot_init
 
     mb_show_capability();
 
+    if (!(mb_info->flags & MB_FLAG_MMAP))
+        {
+        /* Only the upper memory size is known, in KB above 1MB */
+
+        if (!(mb_info->flags & MB_FLAG_MEMINFO))
+            return NULL;
+
+        mm_region_add(0x100000, 0x100000 + (uint64_t)mb_info->mem_upper * 1024,
+                      MM_REGION_USABLE);
+
+        return NULL;
+        }
+
     while ((uint64_t)mb_mmap <
             ((uint64_t)PA2KA(mb_info->mmap_addr + mb_info->mmap_length)))
         {
@@ -164,6 +178,7 @@ multiboot_memmap_t * mboot_init
                 biggest = (mb_mmap->length > biggest) ? mb_mmap->length : biggest;
                 if (biggest == mb_mmap->length)
                     biggest_free = mb_mmap;
+                mm_region_add(base, base + length, MM_REGION_USABLE);
                 break;
             case E820_TYPE_RESERVED:
                 type = "RESERVED";
@@ -182,6 +197,9 @@ multiboot_memmap_t * mboot_init
             }
         printk("mmap: %p - %p (%dKb) %s\n",base,base+length,length/1024,type);
 
+        if (mb_mmap->type != E820_TYPE_FREE)
+            mm_region_add(base, base + length, MM_REGION_RESERVED);
+
         size = mb_mmap->size + sizeof(uint32_t);
         mb_mmap = (multiboot_memmap_t *) ((uint64_t)mb_mmap + size);
         }
@@ -72,6 +72,22 @@ extern void _end(void);
 
 static uint64_t first_usable_phys_address,last_usable_phys_address;
 
+/*
+ * With PCIDs, the TLB entries of each page map are tagged with the PCID
+ * it has on the CPU, so that switching page maps does not flush them.
+ * Each CPU hands out its PCIDs in turn; when it runs out, it starts a new
+ * generation and the page maps of older ones get a new PCID, loaded with
+ * a flush, on their next switch. PCID 0 is kept for the boot page map.
+ */
+
+#define PMAP_PCID_MAX   CR3_PCID_MASK
+
+static bool pmap_pcid_enabled = false;
+static bool pmap_invpcid_enabled = false;
+
+/* PDPTEs may map 1GB pages */
+static bool pmap_1g_pages = false;
+
 static inline int x64_get_pml4_index(uint64_t address)
   {
   return (int) (address >> 39) & 511;
@@ -121,13 +137,14 @@ uint64_t x64_get_usable_size(void)
   return last_usable_phys_address - first_usable_phys_address;
   }
 
-/** x64_paging_map - map lower 4GB physical memory space to the kernel
- * virtual address
+/** x64_paging_map - map the physical memory space up to addr, and at least
+ * the lower 4GB, to the kernel virtual address
  */
 void x64_paging_map(uint64_t addr)
     {
     uint64_t lowest_addr;
     uint64_t num_pdirs;
+    uint64_t num_pdir_pages;
     uint64_t num_pdpt;
 
     uint64_t *first_pdpt, *current_pdpt;
@@ -138,6 +155,16 @@ void x64_paging_map(uint64_t addr)
 
     int base_pml4, base_pdpt;
 
+    /* A single PDPT is set up, which maps up to 512GB */
+
+    if (addr > PG_PDP_SIZE)
+        {
+        printk("x64_paging_map: memory above %p is not mapped\n", 
+               PG_PDP_SIZE);
+
+        addr = PG_PDP_SIZE;
+        }
+
     highest_addr = addr;
 
     /* map the lower 4GB */
@@ -169,18 +196,25 @@ void x64_paging_map(uint64_t addr)
     if (highest_addr & (PG_PDP_SIZE - 1))
         num_pdpt ++;
 
+    /* With 1GB pages, the PDPT maps the memory without any PDIR */
+
+    pmap_1g_pages = has_pdpe1gb();
+
+    num_pdir_pages = pmap_1g_pages ? 0 : num_pdirs;
+
     /* Save the actual physical memory heap range */
 
     first_usable_phys_address = lowest_addr
-                           + (num_pdirs * PAGE_SIZE)
+                           + (num_pdir_pages * PAGE_SIZE)
                            + (num_pdpt * PAGE_SIZE);
     last_usable_phys_address = addr;
 
     printk("user available physical RAM %p-%p\n",
         first_usable_phys_address, last_usable_phys_address);
 
-    printk("x64_paging_map: page tables using %d KB\n",
-        ((num_pdirs * PAGE_SIZE)+(num_pdpt * PAGE_SIZE)) / 1024);
+    printk("x64_paging_map: %s pages, page tables using %d KB\n",
+        pmap_1g_pages ? "1GB" : "2MB",
+        ((num_pdir_pages * PAGE_SIZE)+(num_pdpt * PAGE_SIZE)) / 1024);
 
     first_pdpt = (uint64_t*)(PA2KA((uint64_t)lowest_addr));
     first_pdir = (uint64_t*)(PA2KA((uint64_t)lowest_addr) +
@@ -199,10 +233,23 @@ void x64_paging_map(uint64_t addr)
 
         printk("current_pdpt = %p\n",current_pdpt);
 
+        for (k = 0 ; k < PAGE_SIZE/sizeof(uint64_t); k++)
+            current_pdpt[k] = 0;
+
         /* map each PDIR entry */
 
         for (j = 0 ; j < num_pdirs; j++) /* 4 */
             {
+            if (pmap_1g_pages)
+                {
+                current_pdpt[base_pdpt+j] = (uint64_t)address +
+                                (PG_LARGE | PG_PRESENT | PG_WRITE);
+
+                address += PG_PDIR_SIZE; /* 1GB */
+
+                continue;
+                }
+
             current_pdir = (uint64_t*)((uint64_t)first_pdir + (j * PAGE_SIZE));
 
             /* each PDIR has 512 eightbyte PDEs each pointing to a PTBL */
@@ -312,6 +359,28 @@ void paging_init(uint64_t lowest_addr, uint64_t highest_addr)
     address = sys_read_cr3();
 
     printk("new CR3 %p\n", address);
+
+    if (has_pcid())
+        {
+        pmap_pcid_enabled = true;
+        pmap_invpcid_enabled = has_invpcid();
+
+        printk("paging: PCID enabled%s\n",
+               pmap_invpcid_enabled ? ", with INVPCID" : "");
+        }
+
+    pmap_cpu_init();
+    }
+
+/*
+ * pmap_cpu_init - enable the PCIDs on the calling CPU
+ *
+ * CR3 must not have a PCID set yet, i.e. be the boot page map.
+ */
+void pmap_cpu_init(void)
+    {
+    if (pmap_pcid_enabled)
+        sys_write_cr4(sys_read_cr4() | CR4_PCIDE);
     }
 
 void paging_late_init(void)
@@ -337,15 +406,10 @@ void paging_late_init(void)
  
 int pmap_init(pmap_t *map, bool user, cpu_addr_t start, cpu_addr_t end) 
     {
-    int ret;
+    int ret, i;
     pthread_mutex_t mutex;
     pthread_mutexattr_t attr;
 
-    mutex = kmalloc(sizeof(pthread_mutex_t));
-
-    if (!mutex)
-        return ENOMEM;
-    
     pthread_mutexattr_init(&attr);
 
     if ((ret = pthread_mutex_init(&mutex, &attr)) != OK)
@@ -375,6 +439,10 @@ int pmap_init(pmap_t *map, bool user, cpu_addr_t start, cpu_addr_t end)
     map->user = user;
     map->start = start;
     map->end = end;
+    map->active_cpus = 0;
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        map->pcid_gen[i] = 0;
 
     /* Get the kernel mappings into the new PML4 */
         
@@ -393,164 +461,352 @@ int pmap_init(pmap_t *map, bool user, cpu_addr_t start, cpu_addr_t end)
  
 void pmap_destroy (pmap_t *map) 
     {
+    ASSERT(!map->active_cpus);
+
+    /* The mutex goes back to its cache */
     if (map->lock)
-        {
-        pthread_mutex_destroy(map->lock);
-        kfree(map->lock);
-        }
+        pthread_mutex_destroy((pthread_mutex_t *)&map->lock);
     
     page_free(map->pml4v);
     }
 
+/*
+ * Get the CR3 PCID bits of a page map on the current CPU, called with
+ * interrupts disabled. A PCID still valid is loaded without flush, a new
+ * one with a flush of what its previous page map left.
+ */
+
+static uint64_t pmap_pcid_get(pmap_t *map, int cpu)
+    {
+    x64_percpu_t *pcpu = this_percpu();
+
+    if (map->pcid_gen[cpu] == pcpu->pcid_gen)
+        return map->pcid[cpu] | CR3_NOFLUSH;
+
+    if (pcpu->pcid_next > PMAP_PCID_MAX)
+        {
+        pcpu->pcid_gen++;
+        pcpu->pcid_next = 1;
+        }
+
+    map->pcid[cpu] = (uint16_t)pcpu->pcid_next++;
+    map->pcid_gen[cpu] = pcpu->pcid_gen;
+
+    return map->pcid[cpu];
+    }
+
+/*
+ * Invalidate pages of a page map which is not loaded on the current CPU,
+ * but may still have TLB entries under its PCID. Without INVPCID, the
+ * PCID is dropped instead. Called with interrupts disabled.
+ */
+
+void pmap_pcid_invalidate(pmap_t *map, cpu_addr_t *addrs, int nr)
+    {
+    int cpu = this_cpu();
+    int i;
+
+    if (!pmap_pcid_enabled || (map->pcid_gen[cpu] != percpu_read(pcid_gen)))
+        return;
+
+    if (!pmap_invpcid_enabled)
+        {
+        map->pcid_gen[cpu] = 0;
+        return;
+        }
+
+    if (nr > TLB_BATCH_MAX)
+        invpcid(INVPCID_CONTEXT, map->pcid[cpu], 0);
+    else
+        {
+        for (i = 0; i < nr; i++)
+            invpcid(INVPCID_ADDR, map->pcid[cpu], addrs[i]);
+        }
+    }
+
+/*
+ * Drop the PCID of a page map on another CPU, so that the page map gets a
+ * fresh PCID, loaded with a flush, when that CPU switches to it again.
+ */
+
+void pmap_pcid_drop(pmap_t *map, int cpu)
+    {
+    if (pmap_pcid_enabled)
+        map->pcid_gen[cpu] = 0;
+    }
+
 /* 
  * Switch to a different page map.
  *
- * Switches to a different page map.
+ * Switches to a different page map, and moves this CPU from the active
+ * CPUs of the previous page map to those of the new one. The CPU is made
+ * active before the PCID is looked up and CR3 is loaded, so that a
+ * shootdown either sends it an IPI or drops the PCID it is about to use.
  *
  * @param map  Page map to switch to.
  */
  
 void pmap_switch (pmap_t *map) 
     {
-    sys_write_cr3(map->pml4);
+    pmap_t *prev;
+    ipl_t flags;
+    int cpu;
+
+    flags = interrupts_disable();
+
+    cpu = this_cpu();
+    prev = percpu_read(current_pmap);
+
+    if (prev != map)
+        {
+        atomic_set_bit(cpu, &map->active_cpus);
+
+        if (pmap_pcid_enabled)
+            sys_write_cr3(map->pml4 | pmap_pcid_get(map, cpu));
+        else
+            sys_write_cr3(map->pml4);
+
+        if (prev)
+            atomic_clear_bit(cpu, &prev->active_cpus);
+
+        percpu_write(current_pmap, map);
+        }
+
+    interrupts_restore(flags);
     }
 
     
+/* Size mapped by an entry of a paging structure level */
+static inline uint64_t pmap_level_size(int level)
+    {
+    return (uint64_t)PAGE_SIZE << (9 * level);
+    }
+
+static inline int pmap_level_index(ptr_t virt, int level)
+    {
+    return (int)(virt >> (PAGE_SHIFT + 9 * level)) & 511;
+    }
+
+/* Entry pointing to a paging structure of a page map */
+static inline uint64_t pmap_table_entry(pmap_t *map, void *table)
+    {
+    return (uint64_t)(VA2PA(table) |
+                      PG_PRESENT |
+                      PG_WRITE |
+                      ((map->user) ? PG_USER : 0));
+    }
+
+/*
+ * Split a large page into a paging structure of the next smaller pages,
+ * with the same physical range and flags.
+ *
+ * @param map       Page map the large page is in.
+ * @param entry     Entry of the large page.
+ * @param level     Level of the entry, PMAP_PAGE_2M or PMAP_PAGE_1G.
+ *
+ * @return  0 on success, negative error code on failure.
+ */
+
+static int pmap_split(pmap_t *map, uint64_t *entry, int level)
+    {
+    uint64_t size = pmap_level_size(level - 1);
+    uint64_t phys, flags;
+    uint64_t *table;
+    int i;
+
+    table = page_alloc();
+
+    if (!table)
+        return -ENOMEM;
+
+    phys = *entry & PAGE_MASK & ~(pmap_level_size(level) - 1);
+    flags = *entry & ~PAGE_MASK;
+
+    /* Bit 7 is PAT, not the page size, in a PTE */
+
+    if (level - 1 == PMAP_PAGE_4K)
+        flags &= ~(uint64_t)PG_LARGE;
+
+    for (i = 0; i < 512; i++)
+        table[i] = (phys + i * size) | flags;
+
+    /* The table must be complete before the walkers can see it */
+
+    memory_barrier();
+
+    *entry = pmap_table_entry(map, table);
+
+    return 0;
+    }
+
+/* Walk flags */
+#define PMAP_WALK_ALLOC     (1 << 0)    /* Allocate the missing tables */
+#define PMAP_WALK_SPLIT     (1 << 1)    /* Split the large pages on the way */
+
 /* 
- * Get the page table containing an virtual address in the specified page map
+ * Get the entry mapping a virtual address at a level of a page map
+ *
+ * Large pages above the level are split with PMAP_WALK_SPLIT, otherwise
+ * the walk stops on them and returns their entry and level.
  *
  * @param map       Page map to get from.
- * @param virt      Address to get page table for.
- * @param alloc     Whether to allocate structures if not found.
- * @param mmflag    Allocation flags.
- * @param ptblp     Where to store pointer to page table (virtual address).
+ * @param virt      Address to get the entry for.
+ * @param levelp    Level of the entry wanted, PMAP_PAGE_XXX; updated to
+ *                  the level of a large page returned instead.
+ * @param flags     PMAP_WALK_XXX flags.
+ * @param entryp    Where to store pointer to the entry (virtual address).
  *
  * @return  0 on success, negative error code on failure. 
  */
  
-static int pmap_get_ptbl
+static int pmap_walk
     (
     pmap_t *    map, 
     ptr_t       virt, 
-    bool        alloc, 
-    int         mmflag, 
-    uint64_t ** ptblp
+    int *       levelp, 
+    int         flags, 
+    uint64_t ** entryp
     ) 
     {
-    uint64_t *pml4, *pdp, *pdir;
-    int pml4e, pdpe, pde;
-    cpu_addr_t page;
+    uint64_t *table, *entry;
+    void *page;
+    int level, ret;
 
-    /* Get the virtual address of the PML4 */
+    /* Start from the PML4, a PML4 entry covers 512GB */
     
-    pml4 = map->pml4v;
+    table = map->pml4v;
 
-    /* Get the page directory pointer number. A PDP covers 512GB. */
-    
-    pml4e = x64_get_pml4_index(virt);
-
-    /* If the PDP is not present */
-    
-    if (!(pml4[pml4e] & PG_PRESENT)) 
+    for (level = PMAP_PAGE_512G; level > *levelp; level--)
         {
-        /*
-         * Allocate a new PDP if required.
-         */
-         
-        if (alloc) 
-            {
-            page = (cpu_addr_t)page_alloc();
-            
-            if (!page) 
-                {
-                return -ENOMEM;
-                }
+        entry = &table[pmap_level_index(virt, level)];
 
-            /* Map it into the PML4. */
-            
-            pml4[pml4e] = (uint64_t)(VA2PA(page) | 
-                                    PG_PRESENT |
-                                    PG_WRITE | 
-                                    ((map->user) ? PG_USER : 0));
-            } 
-        else 
+        if (!(*entry & PG_PRESENT))
             {
-            return -ENOENT;
-            }
-        }
+            /* Allocate a new paging structure if required. */
 
-    pdp = (uint64_t *)(PA2VA((cpu_addr_t)(pml4[pml4e] & PAGE_MASK)));
+            if (!(flags & PMAP_WALK_ALLOC))
+                return -ENOENT;
 
-    /* Get the page directory number. A page directory covers 1GB. */
-    
-    pdpe = x64_get_pdpt_index(virt);
+            page = page_alloc();
 
-    /* If the pdpt entry is not present */
-    
-    if (!(pdp[pdpe] & PG_PRESENT)) 
-        {
-        /* Allocate a new page directory if required. */
-        
-        if (alloc) 
-            {
-            page = (cpu_addr_t)page_alloc();
-            if (!page) 
-                {
+            if (!page)
                 return -ENOMEM;
-                }
 
-            /* Map it into the PDP. */
-            
-            pdp[pdpe] = (uint64_t)(VA2PA(page) | 
-                                    PG_PRESENT | 
-                                    PG_WRITE | 
-                                    ((map->user) ? PG_USER : 0));
-            } 
-        else
-            {
-            return -ENOENT;
-            }
-        }
+            memset(page, 0, PAGE_SIZE);
 
-    pdir = (uint64_t *)(PA2VA((cpu_addr_t)(pdp[pdpe] & PAGE_MASK)));
+            /* Lockless walkers must see the table cleared */
 
-    /* Get the page table number. A page table covers 2MB. */
-    
-    pde = x64_get_pd_index(virt);
-    
-    if (!(pdir[pde] & PG_PRESENT)) 
-        {
-        /* Allocate a new page table if required. */
-        
-        if (alloc) 
+            write_barrier();
+
+            *entry = pmap_table_entry(map, page);
+            }
+        else if ((level <= PMAP_PAGE_1G) && (*entry & PG_LARGE))
             {
-            page = (cpu_addr_t)page_alloc();
-            
-            if (!page) 
+            if (!(flags & PMAP_WALK_SPLIT))
                 {
-                return -ENOMEM;
+                *levelp = level;
+                *entryp = entry;
+
+                return 0;
                 }
 
-            /* Map it into the page directory. */
-            
-            pdir[pde] = (uint64_t)(VA2PA(page) |
-                                    PG_PRESENT | 
-                                    PG_WRITE | 
-                                    ((map->user) ? PG_USER : 0));
-            } 
-        else 
-            {
-            return -ENOENT;
+            if ((ret = pmap_split(map, entry, level)) != 0)
+                return ret;
             }
+
+        table = (uint64_t *)(PA2VA((cpu_addr_t)(*entry & PAGE_MASK)));
         }
 
-    ASSERT(!(pdir[pde] & PG_LARGE));
-    
-    *ptblp = (uint64_t *)(PA2VA((cpu_addr_t)(pdir[pde] & PAGE_MASK)));
+    *entryp = &table[pmap_level_index(virt, *levelp)];
     
     return 0;
     }
 
+/* 
+ * Look up the entry mapping a virtual address without any lock
+ *
+ * Writers only publish complete paging structures, and free them through
+ * epoch_defer(), so the walk must run in an epoch read section. Each entry
+ * is read once; large pages end the walk.
+ *
+ * @param pml4      PML4 to walk (virtual address).
+ * @param virt      Address to look up.
+ * @param levelp    Where to store the level of the entry found.
+ *
+ * @return  The entry, 0 if the address is not mapped.
+ */
+
+static uint64_t pmap_lookup(uint64_t *pml4, ptr_t virt, int *levelp)
+    {
+    uint64_t *table = pml4;
+    uint64_t entry;
+    int level;
+
+    for (level = PMAP_PAGE_512G; ; level--)
+        {
+        entry = *(volatile uint64_t *)&table[pmap_level_index(virt, level)];
+
+        /* Keep the reads of the next table after this one */
+        barrier();
+
+        if (!(entry & PG_PRESENT))
+            return 0;
+
+        if ((level == PMAP_PAGE_4K) || 
+            ((level <= PMAP_PAGE_1G) && (entry & PG_LARGE)))
+            break;
+
+        table = (uint64_t *)(PA2VA((cpu_addr_t)(entry & PAGE_MASK)));
+        }
+
+    *levelp = level;
+
+    return entry;
+    }
+
+/* Translate an address with pmap_lookup() */
+static bool pmap_lookup_phys(uint64_t *pml4, ptr_t virt, cpu_addr_t *physp)
+    {
+    uint64_t entry, size;
+    int level;
+    ipl_t flags;
+
+    flags = epoch_enter();
+
+    entry = pmap_lookup(pml4, virt, &level);
+
+    epoch_exit(flags);
+
+    if (!entry)
+        return false;
+
+    size = pmap_level_size(level);
+
+    *physp = (entry & PAGE_MASK & ~(size - 1)) | (virt & (size - 1));
+
+    return true;
+    }
+
+/* Free a paging structure once no lockless walker can be in it */
+static void pmap_table_free_deferred(void *table)
+    {
+    page_free(table);
+    }
+
+/* Check that a paging structure maps nothing */
+static bool pmap_table_empty(uint64_t *table)
+    {
+    int i;
+
+    for (i = 0; i < 512; i++)
+        {
+        if (table[i] & PG_PRESENT)
+            return false;
+        }
+
+    return true;
+    }
+
 /* 
  * Convert page map flags to PTE flags.
  *
@@ -572,6 +828,80 @@ static inline uint64_t pmap_flags_to_pte(int prot)
     return ret;
     }
 
+/* Insert a page of a level, called with the page map lock held */
+static int pmap_insert_page
+    (
+    pmap_t *    map,
+    ptr_t       virt,
+    cpu_addr_t  phys,
+    int         level,
+    int         prot
+    )
+    {
+    uint64_t *entry, *table;
+    tlb_batch_t batch;
+    int found = level;
+    int ret;
+
+    /* Check that we can map here. */
+    
+    if (virt < map->start || virt > map->end)
+        {
+        panic("Map on %p outside allowed area", map);
+        }
+
+    /* Find the entry for the page. */
+    
+    if ((ret = pmap_walk(map, virt, &found, PMAP_WALK_ALLOC, &entry)) != 0) 
+        return ret;
+
+    /* Check that the mapping doesn't already exist. */
+    
+    if ((found != level) || 
+        ((*entry & PG_PRESENT) && ((level == PMAP_PAGE_4K) || 
+                                   (*entry & PG_LARGE))))
+        {
+        panic("Mapping %p which is already mapped", virt);
+        }
+
+    /* A large page replaces a paging structure only if it is unused */
+
+    if (*entry & PG_PRESENT)
+        {
+        table = (uint64_t *)(PA2VA((cpu_addr_t)(*entry & PAGE_MASK)));
+
+        if (!pmap_table_empty(table))
+            panic("Mapping %p which is already mapped", virt);
+
+        *entry = 0;
+
+        memory_barrier();
+
+        /* 
+         * The CPUs may still cache the entry pointing at the table in
+         * their paging-structure caches, drop it before the table is
+         * freed. The epoch only keeps the software walkers off it.
+         */
+
+        tlb_batch_init(&batch, map);
+        tlb_batch_add_table(&batch, virt);
+        tlb_batch_flush(&batch);
+
+        epoch_defer(pmap_table_free_deferred, table);
+        }
+
+    /* Map the address in. */
+    
+    *entry = phys | 
+             PG_PRESENT |
+             ((level != PMAP_PAGE_4K) ? PG_LARGE : 0) |
+             ((map->user) ? PG_USER : PG_GLOBAL) | 
+             pmap_flags_to_pte(prot);
+
+    memory_barrier();
+
+    return 0;
+    }
 
 /** Insert a mapping in a page map.
  *
@@ -588,57 +918,88 @@ static inline uint64_t pmap_flags_to_pte(int prot)
  *            fail if MM_SLEEP is not set.
  */
 int pmap_insert(pmap_t *map, ptr_t virt, cpu_addr_t phys, int prot, int mmflag) {
-    uint64_t *ptbl;
-    int pte, ret;
+    int ret;
 
     ASSERT(!(virt % PAGE_SIZE));
     ASSERT(!(phys % PAGE_SIZE));
 
     pthread_mutex_lock((pthread_mutex_t *)map->lock);
 
-    /* Check that we can map here. */
+    ret = pmap_insert_page(map, virt, phys, PMAP_PAGE_4K, prot);
     
-    if (virt < map->start || virt > map->end)
-        {
-        panic("Map on %p outside allowed area", map);
-        }
-
-    /* Find the page table for the entry. */
+    pthread_mutex_unlock((pthread_mutex_t *)map->lock);
     
-    if ((ret = pmap_get_ptbl(map, virt, true, mmflag, &ptbl)) != 0) 
-        {
-        pthread_mutex_unlock((pthread_mutex_t *)map->lock);
-        
-        return ret;
-        }
+    return ret;
+    }
 
-    /* Check that the mapping doesn't already exist. */
-    
-    pte = x64_get_pte_index(virt);
-    
-    if (ptbl[pte] & PG_PRESENT) 
+/** Insert a mapping of a range in a page map.
+ *
+ * Maps a virtual range to a physical range with the biggest pages that
+ * the alignment of both and the length allow: 1GB pages if the CPU has
+ * them, 2MB pages, and 4KB pages for the rest.
+ *
+ * @param map        Page map to insert in.
+ * @param virt       Virtual address to map.
+ * @param phys       Physical address to map to.
+ * @param size       Size of the range.
+ * @param prot       Protection flags.
+ * @param mmflag     Page allocation flags.
+ *
+ * @return        0 on success, negative error code on failure, in which
+ *                case the part of the range already mapped stays mapped.
+ */
+int pmap_insert_range
+    (
+    pmap_t *    map,
+    ptr_t       virt,
+    cpu_addr_t  phys,
+    size_t      size,
+    int         prot,
+    int         mmflag
+    )
+    {
+    uint64_t page_size;
+    int level, ret = 0;
+
+    ASSERT(!(virt % PAGE_SIZE));
+    ASSERT(!(phys % PAGE_SIZE));
+    ASSERT(!(size % PAGE_SIZE));
+
+    pthread_mutex_lock((pthread_mutex_t *)map->lock);
+
+    while (size)
         {
-        panic("Mapping %p which is already mapped", virt);
-        }
+        for (level = pmap_1g_pages ? PMAP_PAGE_1G : PMAP_PAGE_2M; 
+             level > PMAP_PAGE_4K; level--)
+            {
+            page_size = pmap_level_size(level);
 
-    /* Map the address in. */
-    
-    ptbl[pte] = phys | 
-                PG_PRESENT |
-                ((map->user) ? PG_USER : PG_GLOBAL) | 
-                pmap_flags_to_pte(prot);
+            if (!(virt & (page_size - 1)) && 
+                !(phys & (page_size - 1)) &&
+                (size >= page_size))
+                break;
+            }
+
+        page_size = pmap_level_size(level);
+
+        if ((ret = pmap_insert_page(map, virt, phys, level, prot)) != 0)
+            break;
+
+        virt += page_size;
+        phys += page_size;
+        size -= page_size;
+        }
 
-    memory_barrier();
-    
     pthread_mutex_unlock((pthread_mutex_t *)map->lock);
-    
-    return 0;
+
+    return ret;
     }
 
 /* 
  * Remove a mapping from a page map.
  *
- * Removes the mapping at a virtual address from a page map.
+ * Removes the mapping at a virtual address from a page map. A large page
+ * containing the address is split first.
  *
  * @param map    Page map to unmap from.
  * @param virt   Virtual address to unmap.
@@ -650,8 +1011,11 @@ int pmap_insert(pmap_t *map, ptr_t virt, cpu_addr_t phys, int prot, int mmflag)
  
 int pmap_remove(pmap_t *map, ptr_t virt, cpu_addr_t *physp) 
     {
-    uint64_t *ptbl;
-    int pte, ret;
+    int level = PMAP_PAGE_4K;
+    uint64_t *ptbl = NULL;
+    tlb_batch_t batch;
+    uint64_t *pte, *pde;
+    int ret;
 
     ASSERT(!(virt % PAGE_SIZE));
 
@@ -664,31 +1028,61 @@ int pmap_remove(pmap_t *map, ptr_t virt, cpu_addr_t *physp)
         panic("Unmap on %p outside allowed area", map);
         }
 
-    /* Find the page table for the entry. */
+    /* Find the page table entry. */
     
-    if ((ret = pmap_get_ptbl(map, virt, false, 0, &ptbl)) != 0) 
+    if ((ret = pmap_walk(map, virt, &level, PMAP_WALK_SPLIT, &pte)) != 0) 
         {
         pthread_mutex_unlock((pthread_mutex_t *)map->lock);
         
         return ret;
         }
 
-    pte = x64_get_pte_index(virt);
-    
-    if (ptbl[pte] & PG_PRESENT) 
+    if (*pte & PG_PRESENT) 
         {
         /* Store the physical address if required. */
         
         if (physp != NULL) 
             {
-            *physp = ptbl[pte] & PAGE_MASK;
+            *physp = *pte & PAGE_MASK;
             }
 
         /* Clear the entry. */
         
-        ptbl[pte] = 0;
+        *pte = 0;
+
+        /* Unlink the page table if it has no mapping left */
+
+        level = PMAP_PAGE_2M;
+
+        if ((pmap_walk(map, virt, &level, 0, &pde) == 0) &&
+            (level == PMAP_PAGE_2M) && !(*pde & PG_LARGE))
+            {
+            ptbl = (uint64_t *)(PA2VA((cpu_addr_t)(*pde & PAGE_MASK)));
+
+            if (pmap_table_empty(ptbl))
+                *pde = 0;
+            else
+                ptbl = NULL;
+            }
         
         memory_barrier();
+
+        /* 
+         * Invalidate the stale entry on all the CPUs using the map, which
+         * also drops the paging-structure caches of the page table
+         */
+
+        tlb_batch_init(&batch, map);
+
+        if (ptbl)
+            tlb_batch_add_table(&batch, virt);
+        else
+            tlb_batch_add(&batch, virt);
+
+        tlb_batch_flush(&batch);
+
+        if (ptbl)
+            epoch_defer(pmap_table_free_deferred, ptbl);
         
         pthread_mutex_unlock((pthread_mutex_t *)map->lock);
         
@@ -706,7 +1100,8 @@ int pmap_remove(pmap_t *map, ptr_t virt, cpu_addr_t *physp)
  * Get the value of a mapping in a page map.
  *
  * Gets the physical address, if any, that a virtual address is mapped to in
- * a page map.
+ * a page map. The lookup takes no lock, so it may race with a change of
+ * the mapping and return either the old or the new value.
  *
  * @param map        Page map to lookup in.
  * @param virt        Address to find.
@@ -717,34 +1112,27 @@ int pmap_remove(pmap_t *map, ptr_t virt, cpu_addr_t *physp)
  
 bool pmap_find(pmap_t *map, ptr_t virt, cpu_addr_t *physp) 
     {
-    uint64_t *ptbl;
-    int pte;
-
     ASSERT(!(virt % PAGE_SIZE));
     
     ASSERT(physp);
 
-    pthread_mutex_lock((pthread_mutex_t *)map->lock);
+    return pmap_lookup_phys(map->pml4v, virt, physp);
+    }
 
-    /* Find the page table for the entry. */
-    
-    if (pmap_get_ptbl(map, virt, false, 0, &ptbl) == 0) 
-        {
-        pte = x64_get_pte_index(virt);
-        
-        if (ptbl[pte] & PG_PRESENT) 
-            {
-            *physp = ptbl[pte] & PAGE_MASK;
-            
-            pthread_mutex_unlock((pthread_mutex_t *)map->lock);
-            
-            return true;
-            }
-        }
+/* 
+ * Get the value of a mapping in the kernel page map.
+ *
+ * @param virt        Address to find.
+ * @param physp        Where to store mapping's value.
+ *
+ * @return        True if mapping is present, false if not.
+ */
+ 
+bool pmap_kernel_find(ptr_t virt, cpu_addr_t *physp) 
+    {
+    ASSERT(physp);
 
-    pthread_mutex_unlock((pthread_mutex_t *)map->lock);
-    
-    return false;
+    return pmap_lookup_phys((uint64_t *)_boot_pml4, virt, physp);
     }
 
 /* 
@@ -752,7 +1140,8 @@ bool pmap_find(pmap_t *map, ptr_t virt, cpu_addr_t *physp)
  *
  * Modifies the protection flags of a range of pages in a page map. If any of
  * the pages in the range are not mapped, then the function will ignore it and
- * move on to the next.
+ * move on to the next. A large page partly in the range is split, so that
+ * only the part in the range changes.
  *
  * @param map        Map to modify in.
  * @param start      Start of page range.
@@ -764,33 +1153,65 @@ bool pmap_find(pmap_t *map, ptr_t virt, cpu_addr_t *physp)
  
 int pmap_protect(pmap_t *map, ptr_t start, ptr_t end, int prot) 
     {
-    uint64_t *ptbl;
+    tlb_batch_t batch;
+    uint64_t *pte;
+    uint64_t entry, size;
+    int level, ret = 0;
     ptr_t i;
-    int pte;
 
     ASSERT(!(start % PAGE_SIZE));
     ASSERT(!(end % PAGE_SIZE));
 
     pthread_mutex_lock((pthread_mutex_t *)map->lock);
 
-    for (i = start; i < end; i++) 
+    tlb_batch_init(&batch, map);
+
+    for (i = start; i < end; i += pmap_level_size(level)) 
         {
-        pte = x64_get_pte_index(i);
+        level = PMAP_PAGE_4K;
 
-        if (pmap_get_ptbl(map, i, false, 0, &ptbl) != 0 || 
-            !(ptbl[pte] & PG_PRESENT)) 
+        if (pmap_walk(map, i, &level, 0, &pte) != 0 || 
+            !(*pte & PG_PRESENT)) 
             {
+            level = PMAP_PAGE_4K;
             continue;
             }
 
+        /* Split the large page down to what the range covers of it */
+
+        if (level != PMAP_PAGE_4K)
+            {
+            for (; level > PMAP_PAGE_4K; level--)
+                {
+                size = pmap_level_size(level);
+
+                if (!(i & (size - 1)) && (i + size <= end))
+                    break;
+                }
+
+            if ((ret = pmap_walk(map, i, &level, 
+                                 PMAP_WALK_SPLIT, &pte)) != 0)
+                break;
+            }
+
         /* Clear out original flags, and set the new flags. */
         
-        ptbl[pte] = (ptbl[pte] & ~(PG_WRITE | PG_NOEXEC)) |
-                    pmap_flags_to_pte(prot);
+        entry = (*pte & ~(PG_WRITE | PG_NOEXEC)) |
+                pmap_flags_to_pte(prot);
+
+        if (entry != *pte)
+            {
+            *pte = entry;
+
+            tlb_batch_add(&batch, i);
+            }
         }
 
+    memory_barrier();
+
+    tlb_batch_flush(&batch);
+
     pthread_mutex_unlock((pthread_mutex_t *)map->lock);
     
-    return 0;
+    return ret;
     }
-
@@ -0,0 +1,36 @@
+/* percpu.c - X86-64 per-CPU data area management */
+
+#include <sys.h>
+#include <arch.h>
+#include <os.h>
+
+x64_percpu_t x64_percpu_area[CONFIG_NR_CPUS];
+
+/*
+ * percpu_init - bind the calling CPU to its per-CPU block
+ *
+ * Loading a segment selector into GS clears the GS base in 64 bit mode,
+ * so this must be called after the GDT and the segment registers have
+ * been set up for the calling CPU.
+ */
+
+void percpu_init
+    (
+    uint32_t cpu
+    )
+    {
+    x64_percpu_t * pcpu = percpu_of(cpu);
+
+    pcpu->self = pcpu;
+    pcpu->cpu_idx = cpu;
+    pcpu->timer_ticks = 0;
+    pcpu->intr_flags = 0;
+    pcpu->need_resched = 0;
+    pcpu->resched_pending = 0;
+    pcpu->idle_state = SCHED_CPU_IDLE_NONE;
+    pcpu->current_pmap = NULL;
+    pcpu->pcid_next = 1;
+    pcpu->pcid_gen = 1;
+
+    write_msr(MSR_GS_BASE, (uint64_t)pcpu);
+    }
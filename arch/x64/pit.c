@@ -347,7 +347,9 @@ uint64_t calculate_cpu_frequency(void)
 
     /* Calculate the differences between the values. */
     cycles = end - start;
-    ticks = ((ehi << 8) | elo) - ((shi << 8) | slo);
+
+    /* The PIT counts down */
+    ticks = ((shi << 8) | slo) - ((ehi << 8) | elo);
 
     /*
      * Calculate frequency. 
@@ -567,7 +569,9 @@ uint64_t calculate_lapic_frequency(void)
 
     /* Calculate the differences between the values. */
     lticks = 0xFFFFFFFF - end;
-    pticks = ((ehi << 8) | elo) - ((shi << 8) | slo);
+
+    /* The PIT counts down */
+    pticks = ((shi << 8) | slo) - ((ehi << 8) | elo);
 
     /*
      * Calculate frequency. 
@@ -14,6 +14,10 @@ status_t pm_counter_enable(void)
     clockcounter_pm_counter.counter_resolution_ns = 1;
      
     clockcounter_pm_counter.counter_fixup_period = 2 * NSECS_PER_SEC;
+
+    /* Already in nanoseconds */
+    clockcounter_pm_counter.counter_mult = 1;
+    clockcounter_pm_counter.counter_shift = 0;
     
     return OK;
     }
@@ -1,6 +1,7 @@
 #include <sys.h>
 #include <arch.h>
 #include <os.h>
+#include <time.h>
 
 void sched_thread_arch_init
     (
@@ -22,3 +23,108 @@ void sched_thread_arch_post_switch(sched_thread_t * thread)
     {
     
     }
+
+/* Set the TSC frequency of a CPU and its cycles to ns scale factor */
+void sched_cpu_arch_tsc_freq_set
+    (
+    sched_cpu_arch_t *  cpu_arch,
+    uint64_t            tsc_freq_hz
+    )
+    {
+    cpu_arch->tsc_freq_hz = tsc_freq_hz;
+
+    cpu_arch->tsc_scale_factor = 
+            ((uint64_t)NSECS_PER_SEC << 32) / tsc_freq_hz;
+    }
+
+/* Start the periodic scheduling tick of the current CPU on its LAPIC */
+status_t sched_cpu_arch_tick_start (void)
+    {
+    return tick_percpu_start();
+    }
+
+/* 
+ * Stop the periodic scheduling tick of the current CPU and get one 
+ * tick after the specified time instead
+ */
+status_t sched_cpu_arch_tick_stop
+    (
+    uint64_t    sleep_ns
+    )
+    {
+    return tick_percpu_stop((abstime_t)sleep_ns);
+    }
+
+/* SCHED_CPU_IDLE_MWAIT if MONITOR/MWAIT is usable, or SCHED_CPU_IDLE_HALT */
+static int sched_cpu_arch_idle_mode = SCHED_CPU_IDLE_NONE;
+
+/*
+ * Put the current CPU to sleep until an interrupt arrives or another
+ * CPU sets its need_resched word. The sleep state is published before
+ * need_resched is checked, so that sched_cpu_arch_wakeup() either
+ * wakes the monitor, sends an IPI to the halted CPU, or is seen here.
+ *
+ * Called with interrupts disabled, returns with interrupts enabled.
+ */
+void sched_cpu_arch_idle (void)
+    {
+    x64_percpu_t * pcpu = this_percpu();
+
+    if (sched_cpu_arch_idle_mode == SCHED_CPU_IDLE_NONE)
+        {
+        sched_cpu_arch_idle_mode = has_mwait() ? 
+            SCHED_CPU_IDLE_MWAIT : SCHED_CPU_IDLE_HALT;
+        }
+
+    percpu_write(idle_state, sched_cpu_arch_idle_mode);
+
+    if (sched_cpu_arch_idle_mode == SCHED_CPU_IDLE_MWAIT)
+        cpu_monitor(&pcpu->need_resched);
+
+    memory_barrier();
+
+    if (percpu_read(need_resched))
+        interrupts_enable();
+    else if (sched_cpu_arch_idle_mode == SCHED_CPU_IDLE_MWAIT)
+        cpu_sti_mwait(0);
+    else
+        cpu_sti_halt();
+
+    percpu_write(idle_state, SCHED_CPU_IDLE_NONE);
+    }
+
+/*
+ * Wake an idle CPU: the need_resched write alone wakes a CPU in MWAIT,
+ * a CPU in HLT also needs the reschedule IPI.
+ */
+void sched_cpu_arch_wakeup
+    (
+    uint32_t    cpu_idx
+    )
+    {
+    x64_percpu_t * pcpu = percpu_of(cpu_idx);
+
+    *(volatile uint64_t *)&pcpu->need_resched = 1;
+
+    memory_barrier();
+
+    if (*(volatile uint64_t *)&pcpu->idle_state == SCHED_CPU_IDLE_HALT)
+        lapic_ipi(cpu_idx, 0, INTR_LAPIC_RESCHEDULE);
+    }
+
+/*
+ * Ask a busy CPU to reschedule. Only the first request sends an IPI,
+ * later ones are folded into it until lapic_reschedule_handler() clears
+ * resched_pending on that CPU. This is kept apart from need_resched,
+ * which the idle wakeups may leave set while the CPU runs threads.
+ */
+void sched_cpu_arch_resched
+    (
+    uint32_t    cpu_idx
+    )
+    {
+    x64_percpu_t * pcpu = percpu_of(cpu_idx);
+
+    if (xchg(&pcpu->resched_pending, 1) == 0)
+        lapic_ipi(cpu_idx, 0, INTR_LAPIC_RESCHEDULE);
+    }
@@ -284,6 +284,8 @@ void smp_init(void)
             /* Once AP starts up it will set smp_ap_booted to none zero */
             
             while (smp_ap_booted == 0);
+
+            tsc_sync_source(i);
             }
         }
     }
@@ -325,6 +327,8 @@ void smp_ap_ready (void)
     off = offset;
     smp_ap_booted = 1;
 
+    tsc_sync_target();
+
     again:
 
         if (bsp_apic_init_done == 1)
@@ -358,14 +362,23 @@ void smp_ap_entry_point(void)
     {
     size_t *new_stack;
 
-    printk("ok\n");
-
     /* load the GDT */
     x64_gdt_ap_init();
 
     /* load an IDT */
     x64_idt_ap_init();
 
+    /* 
+     * Point GS base at the per-CPU block of this AP, this must be done
+     * before any spinlock (e.g. the printk one) may be contended here.
+     */
+    percpu_init(lapic_id());
+
+    /* Same paging features as the BSP, e.g. PCIDs */
+    pmap_cpu_init();
+
+    printk("ok\n");
+
     new_stack = (size_t*) page_alloc();
     if (!new_stack)
         {
@@ -0,0 +1,117 @@
+/* spinlock.c - X86-64 queued spinlock slow path */
+
+#include <sys.h>
+#include <arch.h>
+#include <os.h>
+
+typedef struct qspinlock_node
+    {
+    /* Next waiter in the queue */
+    struct qspinlock_node * volatile next;
+
+    /* Set by the previous waiter when we become the queue head */
+    volatile int locked;
+
+    /* Nodes in use on this cpu, only kept in the first node */
+    int count;
+    } __attribute__((aligned(X64_CACHE_LINE_SIZE))) qspinlock_node_t;
+
+static qspinlock_node_t 
+    qspinlock_nodes[CONFIG_NR_CPUS][QSPINLOCK_NODES_PER_CPU];
+
+/*
+ * queued_spinlock_slowpath - wait for a contended queued spinlock
+ *
+ * The caller is appended to the queue of the lock with its own node and 
+ * spins on it until the previous waiter hands the queue head over. The
+ * queue head then waits for the owner to release the lock and takes it;
+ * only the queue head may take the lock while the queue is not empty, 
+ * since the fast path only succeeds on a zero lock word.
+ *
+ * Interrupts are disabled while the node is in use, so that the waiter
+ * can neither be preempted on its queue nor moved to another cpu, which
+ * would let another thread of the cpu take the same node or leave the
+ * queue blocked behind a waiter which is switched out.
+ */
+
+void queued_spinlock_slowpath
+    (
+    spinlock_t *lock
+    )
+    {
+    qspinlock_node_t * node;
+    qspinlock_node_t * prev;
+    qspinlock_node_t * next;
+    unsigned int val;
+    uint16_t tail;
+    uint16_t old;
+    ipl_t ipl;
+    id_t cpu;
+    int idx;
+
+    ipl = interrupts_disable();
+
+    cpu = this_cpu();
+
+    idx = qspinlock_nodes[cpu][0].count++;
+
+    /* Nested too deep in interrupts, spin on the lock word instead */
+    if (idx >= QSPINLOCK_NODES_PER_CPU)
+        {
+        while (queued_spinlock_trylock(lock) != 0)
+            cpu_relax();
+
+        goto release;
+        }
+
+    node = &qspinlock_nodes[cpu][idx];
+    node->next = NULL;
+    node->locked = 0;
+
+    tail = QSPINLOCK_TAIL(cpu, idx);
+
+    /* The node must be initialized before others can see it */
+    barrier();
+
+    old = (uint16_t)xchg_16((void *)&lock->tail, tail);
+
+    /* Wait behind the previous waiter until we are the queue head */
+    if (old)
+        {
+        prev = &qspinlock_nodes[QSPINLOCK_TAIL_CPU(old)][QSPINLOCK_TAIL_IDX(old)];
+
+        prev->next = node;
+
+        while (!node->locked)
+            cpu_relax();
+        }
+
+    /* Wait for the owner to release the lock */
+    while (lock->locked)
+        cpu_relax();
+
+    /* If we are the last waiter, clear the tail as we take the lock */
+    while (TRUE)
+        {
+        val = lock->counter;
+
+        if ((val >> 16) != tail)
+            break;
+
+        if (cmpxchg(&lock->counter, val, QSPINLOCK_LOCKED) == val)
+            goto release;
+        }
+
+    lock->locked = QSPINLOCK_LOCKED;
+
+    /* Someone queued behind us, wait for the link and hand over the head */
+    while ((next = node->next) == NULL)
+        cpu_relax();
+
+    next->locked = 1;
+
+release:
+    qspinlock_nodes[cpu][0].count--;
+
+    interrupts_restore(ipl);
+    }
@@ -0,0 +1,268 @@
+/* tlb.c - X86-64 TLB shootdown */
+
+#include <sys.h>
+#include <arch.h>
+#include <os.h>
+
+/*
+ * A shootdown is posted in tlb_shootdown by its initiator, which then
+ * sends INTR_LAPIC_TLB to the target CPUs and spins until each of them
+ * has cleared its bit in the pending mask. Only one shootdown is in
+ * flight at a time. The initiator runs with interrupts disabled, so
+ * while it waits for the shootdown lock it serves the requests posted
+ * for its own CPU, which could otherwise never be acknowledged.
+ *
+ * Kernel page maps (not user) are mapped global and active on every
+ * online CPU; a user page map is active on the CPUs that switched to it.
+ * With PCIDs, the other CPUs may still hold entries of a user page map
+ * under its PCID: they drop that PCID instead of being interrupted.
+ *
+ * INVLPG only drops the paging-structure caches of the current PCID, but
+ * the global kernel entries are cached under every PCID. When paging
+ * structures of a kernel page map are unlinked, each CPU thus toggles
+ * CR4.PGE, which drops the TLBs and paging-structure caches of all the
+ * PCIDs, before the structures may be freed.
+ */
+
+typedef struct tlb_shootdown
+    {
+    /* CPUs which have not flushed yet */
+    volatile unsigned long  pending;
+
+    pmap_t *                map;
+    int                     nr;
+    cpu_addr_t *            addrs;
+    bool                    tables;
+    } tlb_shootdown_t;
+
+static tlb_shootdown_t      tlb_shootdown;
+static SPINLOCK_DECLARE(tlb_shootdown_lock);
+
+/* CPUs able to take the shootdown IPI */
+static volatile unsigned long tlb_online_cpus = 0;
+
+static atomic64_t tlb_nr_shootdowns = ATOMIC64_INIT(0);
+static atomic64_t tlb_nr_ipis = ATOMIC64_INIT(0);
+static atomic64_t tlb_nr_full_flushes = ATOMIC64_INIT(0);
+
+/* Invalidate pages of a page map on this CPU, with interrupts disabled */
+static void tlb_invalidate_local
+    (
+    pmap_t *        map,
+    cpu_addr_t *    addrs,
+    int             nr,
+    bool            tables
+    )
+    {
+    uint64_t cr4;
+    int i;
+
+    /* A user page map not loaded here may only be cached under its PCID */
+
+    if (map->user && (percpu_read(current_pmap) != map))
+        {
+        pmap_pcid_invalidate(map, addrs, nr);
+        return;
+        }
+
+    if ((nr <= TLB_BATCH_MAX) && (map->user || !tables))
+        {
+        for (i = 0; i < nr; i++)
+            invlpg(addrs[i]);
+
+        return;
+        }
+
+    /* 
+     * A CR3 reload keeps the global entries and the other PCIDs, any
+     * change of CR4.PGE drops everything
+     */
+
+    if (map->user)
+        sys_write_cr3(sys_read_cr3() & ~CR3_NOFLUSH);
+    else
+        {
+        cr4 = sys_read_cr4();
+
+        sys_write_cr4(cr4 ^ CR4_PGE);
+        sys_write_cr4(cr4);
+        }
+
+    atomic64_inc(&tlb_nr_full_flushes);
+    }
+
+/* Serve the shootdown posted for this CPU, if any */
+static void tlb_shootdown_serve (void)
+    {
+    int cpu = this_cpu();
+
+    if (!(tlb_shootdown.pending & (1UL << cpu)))
+        return;
+
+    tlb_invalidate_local(tlb_shootdown.map, tlb_shootdown.addrs,
+                         tlb_shootdown.nr, tlb_shootdown.tables);
+
+    atomic_clear_bit(cpu, &tlb_shootdown.pending);
+    }
+
+void tlb_shootdown_handler
+    (
+    uint64_t    stack_frame
+    )
+    {
+    lapic_write(LAPIC_EOI, 0);
+
+    tlb_shootdown_serve();
+    }
+
+/* tlb_cpu_online - let the calling CPU take shootdowns, interrupts are on */
+void tlb_cpu_online (void)
+    {
+    atomic_set_bit(this_cpu(), &tlb_online_cpus);
+    }
+
+void tlb_batch_init
+    (
+    tlb_batch_t *   batch,
+    pmap_t *        map
+    )
+    {
+    batch->map = map;
+    batch->nr = 0;
+    batch->tables = false;
+    }
+
+void tlb_batch_add
+    (
+    tlb_batch_t *   batch,
+    cpu_addr_t      virt
+    )
+    {
+    if (batch->nr < TLB_BATCH_MAX)
+        batch->addrs[batch->nr] = virt;
+
+    if (batch->nr <= TLB_BATCH_MAX)
+        batch->nr++;
+    }
+
+/*
+ * tlb_batch_add_table - add the range of a paging structure unlinked from
+ * the page map, which must not be freed before the batch is flushed
+ */
+void tlb_batch_add_table
+    (
+    tlb_batch_t *   batch,
+    cpu_addr_t      virt
+    )
+    {
+    batch->tables = true;
+
+    tlb_batch_add(batch, virt);
+    }
+
+/*
+ * tlb_batch_flush - invalidate the pages of a batch on all the CPUs which
+ * may cache them, and wait until they did
+ *
+ * Must be called after the page table entries were changed, and before
+ * the pages they referred to are reused.
+ */
+void tlb_batch_flush
+    (
+    tlb_batch_t *   batch
+    )
+    {
+    bool global = !batch->map->user;
+    unsigned long targets;
+    ipl_t flags;
+    int cpu, i;
+
+    if (!batch->nr)
+        return;
+
+    flags = interrupts_disable();
+
+    cpu = this_cpu();
+
+    tlb_invalidate_local(batch->map, batch->addrs, batch->nr, batch->tables);
+
+    /* Drop the PCIDs before the active CPUs are read, see pmap_switch() */
+
+    if (!global)
+        {
+        for (i = 0; i < CONFIG_NR_CPUS; i++)
+            {
+            if (i != cpu)
+                pmap_pcid_drop(batch->map, i);
+            }
+        }
+
+    memory_barrier();
+
+    targets = (global ? tlb_online_cpus : batch->map->active_cpus) &
+              ~(1UL << cpu);
+
+    if (targets)
+        {
+        while (spinlock_trylock(&tlb_shootdown_lock) != 0)
+            {
+            tlb_shootdown_serve();
+
+            cpu_relax();
+            }
+
+        /* CPUs which switched to the map meanwhile reloaded CR3 */
+
+        targets = (global ? tlb_online_cpus : batch->map->active_cpus) &
+                  ~(1UL << cpu);
+
+        tlb_shootdown.map = batch->map;
+        tlb_shootdown.addrs = batch->addrs;
+        tlb_shootdown.nr = batch->nr;
+        tlb_shootdown.tables = batch->tables;
+
+        memory_barrier();
+
+        tlb_shootdown.pending = targets;
+
+        for (i = 0; i < CONFIG_NR_CPUS; i++)
+            {
+            if (targets & (1UL << i))
+                {
+                lapic_ipi(i, 0, INTR_LAPIC_TLB);
+
+                atomic64_inc(&tlb_nr_ipis);
+                }
+            }
+
+        while (tlb_shootdown.pending)
+            cpu_relax();
+
+        spinlock_unlock(&tlb_shootdown_lock);
+
+        atomic64_inc(&tlb_nr_shootdowns);
+        }
+
+    interrupts_restore(flags);
+
+    batch->nr = 0;
+    batch->tables = false;
+    }
+
+int do_tlb (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    printk("online cpus %p, %lld shootdowns, %lld IPIs, %lld full flushes\n",
+        tlb_online_cpus,
+        (long long)atomic64_read(&tlb_nr_shootdowns),
+        (long long)atomic64_read(&tlb_nr_ipis),
+        (long long)atomic64_read(&tlb_nr_full_flushes));
+
+    return 0;
+    }
+
+CELL_OS_CMD(
+    tlb,   1,        1,    do_tlb,
+    "show TLB shootdown statistics",
+    "show the CPUs taking TLB shootdowns, and the number of shootdowns,\n"
+    "of IPIs sent and of full TLB flushes\n"
+    );
@@ -0,0 +1,286 @@
+/* tsc.c - X86-64 TSC clock counter */
+
+#include <sys.h>
+#include <arch.h>
+#include <os.h>
+#include <os/acpi.h>
+
+extern uint64_t calculate_cpu_frequency(void);
+
+/* Calibration results, kept for the tsc command */
+static uint64_t tsc_pit_hz;
+static uint64_t tsc_pm_timer_hz;
+
+/* Synchronization check state, one AP is checked at a time */
+static SPINLOCK_DECLARE(tsc_sync_lock);
+static uint64_t tsc_sync_last;
+static uint64_t tsc_sync_max_warp;
+static int      tsc_sync_warps;
+static atomic_t tsc_sync_start;
+static atomic_t tsc_sync_stop;
+
+/*
+ * Count the TSC cycles elapsed over TSC_CALIBRATE_PM_TICKS PM timer ticks.
+ * Gives up after 'timeout' cycles if the PM timer does not move.
+ */
+static uint64_t tsc_calibrate_pm_timer
+    (
+    uint64_t    timeout
+    )
+    {
+    cycle_t mask, pm_start, ticks;
+    uint64_t tsc_start, tsc_end;
+    ipl_t ipl;
+
+    if (!clockcounter_pm_timer.counter_bits)
+        return 0;
+
+    mask = (1ULL << clockcounter_pm_timer.counter_bits) - 1;
+
+    ipl = interrupts_disable();
+
+    pm_start = clockcounter_pm_timer.counter_read();
+    tsc_start = rdtsc();
+
+    do
+        {
+        ticks = (clockcounter_pm_timer.counter_read() - pm_start) & mask;
+        tsc_end = rdtsc();
+        }
+    while ((ticks < TSC_CALIBRATE_PM_TICKS) &&
+           (tsc_end - tsc_start < timeout));
+
+    interrupts_restore(ipl);
+
+    if (ticks < TSC_CALIBRATE_PM_TICKS)
+        return 0;
+
+    return ((tsc_end - tsc_start) * PM_TIMER_FREQUENCY) / ticks;
+    }
+
+/*
+ * Calibrate the TSC the first time it is enabled. The PM timer result is
+ * preferred over the PIT one as it is measured over a longer period.
+ */
+static status_t tsc_counter_enable(void)
+    {
+    uint64_t hz, diff;
+
+    if (clockcounter_tsc.counter_unstable)
+        return ERROR;
+
+    if (clockcounter_tsc.counter_frequency_hz)
+        return OK;
+
+    if (!has_invariant_tsc())
+        {
+        printk("TSC is not invariant\n");
+
+        return ERROR;
+        }
+
+    /* The BSP has already calibrated its TSC against the PIT */
+    tsc_pit_hz = kurrent_cpu ? kurrent_cpu->cpu_arch.tsc_freq_hz : 0;
+
+    if (!tsc_pit_hz)
+        tsc_pit_hz = calculate_cpu_frequency();
+
+    tsc_pm_timer_hz =
+        tsc_calibrate_pm_timer(tsc_pit_hz ? tsc_pit_hz : ~0ULL);
+
+    hz = tsc_pm_timer_hz ? tsc_pm_timer_hz : tsc_pit_hz;
+
+    if (!hz)
+        {
+        printk("TSC calibration failed\n");
+
+        return ERROR;
+        }
+
+    if (tsc_pit_hz && tsc_pm_timer_hz)
+        {
+        diff = (tsc_pit_hz > tsc_pm_timer_hz) ?
+               tsc_pit_hz - tsc_pm_timer_hz : tsc_pm_timer_hz - tsc_pit_hz;
+
+        if (diff * TSC_CALIBRATE_MAX_DIFF > hz)
+            printk("TSC calibrations disagree: PIT %lld Hz, PM timer %lld Hz\n",
+                   tsc_pit_hz, tsc_pm_timer_hz);
+        }
+
+    clockcounter_calc_mult_shift(&clockcounter_tsc.counter_mult,
+                                 &clockcounter_tsc.counter_shift,
+                                 hz, NSECS_PER_SEC, TSC_MAX_DELTA_SECS);
+
+    clockcounter_tsc.counter_bits = 64;
+
+    clockcounter_tsc.counter_resolution_ns = NSECS_PER_SEC / hz;
+
+    if (!clockcounter_tsc.counter_resolution_ns)
+        clockcounter_tsc.counter_resolution_ns = 1;
+
+    clockcounter_tsc.counter_fixup_period =
+        (abstime_t)TSC_MAX_DELTA_SECS * NSECS_PER_SEC;
+
+    clockcounter_tsc.counter_frequency_hz = hz;
+
+    /* Account thread time with the better calibration from now on */
+    if (kurrent_cpu)
+        {
+        ipl_t ipl = interrupts_disable();
+
+        sched_cpu_arch_tsc_freq_set(&kurrent_cpu->cpu_arch, hz);
+
+        interrupts_restore(ipl);
+        }
+
+    printk("TSC runs at %lld Hz, mult %d shift %d\n",
+           hz, clockcounter_tsc.counter_mult, clockcounter_tsc.counter_shift);
+
+    return OK;
+    }
+
+static status_t tsc_counter_disable(void)
+    {
+    return OK;
+    }
+
+/* Read the current time counter value (masked by the counter bits ) */
+
+static cycle_t tsc_counter_read(void)
+    {
+    return (cycle_t)rdtsc();
+    }
+
+/* Caculate the time elapsed in nanoseconds */
+
+static abstime_t tsc_counter_time_elapsed(cycle_t t1, cycle_t t2)
+    {
+    return clockcounter_cyc2ns(&clockcounter_tsc,
+                               clockcounter_delta(&clockcounter_tsc, t1, t2));
+    }
+
+struct clockcounter clockcounter_tsc =
+    {
+    .counter_name = "TSC",
+    .counter_enable = tsc_counter_enable,
+    .counter_disable = tsc_counter_disable,
+    .counter_read = tsc_counter_read,
+    .counter_time_elapsed = tsc_counter_time_elapsed,
+    };
+
+/*
+ * Both CPUs take turns reading the TSC under a lock; a value lower than
+ * the previous one, read by either CPU, means the TSCs are not in sync.
+ */
+static void tsc_sync_warp_check(void)
+    {
+    uint64_t prev, now;
+    int i;
+
+    for (i = 0; i < TSC_SYNC_LOOPS; i++)
+        {
+        spinlock_lock(&tsc_sync_lock);
+
+        prev = tsc_sync_last;
+        now = rdtsc_ordered();
+        tsc_sync_last = now;
+
+        if (prev > now)
+            {
+            tsc_sync_warps++;
+
+            if (prev - now > tsc_sync_max_warp)
+                tsc_sync_max_warp = prev - now;
+            }
+
+        spinlock_unlock(&tsc_sync_lock);
+        }
+    }
+
+/*
+ * tsc_sync_source - check the TSC of an AP against the one of this CPU
+ *
+ * Called by the BSP once the AP has signalled it is up, while the AP runs
+ * tsc_sync_target(). The TSC stops being used as clock counter if the two
+ * are found out of sync.
+ */
+void tsc_sync_source
+    (
+    int     cpu
+    )
+    {
+    if (!has_invariant_tsc() || clockcounter_tsc.counter_unstable)
+        return;
+
+    atomic_inc(&tsc_sync_start);
+
+    while (atomic_read(&tsc_sync_start) != 2)
+        cpu_relax();
+
+    tsc_sync_warp_check();
+
+    atomic_inc(&tsc_sync_stop);
+
+    while (atomic_read(&tsc_sync_stop) != 2)
+        cpu_relax();
+
+    if (tsc_sync_warps)
+        {
+        printk("TSC of cpu%d warps by up to %lld cycles\n",
+               cpu, tsc_sync_max_warp);
+
+        clockcounter_mark_unstable(&clockcounter_tsc,
+                                   "TSCs are not synchronized");
+        }
+
+    tsc_sync_last = 0;
+    tsc_sync_max_warp = 0;
+    tsc_sync_warps = 0;
+
+    /* Resetting the stop count releases the AP */
+    atomic_set(&tsc_sync_start, 0);
+    write_barrier();
+    atomic_set(&tsc_sync_stop, 0);
+    }
+
+/* tsc_sync_target - the AP side of tsc_sync_source() */
+void tsc_sync_target (void)
+    {
+    if (!has_invariant_tsc() || clockcounter_tsc.counter_unstable)
+        return;
+
+    atomic_inc(&tsc_sync_start);
+
+    while (atomic_read(&tsc_sync_start) != 2)
+        cpu_relax();
+
+    tsc_sync_warp_check();
+
+    atomic_inc(&tsc_sync_stop);
+
+    while (atomic_read(&tsc_sync_stop) != 0)
+        cpu_relax();
+    }
+
+int do_tsc (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    printk("invariant %s, %s\n", has_invariant_tsc() ? "yes" : "no",
+           clockcounter_tsc.counter_unstable ? "unstable" : "stable");
+
+    printk("%lld Hz (PIT %lld Hz, PM timer %lld Hz), mult %d shift %d\n",
+           clockcounter_tsc.counter_frequency_hz, tsc_pit_hz,
+           tsc_pm_timer_hz, clockcounter_tsc.counter_mult,
+           clockcounter_tsc.counter_shift);
+
+    printk("clock counter in use: %s\n", global_clockcounter ?
+           global_clockcounter->counter_name : "none");
+
+    return 0;
+    }
+
+CELL_OS_CMD(
+    tsc,   1,        1,    do_tsc,
+    "show the TSC clock counter",
+    "show whether the TSC is invariant and in sync across CPUs, its\n"
+    "calibrated frequency and the clock counter in use\n"
+    );
@@ -542,7 +542,7 @@ AcpiOsCreateSemaphore (
         return (AE_BAD_PARAMETER);
     }
 
-    Sem = AcpiOsAllocate (sizeof (sem_t));
+    Sem = kmem_cache_alloc (&sched_sem_cache);
 
     if (!Sem)
     {
@@ -551,7 +551,7 @@ AcpiOsCreateSemaphore (
 
     if (sem_init (Sem, 0, InitialUnits) == -1)
     {
-        AcpiOsFree (Sem);
+        kmem_cache_free (&sched_sem_cache, Sem);
         return (AE_BAD_PARAMETER);
     }
 
@@ -589,7 +589,7 @@ AcpiOsDeleteSemaphore (
         return (AE_BAD_PARAMETER);
     }
 
-    AcpiOsFree(Sem);
+    kmem_cache_free (&sched_sem_cache, Sem);
     
     return (AE_OK);
 }
@@ -18,11 +18,14 @@
 #include <arch/x86/x64/barrier.h>
 #include <arch/x86/x64/spinlock.h>
 #include <arch/x86/x64/smp.h>
+#include <arch/x86/x64/percpu.h>
 #include <arch/x86/x64/apic.h>
 #include <arch/x86/x64/interrupt.h>
 #include <arch/x86/x64/multiboot.h>
 #include <arch/x86/x64/segment.h>
 #include <arch/x86/x64/paging.h>
+#include <arch/x86/x64/tlb.h>
+#include <arch/x86/x64/tsc.h>
 #include <arch/x86/x64/context.h>
 #include <arch/x86/x64/msr.h>
 #include <arch/x86/x64/sched_arch.h>
@@ -330,4 +330,50 @@ static inline int find_last_bit_set
     return r + 1;
     }
 
+/*
+ * find_first_bit_set64 - find first set bit in 64 bit word
+ *
+ * NOTE:
+ *
+ * find_first_bit_set64(value) returns 0 if value is 0 or the position
+ * of the first set bit if value is nonzero. The first (least significant)
+ * bit is at position 1.
+ */
+static inline int find_first_bit_set64
+    (
+    uint64_t x
+    )
+    {
+    long r;
+
+    asm("bsfq %1,%0\n\t"
+        "cmovzq %2,%0"
+        : "=&r" (r) : "rm" (x), "rm" (-1L));
+
+    return (int)r + 1;
+    }
+
+/*
+ * find_last_bit_set64 - find last set bit in 64 bit word
+ *
+ * NOTE:
+ *
+ * find_last_bit_set64(value) returns 0 if value is 0 or the position
+ * of the last set bit if value is nonzero. The last (most significant)
+ * bit is at position 64.
+ */
+static inline int find_last_bit_set64
+    (
+    uint64_t x
+    )
+    {
+    long r;
+
+    asm("bsrq %1,%0\n\t"
+        "cmovzq %2,%0"
+        : "=&r" (r) : "rm" (x), "rm" (-1L));
+
+    return (int)r + 1;
+    }
+
 #endif /* _ARCH_X86_COMMON_BITOPS_H */
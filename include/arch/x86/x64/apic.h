@@ -80,6 +80,7 @@
 #define    LAPIC_TIMER_BASE_TMBASE       0x1
 #define    LAPIC_TIMER_BASE_DIV          0x2
 #define    LAPIC_LVT_TIMER_PERIODIC      (1 << 17) /* MODE: 0=one-shot 1=periodic */
+#define    LAPIC_LVT_TIMER_TSC_DEADLINE  (2 << 17) /* MODE: 2=TSC-deadline */
 #define    LAPIC_LVT_MASKED              (1 << 16) /* MASK: 0=unmasked 1=masked */
 #define    LAPIC_LVT_BUSY                (1 << 12) /* BUSY: 0=not busy 1=busy */
 #define    LAPIC_LVT_INTR_ID_MASK        (0xFF) /* Interrupt ID-number */
@@ -157,7 +158,8 @@ uint8_t lapic_id(void);
 void lapic_ipi(uint32_t dest, uint32_t type, uint8_t vec);
 void lapic_write(uint32_t offset, uint32_t value);
 uint32_t lapic_read(uint32_t offset);
-#define this_cpu() lapic_id()
+void lapic_timer_periodic_start(uint64_t period_ns);
+void lapic_timer_one_shot_start(uint64_t ns);
 #endif /* __ASM__ */
 
 #endif /* _ARCH_X86_APIC_H */
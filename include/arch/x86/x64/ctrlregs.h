@@ -143,6 +143,8 @@ static inline bool interrupts_disabled(void)
  */
 #define CR3_PCD     (1 << 4) /* PCD Page-level Cache Disable (bit 4 of CR3) */
 #define CR3_PWT     (1 << 3) /* PWT Page-level Write-Through (bit 3 of CR3) */
+#define CR3_PCID_MASK   0xFFF /* PCID Process-Context Identifier (bits 11:0 of CR3) */
+#define CR3_NOFLUSH ((uint64_t)1 << 63) /* Keep the TLB entries of the PCID on load */
 
 #define CR4_VME     (1 << 0) /* VME Virtual-8086 Mode Extensions (bit 0 of CR4) */
 #define CR4_PVI     (1 << 1) /* PVI Protected-Mode Virtual Interrupts (bit 1 of CR4) */
@@ -159,6 +161,7 @@ static inline bool interrupts_disabled(void)
                                    * Floating-Point Exceptions (bit 10 of CR4) */
 #define CR4_VMXE    (1 << 13) /* VMXE VMX-Enable Bit (bit 13 of CR4) */
 #define CR4_SMXE    (1 << 14) /* SMXE SMX-Enable Bit (bit 14 of CR4) */
+#define CR4_PCIDE   (1 << 17) /* PCIDE PCID-Enable Bit (bit 17 of CR4) */
 #define CR4_OSXSAVE (1 << 18) /* OSXSAVE XSAVE and Processor Extended States-Enable
                                 * Bit (bit 18 of CR4) */
 
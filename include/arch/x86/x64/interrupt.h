@@ -25,6 +25,7 @@
 #define INTR_LAPIC_SPURIOUS     0xf1    /* Spurious */
 #define INTR_LAPIC_IPI          0xf2     /* IPI message */
 #define INTR_LAPIC_RESCHEDULE   0xf3     /* Reschedule */
+#define INTR_LAPIC_TLB          0xf4     /* TLB shootdown */
 
 /** Enable interrupts.
  * @return        Previous interrupt state. */
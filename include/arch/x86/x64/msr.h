@@ -46,6 +46,7 @@
 
 #define MSR_IA32_PEBS_ENABLE        0x000003f1
 #define MSR_IA32_DS_AREA        0x00000600
+#define MSR_IA32_TSC_DEADLINE        0x000006e0
 #define MSR_IA32_PERF_CAPABILITIES    0x00000345
 
 #define MSR_MTRRfix64K_00000        0x00000250
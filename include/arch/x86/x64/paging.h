@@ -7,6 +7,73 @@ void paging_init
     uint64_t highest_addr
     );
 void paging_late_init(void);
+void pmap_cpu_init(void);
+
+struct pmap;
+
+int pmap_init
+    (
+    struct pmap *   map,
+    bool            user,
+    cpu_addr_t      start,
+    cpu_addr_t      end
+    );
+
+void pmap_destroy
+    (
+    struct pmap *   map
+    );
+
+int pmap_remove
+    (
+    struct pmap *   map,
+    ptr_t           virt,
+    cpu_addr_t *    physp
+    );
+
+int pmap_protect
+    (
+    struct pmap *   map,
+    ptr_t           start,
+    ptr_t           end,
+    int             prot
+    );
+
+void pmap_pcid_invalidate
+    (
+    struct pmap *   map,
+    cpu_addr_t *    addrs,
+    int             nr
+    );
+
+void pmap_pcid_drop
+    (
+    struct pmap *   map,
+    int             cpu
+    );
+
+bool pmap_find
+    (
+    struct pmap *   map,
+    ptr_t           virt,
+    cpu_addr_t *    physp
+    );
+
+bool pmap_kernel_find
+    (
+    ptr_t           virt,
+    cpu_addr_t *    physp
+    );
+
+int pmap_insert_range
+    (
+    struct pmap *   map,
+    ptr_t           virt,
+    cpu_addr_t      phys,
+    size_t          size,
+    int             prot,
+    int             mmflag
+    );
 
 addr_t mem_get_low_addr(void);
 addr_t mem_get_high_addr(void);
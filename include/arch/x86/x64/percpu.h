@@ -0,0 +1,112 @@
+/* percpu.h - X86-64 per-CPU data area reached through IA32_GS_BASE */
+
+#ifndef _ARCH_X86_X64_PERCPU_H
+#define _ARCH_X86_X64_PERCPU_H
+
+#include <sys.h>
+#include <stddef.h>
+
+#define X64_CACHE_LINE_SIZE     64
+
+#ifndef __ASM__
+
+struct sched_thread;
+struct sched_cpu;
+struct pmap;
+
+/*
+ * Each CPU owns one per-CPU block and loads its address into IA32_GS_BASE,
+ * so that the hot per-CPU fields are reached with one %gs: relative load
+ * instead of an LAPIC ID read over the APIC bus.
+ *
+ * All the fields are 64 bit wide so that a 'movq' can access any of them.
+ */
+
+typedef struct x64_percpu
+    {
+    /* Linear address of this block */
+    struct x64_percpu *     self;
+
+    /* CPU index (the LAPIC ID latched at setup time) */
+    uint64_t                cpu_idx;
+
+    /* Thread running on this CPU */
+    struct sched_thread *   current_thread;
+
+    /* Scheduler CPU structure of this CPU */
+    struct sched_cpu *      current_cpu;
+
+    /* Timer ticks taken on this CPU */
+    uint64_t                timer_ticks;
+
+    /* Interrupt state saved by QUEUE_ISR_LOCK() */
+    long                    intr_flags;
+
+    /* Set by other CPUs to wake this CPU from idle (MWAIT monitored) */
+    uint64_t                need_resched;
+
+    /* A reschedule IPI has been sent and not yet handled */
+    uint64_t                resched_pending;
+
+    /* How this CPU sleeps while idle, SCHED_CPU_IDLE_XXX */
+    uint64_t                idle_state;
+
+    /* Page map loaded in CR3 by pmap_switch(), NULL for the boot one */
+    struct pmap *           current_pmap;
+
+    /* Next PCID to hand out, and the generation of the PCIDs handed out */
+    uint64_t                pcid_next;
+    uint64_t                pcid_gen;
+    } __attribute__((aligned(X64_CACHE_LINE_SIZE))) x64_percpu_t;
+
+extern x64_percpu_t x64_percpu_area[];
+
+#define PERCPU_OFFSET(field)    offsetof(x64_percpu_t, field)
+
+#define PERCPU_TYPE(field)      __typeof__(((x64_percpu_t *)0)->field)
+
+/* Read a field of the per-CPU block of the current CPU */
+#define percpu_read(field)                                  \
+    ({                                                      \
+    PERCPU_TYPE(field) __percpu_val;                        \
+    asm volatile ("movq %%gs:%c1, %0"                       \
+                  : "=r" (__percpu_val)                     \
+                  : "i" (PERCPU_OFFSET(field)));            \
+    __percpu_val;                                           \
+    })
+
+/* Write a field of the per-CPU block of the current CPU */
+#define percpu_write(field, val)                            \
+    do {                                                    \
+    PERCPU_TYPE(field) __percpu_val = (val);                \
+    asm volatile ("movq %0, %%gs:%c1"                       \
+                  :                                         \
+                  : "r" (__percpu_val),                     \
+                    "i" (PERCPU_OFFSET(field))              \
+                  : "memory");                              \
+    } while (0)
+
+/* Increase a counter field of the per-CPU block of the current CPU */
+#define percpu_inc(field)                                   \
+    asm volatile ("incq %%gs:%c0"                           \
+                  :                                         \
+                  : "i" (PERCPU_OFFSET(field))              \
+                  : "memory", "cc")
+
+/* Get the per-CPU block of the current CPU */
+#define this_percpu()   percpu_read(self)
+
+/* Get the per-CPU block of any CPU */
+#define percpu_of(cpu)  (&x64_percpu_area[(cpu)])
+
+/* Get the index of the current CPU */
+#define this_cpu()      ((id_t)percpu_read(cpu_idx))
+
+void percpu_init
+    (
+    uint32_t cpu
+    );
+
+#endif /* __ASM__ */
+
+#endif /* _ARCH_X86_X64_PERCPU_H */
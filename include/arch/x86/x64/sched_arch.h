@@ -10,8 +10,57 @@ typedef struct sched_cpu_arch
     {
     uint64_t apic_period_ns;
     uint64_t apic_scale_factor;
+    uint64_t tsc_freq_hz;
+    uint64_t tsc_scale_factor;  /* (NSECS_PER_SEC << 32) / tsc_freq_hz */
     x64_seg_descriptor_t gdt[GDT_SEL_ENTRIES];
     x64_tss_t            tss;
     }sched_cpu_arch_t;
 
+/* 
+ * Convert TSC cycles to nanoseconds; the 64 bit cycles are split so that
+ * the 32.32 fixed point multiplication does not overflow. Returns 0 if
+ * the TSC of the CPU has not been calibrated yet.
+ */
+static inline uint64_t sched_cpu_arch_cycles_to_ns
+    (
+    sched_cpu_arch_t *  cpu_arch,
+    uint64_t            cycles
+    )
+    {
+    uint64_t factor = cpu_arch->tsc_scale_factor;
+
+    return ((cycles >> 32) * factor) + 
+           (((cycles & 0xFFFFFFFF) * factor) >> 32);
+    }
+
+void sched_cpu_arch_tsc_freq_set
+    (
+    sched_cpu_arch_t *  cpu_arch,
+    uint64_t            tsc_freq_hz
+    );
+
+/* How an idle CPU sleeps, kept in x64_percpu_t::idle_state */
+#define SCHED_CPU_IDLE_NONE     0   /* Not sleeping */
+#define SCHED_CPU_IDLE_MWAIT    1   /* In MWAIT, woken by need_resched */
+#define SCHED_CPU_IDLE_HALT     2   /* In HLT, woken by an IPI */
+
+void sched_cpu_arch_idle (void);
+
+void sched_cpu_arch_wakeup
+    (
+    uint32_t    cpu_idx
+    );
+
+void sched_cpu_arch_resched
+    (
+    uint32_t    cpu_idx
+    );
+
+status_t sched_cpu_arch_tick_start (void);
+
+status_t sched_cpu_arch_tick_stop
+    (
+    uint64_t    sleep_ns
+    );
+
 #endif /* _ARCH_X86_X64_SCHED_ARCH_H */
@@ -7,7 +7,18 @@
 
 typedef struct spinlock
     {
-    unsigned int counter;
+    union
+        {
+        volatile unsigned int counter;
+
+        /* Queued spinlock view of the lock word */
+        struct
+            {
+            volatile uint8_t  locked;
+            uint8_t           reserved;
+            volatile uint16_t tail;
+            };
+        };
     ipl_t flags;
     } spinlock_t;
 
@@ -92,7 +103,7 @@ static inline void basic_spinlock_lock(spinlock_t *lock)
     {
 	while (1)
 	    {
-		if (!xchg_32(&lock->counter, SPINLOCK_EBUSY)) 
+		if (!xchg_32((void *)&lock->counter, SPINLOCK_EBUSY)) 
             return;
 	
 		while (lock->counter) cpu_relax();
@@ -107,7 +118,7 @@ static inline void basic_spinlock_unlock(spinlock_t *lock)
 
 static inline int basic_spinlock_trylock(spinlock_t *lock)
     {
-	return xchg_32(&lock->counter, SPINLOCK_EBUSY);
+	return xchg_32((void *)&lock->counter, SPINLOCK_EBUSY);
     }
 
 /*
@@ -217,9 +228,61 @@ static inline int ticket_lockable(ticketlock *t)
 	return (u.s.ticket == u.s.users);
     }
 
+/*
+ * Queued (MCS) spinlock
+ *
+ * The lock word holds a locked byte and the tail of a queue of waiting 
+ * cpus. A waiter spins on the flag of its own per-CPU queue node instead
+ * of on the lock word, so a release only touches the cache line of the 
+ * next waiter, and the lock is granted in FIFO order.
+ *
+ * The tail encodes (cpu + 1) and the index of the queue node used by the
+ * waiter; a cpu has one node per nesting level (thread, interrupt, ...).
+ * The slow path uses this_cpu(), so a spinlock must not be contended on 
+ * a cpu before percpu_init() has been called there.
+ */
+
+#define QSPINLOCK_LOCKED            1
+#define QSPINLOCK_NODES_PER_CPU     4
+
+#define QSPINLOCK_TAIL(cpu, idx)    ((uint16_t)((((cpu) + 1) << 2) | (idx)))
+#define QSPINLOCK_TAIL_CPU(tail)    (((tail) >> 2) - 1)
+#define QSPINLOCK_TAIL_IDX(tail)    ((tail) & 3)
+
+void queued_spinlock_slowpath(spinlock_t *lock);
+
+static inline void queued_spinlock_lock(spinlock_t *lock)
+    {
+    if (cmpxchg(&lock->counter, 0, QSPINLOCK_LOCKED) == 0)
+        return;
+
+    queued_spinlock_slowpath(lock);
+    }
+
+static inline void queued_spinlock_unlock(spinlock_t *lock)
+    {
+    barrier();
+    lock->locked = 0;
+    }
+
+static inline int queued_spinlock_trylock(spinlock_t *lock)
+    {
+    if ((lock->counter == 0) && 
+        (cmpxchg(&lock->counter, 0, QSPINLOCK_LOCKED) == 0))
+        return 0;
+
+    return SPINLOCK_EBUSY;
+    }
+
+#ifdef CONFIG_SPINLOCK_QUEUED
+#define spinlock_lock queued_spinlock_lock
+#define spinlock_unlock queued_spinlock_unlock
+#define spinlock_trylock  queued_spinlock_trylock
+#else
 #define spinlock_lock basic_spinlock_lock
 #define spinlock_unlock basic_spinlock_unlock
 #define spinlock_trylock  basic_spinlock_trylock
+#endif
 
 typedef union rwticket rwticket;
 
@@ -0,0 +1,66 @@
+/* tlb.h - X86-64 TLB shootdown */
+
+#ifndef _ARCH_X86_X64_TLB_H
+#define _ARCH_X86_X64_TLB_H
+
+#include <sys.h>
+
+/*
+ * The invalidations of a page map operation are gathered in a batch and
+ * flushed at once, on this CPU and on the other CPUs having the page map
+ * active. Past TLB_BATCH_MAX pages a batch flushes the whole TLB rather
+ * than each page. A batch which unlinked paging structures of a kernel
+ * page map flushes everything too, see tlb_batch_add_table().
+ */
+
+#define TLB_BATCH_MAX           32
+
+#ifndef __ASM__
+
+struct pmap;
+
+typedef struct tlb_batch
+    {
+    struct pmap *   map;
+
+    /* Pages to invalidate, more than TLB_BATCH_MAX means a full flush */
+    int             nr;
+    cpu_addr_t      addrs[TLB_BATCH_MAX];
+
+    /* Paging structures were unlinked from the page map */
+    bool            tables;
+    } tlb_batch_t;
+
+void tlb_batch_init
+    (
+    tlb_batch_t *   batch,
+    struct pmap *   map
+    );
+
+void tlb_batch_add
+    (
+    tlb_batch_t *   batch,
+    cpu_addr_t      virt
+    );
+
+void tlb_batch_add_table
+    (
+    tlb_batch_t *   batch,
+    cpu_addr_t      virt
+    );
+
+void tlb_batch_flush
+    (
+    tlb_batch_t *   batch
+    );
+
+void tlb_cpu_online (void);
+
+void tlb_shootdown_handler
+    (
+    uint64_t    stack_frame
+    );
+
+#endif /* __ASM__ */
+
+#endif /* _ARCH_X86_X64_TLB_H */
@@ -0,0 +1,39 @@
+/* tsc.h - X86-64 TSC clock counter */
+
+#ifndef _ARCH_X86_X64_TSC_H
+#define _ARCH_X86_X64_TSC_H
+
+#include <sys.h>
+
+/*
+ * An invariant TSC is read in a few tens of cycles, against about a
+ * microsecond for the PM timer, so it becomes the global clock counter
+ * when the CPUs have it. Its frequency is calibrated against the PIT and
+ * the PM timer at boot, and the TSCs of the APs are checked against the
+ * one of the BSP as they come up.
+ */
+
+/* Largest delta, in seconds, that the cycles to ns conversion handles */
+#define TSC_MAX_DELTA_SECS          600
+
+/* PM timer ticks the TSC is calibrated over, about 50 ms */
+#define TSC_CALIBRATE_PM_TICKS      (PM_TIMER_FREQUENCY / 20)
+
+/* Calibrations further apart than 1/TSC_CALIBRATE_MAX_DIFF are reported */
+#define TSC_CALIBRATE_MAX_DIFF      100
+
+/* Loops each CPU runs when checking the TSC synchronization */
+#define TSC_SYNC_LOOPS              20000
+
+#ifndef __ASM__
+
+void tsc_sync_source
+    (
+    int     cpu
+    );
+
+void tsc_sync_target (void);
+
+#endif /* __ASM__ */
+
+#endif /* _ARCH_X86_X64_TSC_H */
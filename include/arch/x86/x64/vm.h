@@ -95,6 +95,13 @@ typedef struct pmap
     bool            user;  /* Pages mapped is userspace accessible */
     cpu_addr_t      start; /* start page of the range covered by this page map */
     cpu_addr_t      end;   /* end page of the range covered by this page map */
+
+    /* CPUs which have switched to this page map, for TLB shootdowns */
+    volatile unsigned long active_cpus;
+
+    /* PCID of the page map on each CPU, valid if of the CPU generation */
+    uint16_t        pcid[CONFIG_NR_CPUS];
+    volatile uint64_t pcid_gen[CONFIG_NR_CPUS];
     } pmap_t;
 
 /* Page mapping protection flags. */
@@ -102,6 +109,13 @@ typedef struct pmap
 #define PMAP_READ        (1<<0)    /* Mapping should be readable. */
 #define PMAP_WRITE       (1<<1)    /* Mapping should be writable. */
 #define PMAP_EXEC        (1<<2)    /* Mapping should be executable. */
+
+/* Page sizes, as the level of the paging structure entry mapping them. */
+
+#define PMAP_PAGE_4K     0         /* PTE */
+#define PMAP_PAGE_2M     1         /* PDE with PG_LARGE */
+#define PMAP_PAGE_1G     2         /* PDPTE with PG_LARGE, if PDPE1GB */
+#define PMAP_PAGE_512G   3         /* PML4E, never a page */
 #endif
 
 #endif /* __INCLUDE_ARCH_X64_VM_H */
@@ -257,6 +257,24 @@ static inline uint64_t rdtsc(void)
 	return ((uint64_t) lower) | (((uint64_t) upper) << 32);
     }
 
+/* rdtsc_ordered - read the TSC once all the prior loads are done */
+static inline uint64_t rdtsc_ordered(void)
+    {
+    uint32_t lower;
+    uint32_t upper;
+
+    asm volatile (
+        "lfence\n"
+        "rdtsc\n"
+        : "=a" (lower), /* EAX */
+          "=d" (upper)  /* EDX */
+        :
+        : "memory"
+        );
+
+    return ((uint64_t) lower) | (((uint64_t) upper) << 32);
+    }
+
 /** write_msr - write to MSR
  *
  * @param msr MSR register to write to
@@ -335,12 +353,23 @@ static inline void invlpg(uintptr_t addr)
 #define CPUID_GETFEATURES       1
 #define CPUID_GETTLB            2
 #define CPUID_GETSERIAL         3
+#define CPUID_GETEXTFEATURES    7
+
+/* CPUID_GETEXTFEATURES sub-leaf 0 feature bits */
+#define CPUID_EXTFEAT_EBX_INVPCID    (1 << 10)
+
+/* CPUID_INTELFEATURES feature bits */
+#define CPUID_INTELFEAT_EDX_PDPE1GB  (1 << 26)
+
+/* CPUID_INTELPOWERMGMT feature bits */
+#define CPUID_POWERMGMT_EDX_INVTSC   (1 << 8)
 
 #define CPUID_INTELEXTENDED     0x80000000
 #define CPUID_INTELFEATURES     0x80000001
 #define CPUID_INTELBRANDSTRING  0x80000002
 #define CPUID_INTELBRANDSTRINGMORE  0x80000003
 #define CPUID_INTELBRANDSTRINGEND   0x80000004
+#define CPUID_INTELPOWERMGMT    0x80000007
 
 
 /**
@@ -400,12 +429,14 @@ static inline void invlpg(uintptr_t addr)
 #define CPUID_FEAT_ECX_CX16          (1 << 13)
 #define CPUID_FEAT_ECX_ETPRD         (1 << 14)
 #define CPUID_FEAT_ECX_PDCM          (1 << 15)
+#define CPUID_FEAT_ECX_PCID          (1 << 17)
 #define CPUID_FEAT_ECX_DCA           (1 << 18)
 #define CPUID_FEAT_ECX_SSE4_1        (1 << 19)
 #define CPUID_FEAT_ECX_SSE4_2        (1 << 20)
 #define CPUID_FEAT_ECX_x2APIC        (1 << 21)
 #define CPUID_FEAT_ECX_MOVBE         (1 << 22)
 #define CPUID_FEAT_ECX_POPCNT        (1 << 23)
+#define CPUID_FEAT_ECX_TSC_DEADLINE  (1 << 24)
 #define CPUID_FEAT_ECX_XSAVE         (1 << 26)
 #define CPUID_FEAT_ECX_OSXSAVE       (1 << 27)
 #define CPUID_FEAT_ECX_AVX           (1 << 28)
@@ -541,6 +572,18 @@ static inline void cpuid(uint32_t req, cpuid_info_t *cpuid_info)
           "=d" (cpuid_info->edx)
         : "a" (req));
     }
+
+/** cpuid_count - run CPUID for a request which has sub-leaves in ECX */
+static inline void cpuid_count(uint32_t req, uint32_t sub, cpuid_info_t *cpuid_info)
+    {
+    asm volatile(
+        "cpuid"
+        : "=a" (cpuid_info->eax),
+          "=b" (cpuid_info->ebx),
+          "=c" (cpuid_info->ecx),
+          "=d" (cpuid_info->edx)
+        : "a" (req), "c" (sub));
+    }
 #endif /* __ASM__ */
 /*********************CPUID cmd and bits (end)***************************/
 
@@ -664,6 +707,191 @@ static inline bool has_x2apic(void)
         return 0;
     }
 
+/** has_mwait - check if the CPU supports MONITOR/MWAIT
+  *
+  *@return true if the CPU supports MONITOR/MWAIT
+  */
+
+static inline bool has_mwait(void)
+    {
+    cpuid_info_t cpuid_info;
+
+    cpuid(CPUID_GETFEATURES, &cpuid_info);
+
+    if (cpuid_info.ecx & CPUID_FEAT_ECX_MONITOR)
+        return 1;
+    else
+        return 0;
+    }
+
+/** has_tsc_deadline - check if the LAPIC timer has the TSC-deadline mode
+  *
+  *@return true if the LAPIC timer can be armed with a TSC deadline
+  */
+
+static inline bool has_tsc_deadline(void)
+    {
+    cpuid_info_t cpuid_info;
+
+    cpuid(CPUID_GETFEATURES, &cpuid_info);
+
+    if (cpuid_info.ecx & CPUID_FEAT_ECX_TSC_DEADLINE)
+        return 1;
+    else
+        return 0;
+    }
+
+/** has_pcid - check if the CPU supports process-context identifiers
+  *
+  *@return true if the CPU supports CR4.PCIDE
+  */
+
+static inline bool has_pcid(void)
+    {
+    cpuid_info_t cpuid_info;
+
+    cpuid(CPUID_GETFEATURES, &cpuid_info);
+
+    if (cpuid_info.ecx & CPUID_FEAT_ECX_PCID)
+        return 1;
+    else
+        return 0;
+    }
+
+/** has_invpcid - check if the CPU supports the INVPCID instruction
+  *
+  *@return true if the CPU supports INVPCID
+  */
+
+static inline bool has_invpcid(void)
+    {
+    cpuid_info_t cpuid_info;
+
+    cpuid(CPUID_GETVENDORSTRING, &cpuid_info);
+
+    if (cpuid_info.eax < CPUID_GETEXTFEATURES)
+        return 0;
+
+    cpuid_count(CPUID_GETEXTFEATURES, 0, &cpuid_info);
+
+    if (cpuid_info.ebx & CPUID_EXTFEAT_EBX_INVPCID)
+        return 1;
+    else
+        return 0;
+    }
+
+/** has_pdpe1gb - check if the CPU supports 1GB pages
+  *
+  *@return true if PDPTEs can map 1GB pages
+  */
+
+static inline bool has_pdpe1gb(void)
+    {
+    cpuid_info_t cpuid_info;
+
+    cpuid(CPUID_INTELEXTENDED, &cpuid_info);
+
+    if (cpuid_info.eax < CPUID_INTELFEATURES)
+        return 0;
+
+    cpuid(CPUID_INTELFEATURES, &cpuid_info);
+
+    if (cpuid_info.edx & CPUID_INTELFEAT_EDX_PDPE1GB)
+        return 1;
+    else
+        return 0;
+    }
+
+/** has_invariant_tsc - check if the TSC runs at a constant rate
+  *
+  * An invariant TSC keeps its rate across P-, C- and T-state changes, so
+  * that it may be used as a wall clock source.
+  *
+  *@return true if the TSC is invariant
+  */
+
+static inline bool has_invariant_tsc(void)
+    {
+    cpuid_info_t cpuid_info;
+
+    cpuid(CPUID_INTELEXTENDED, &cpuid_info);
+
+    if (cpuid_info.eax < CPUID_INTELPOWERMGMT)
+        return 0;
+
+    cpuid(CPUID_INTELPOWERMGMT, &cpuid_info);
+
+    if (cpuid_info.edx & CPUID_POWERMGMT_EDX_INVTSC)
+        return 1;
+    else
+        return 0;
+    }
+
+/* INVPCID invalidation types */
+#define INVPCID_ADDR            0   /* One address in one PCID */
+#define INVPCID_CONTEXT         1   /* All but the global entries of one PCID */
+#define INVPCID_ALL_GLOBAL      2   /* All the entries of all PCIDs */
+#define INVPCID_ALL             3   /* All but the global entries of all PCIDs */
+
+/** invpcid - invalidate TLB entries by process-context identifier
+ *
+ * @param type INVPCID_XXX invalidation type
+ * @param pcid PCID to invalidate, for INVPCID_ADDR and INVPCID_CONTEXT
+ * @param addr Address to invalidate, for INVPCID_ADDR
+ */
+
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t addr)
+    {
+    struct { uint64_t pcid, addr; } desc = { pcid, addr };
+
+    asm volatile ("invpcid %[desc], %[type]\n"
+                  :
+                  : [desc] "m" (desc), [type] "r" (type)
+                  : "memory");
+    }
+
+/** cpu_monitor - arm address monitoring hardware on a cache line
+ *
+ * @param addr Linear address to be monitored by a following MWAIT
+ */
+
+static inline void cpu_monitor(const volatile void *addr)
+    {
+    asm volatile ("monitor\n" 
+                  : 
+                  : "a" (addr), "c" (0), "d" (0));
+    }
+
+/** cpu_sti_mwait - enable interrupts and wait on the monitored cache line
+ *
+ * The STI interrupt shadow covers MWAIT, so an interrupt pending at STI
+ * breaks the MWAIT instead of being taken before it.
+ *
+ * @param hint C-state hint passed in EAX
+ */
+
+static inline void cpu_sti_mwait(uint32_t hint)
+    {
+    asm volatile ("sti\n"
+                  "mwait\n" 
+                  : 
+                  : "a" (hint), "c" (0)
+                  : "memory");
+    }
+
+/** cpu_sti_halt - enable interrupts and halt until the next interrupt
+ *
+ * The STI interrupt shadow covers HLT, so an interrupt pending at STI
+ * wakes the HLT instead of being taken before it.
+ */
+
+static inline void cpu_sti_halt(void)
+    {
+    asm volatile ("sti\n"
+                  "hlt\n" 
+                  ::: "memory");
+    }
+
 #endif /* __ASM__ */
 
 
@@ -7,18 +7,43 @@
 
 #define CONFIG_KSTACK_SIZE            4096
 
-#define CONFIG_KHEAP_SIZE             (16 * 1024 * 1024)
+/* Initial kernel heap arena of the boot CPU, and of each other CPU */
+#define CONFIG_KHEAP_SIZE             (4 * 1024 * 1024)
+#define CONFIG_KHEAP_ARENA_SIZE       (1 * 1024 * 1024)
+
+/*
+ * Heap arena growth policy: an arena out of memory grows by the given
+ * percentage of its size, clamped to [MIN, MAX], or by the request if
+ * larger. MAX can not exceed the largest page allocator block.
+ */
+#define CONFIG_KHEAP_GROW_MIN         (1 * 1024 * 1024)
+#define CONFIG_KHEAP_GROW_MAX         (16 * 1024 * 1024)
+#define CONFIG_KHEAP_GROW_PERCENT     50
+
+/* Largest size an arena grows to */
+#define CONFIG_KHEAP_ARENA_MAX        (256 * 1024 * 1024)
 
 #define CONFIG_HEAP_NUM_PAGES               (CONFIG_KHEAP_SIZE/PAGE_SIZE)
 
 #define CONFIG_SMP                          1
 
+/*
+ * Use queued (MCS) spinlocks instead of test-and-set spinlocks. Left off
+ * until the kernel can disable preemption: a lock holder preempted while
+ * cpus queue behind it keeps all of them spinning.
+ */
+#undef CONFIG_SPINLOCK_QUEUED
+
 #define CONFIG_NR_CPUS                      8
 
 #define CONFIG_HZ                           100
 
 #define CONFIG_SCHED_USE_APIC               1
 
+#define CONFIG_SCHED_BALANCE_TICKS          (CONFIG_HZ / 10)
+
+#define CONFIG_MUTEX_ADAPTIVE_SPIN_NS       (20 * 1000)
+
 #define CONFIG_SYS_CBSIZE                   1024
 
 #define CONFIG_SYS_MAXARGS                  16
@@ -4,6 +4,8 @@
 #include <sys.h>
 #include <os/debug.h>
 #include <os/alloc.h>
+#include <os/kmem_cache.h>
+#include <os/epoch.h>
 #include <os/printk.h>
 #include <os/ksh.h>
 #include <os/list.h>
@@ -21,7 +23,6 @@
 #include <os/sched_thread.h>
 #include <os/sched_mutex.h>
 
-extern timespec_t real_wall_time;
 extern struct clockcounter * global_clockcounter;
 
 #endif /*__INCLUDE_OS_H */
@@ -5,6 +5,22 @@
 #include <os/list.h>
 #include <os/tlsf.h>
 
+/* Physical memory zones, DMA32 is the memory below 4GB */
+
+#define PAGE_ZONE_DMA32         0
+#define PAGE_ZONE_NORMAL        1
+#define PAGE_ZONE_MAX           2
+
+#define PAGE_ZONE_DMA32_END     0x100000000UL
+
+/* 
+ * The biggest buddy block has 2^PAGE_ALLOC_MAX_ORDER pages, which is also
+ * the most page_alloc_contig() can allocate at once (16MB)
+ */
+
+#define PAGE_ALLOC_MAX_ORDER        12
+#define PAGE_ALLOC_MAX_CONTIG_PAGES (1 << PAGE_ALLOC_MAX_ORDER)
+
 void page_alloc_init
     (
     cpu_addr_t first_address,
@@ -15,10 +31,19 @@ void page_free(void *addr);
 void page_free(void *addr);
 void page_free_contig(size_t index);
 void *page_alloc_contig(int num_pages);
+void *page_alloc_zone_contig(int zone_idx, int num_pages);
 
+extern void kmalloc_init(void);
 extern void *kmalloc(size_t size);
 extern void kfree(void *ptr);
 extern void *krealloc(void *ptr, size_t size);
 extern void *kcalloc(size_t nelem, size_t elem_size);
+extern size_t kmalloc_shrink(void);
+
+cpu_addr_t vm_virt2phys
+    (
+    cpu_addr_t vaddr, 
+    size_t size
+    );
 
 #endif 
@@ -49,14 +49,76 @@ typedef struct clockcounter
     /* Minium overflow fixup period in nanoseconds */
 
     abstime_t counter_fixup_period;
+
+    /* 
+     * Fixed point conversion of cycles to nanoseconds, 
+     * ns = (cycles * counter_mult) >> counter_shift
+     */
+
+    uint32_t counter_mult;
+    uint32_t counter_shift;
+
+    /* Set once the counter is found unreliable, it is never selected again */
+
+    int counter_unstable;
     }clockcounter_t;
 
+/* 
+ * Cycles elapsed from t1 to t2. A 64 bit counter read slightly behind t1,
+ * e.g. the TSC of another CPU, is taken as no time elapsed.
+ */
+static inline cycle_t clockcounter_delta
+    (
+    struct clockcounter *   counter,
+    cycle_t                 t1,
+    cycle_t                 t2
+    )
+    {
+    cycle_t delta = t2 - t1;
+
+    if (counter->counter_bits < 64)
+        return delta & ((1ULL << counter->counter_bits) - 1);
+
+    return ((int64_t)delta < 0) ? 0 : delta;
+    }
+
+/* Convert a counter delta to nanoseconds, see counter_mult */
+static inline abstime_t clockcounter_cyc2ns
+    (
+    struct clockcounter *   counter,
+    cycle_t                 cycles
+    )
+    {
+    return (abstime_t)((cycles * counter->counter_mult) >> 
+                       counter->counter_shift);
+    }
+
+void clockcounter_calc_mult_shift
+    (
+    uint32_t *  mult,
+    uint32_t *  shift,
+    uint64_t    from,
+    uint64_t    to,
+    uint64_t    max_secs
+    );
+
+void clockcounter_mark_unstable
+    (
+    struct clockcounter *   counter,
+    const char *            reason
+    );
+
 void real_wall_time_init(void);
 
 void real_wall_time_regular_update(void);
 
 abstime_t get_now_nanosecond(void);
 
+abstime_t get_monotonic_nanosecond(void);
+
+abstime_t get_wall_offset_nanosecond(void);
+
 extern struct clockcounter clockcounter_pm_timer;
+extern struct clockcounter clockcounter_tsc;
 extern struct clockcounter * global_clockcounter;
 
@@ -100,6 +100,23 @@ status_t clockeventer_stop(struct clockeventer * eventer);
 
 status_t clockeventer_subsystem_init(void);
 
+status_t tick_percpu_eventer_init
+    (
+    clockeventer_t *    eventer
+    );
+
+status_t tick_percpu_start (void);
+
+status_t tick_percpu_stop
+    (
+    abstime_t   sleep_ns
+    );
+
+void tick_percpu_timer_armed
+    (
+    abstime_t   expires
+    );
+
 extern struct clockeventer * global_tick_eventer;
 
 #ifdef __cplusplus
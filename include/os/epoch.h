@@ -0,0 +1,36 @@
+/* epoch.h - epoch based deferred reclamation */
+
+#ifndef _OS_EPOCH_H
+#define _OS_EPOCH_H
+
+#include <sys.h>
+#include <arch.h>
+
+/*
+ * Lockless readers run in an epoch read section, with interrupts disabled
+ * and without sleeping. A writer that unlinks an object which readers may
+ * still see defers its freeing with epoch_defer(); the object is freed once
+ * every CPU has left the read sections that could have seen it, that is
+ * once the global epoch has advanced twice past the unlink.
+ */
+
+typedef void (*epoch_func_t)(void *arg);
+
+ipl_t epoch_enter(void);
+
+void epoch_exit
+    (
+    ipl_t   flags
+    );
+
+void epoch_defer
+    (
+    epoch_func_t    func,
+    void *          arg
+    );
+
+void epoch_synchronize(void);
+
+void epoch_reclaim(void);
+
+#endif /* _OS_EPOCH_H */
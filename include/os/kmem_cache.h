@@ -0,0 +1,117 @@
+/* kmem_cache.h - slab object caches */
+
+#ifndef _OS_KMEM_CACHE_H
+#define _OS_KMEM_CACHE_H
+
+#include <sys.h>
+#include <arch.h>
+#include <os/list.h>
+
+/*
+ * An object cache hands out fixed-size objects carved out of slabs, which
+ * are naturally aligned blocks of pages from the page allocator. Each CPU
+ * keeps a magazine of free objects in front of the cache, so that most
+ * allocations and frees need neither the cache lock nor the kmalloc pool.
+ *
+ * The constructor, if any, is called once on each object when its slab is
+ * created, with the cache lock held. Objects must be freed back in their
+ * constructed state.
+ */
+
+/* Objects held in each per-CPU magazine */
+#define KMEM_CACHE_MAGAZINE_SIZE    16
+
+/* Slabs are grown until they hold at least this many objects */
+#define KMEM_SLAB_MIN_OBJS          8
+#define KMEM_SLAB_MAX_PAGES         16
+
+typedef void (*kmem_cache_ctor_t)(void *obj);
+
+typedef struct kmem_magazine
+    {
+    int     nr;
+    void *  objs[KMEM_CACHE_MAGAZINE_SIZE];
+    } __attribute__((aligned(X64_CACHE_LINE_SIZE))) kmem_magazine_t;
+
+typedef struct kmem_cache
+    {
+    const char *        name;
+    size_t              size;
+    size_t              align;
+    kmem_cache_ctor_t   ctor;
+
+    /* Slab layout, set up on the first slab creation */
+    size_t              obj_size;
+    size_t              slab_pages;
+    size_t              objs_offset;
+    unsigned int        objs_per_slab;
+
+    spinlock_t          lock;
+
+    /* Slabs with some, all and no objects allocated */
+    list_t              slabs_partial;
+    list_t              slabs_full;
+    list_t              slabs_empty;
+
+    size_t              nr_slabs;
+    size_t              nr_empty;
+
+    /* Objects out of the slabs, including those in the magazines */
+    size_t              nr_active;
+
+    /* Node in the list of all caches */
+    list_t              node;
+
+    kmem_magazine_t     magazine[CONFIG_NR_CPUS];
+    } kmem_cache_t;
+
+/* Statically declares an object cache, usable before any init code ran */
+
+#define KMEM_CACHE_DECLARE(_var, _name, _size, _align, _ctor)   \
+    kmem_cache_t _var =                                         \
+        {                                                       \
+        .name = _name,                                          \
+        .size = _size,                                          \
+        .align = _align,                                        \
+        .ctor = _ctor,                                          \
+        .lock = SPINLOCK_INITIALISER(#_var),                    \
+        .slabs_partial = LIST_INITIALISER(_var.slabs_partial),  \
+        .slabs_full = LIST_INITIALISER(_var.slabs_full),        \
+        .slabs_empty = LIST_INITIALISER(_var.slabs_empty),      \
+        .node = LIST_INITIALISER(_var.node),                    \
+        }
+
+void kmem_cache_init
+    (
+    kmem_cache_t *      cache,
+    const char *        name,
+    size_t              size,
+    size_t              align,
+    kmem_cache_ctor_t   ctor
+    );
+
+kmem_cache_t * kmem_cache_create
+    (
+    const char *        name,
+    size_t              size,
+    size_t              align,
+    kmem_cache_ctor_t   ctor
+    );
+
+void kmem_cache_destroy
+    (
+    kmem_cache_t *      cache
+    );
+
+void * kmem_cache_alloc
+    (
+    kmem_cache_t *      cache
+    );
+
+void kmem_cache_free
+    (
+    kmem_cache_t *      cache,
+    void *              obj
+    );
+
+#endif /* _OS_KMEM_CACHE_H */
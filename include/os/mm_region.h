@@ -0,0 +1,53 @@
+/* mm_region.h - physical memory map */
+
+#ifndef _OS_MM_REGION_H
+#define _OS_MM_REGION_H
+
+#include <sys.h>
+#include <arch.h>
+
+/*
+ * The physical memory map is the set of usable RAM ranges reported by the
+ * boot loader plus the reserved ranges (firmware tables, the kernel image,
+ * early allocations) that must never be handed out. Reserved ranges take
+ * precedence over usable ones; anything that is in no usable range is a
+ * hole.
+ */
+
+#define MM_REGION_MAX           32
+
+#define MM_REGION_USABLE        1
+#define MM_REGION_RESERVED      2
+
+typedef struct mm_region
+    {
+    cpu_addr_t  start;
+    cpu_addr_t  end;        /* Exclusive */
+    } mm_region_t;
+
+typedef void (*mm_region_func_t)(cpu_addr_t start, cpu_addr_t end, void *arg);
+
+status_t mm_region_add
+    (
+    cpu_addr_t  start,
+    cpu_addr_t  end,
+    int         type
+    );
+
+cpu_addr_t mm_region_usable_low(void);
+cpu_addr_t mm_region_usable_high(void);
+
+void mm_region_walk_free
+    (
+    mm_region_func_t    func,
+    void *              arg
+    );
+
+cpu_addr_t mm_region_alloc_early
+    (
+    size_t      size,
+    cpu_addr_t  low,
+    cpu_addr_t  high
+    );
+
+#endif /* _OS_MM_REGION_H */
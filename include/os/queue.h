@@ -44,7 +44,7 @@ typedef struct qhead
         }while(0)
 
 #define QUEUE_ISR_LOCK(head)        do {                \
-                __cpu_intr_flags = intr_disable();      \
+                percpu_write(intr_flags, intr_disable());\
                 if ((head)->lock)                       \
                     spinlock_lock(&(head)->safe);       \
                 }while(0)
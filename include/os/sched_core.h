@@ -13,11 +13,7 @@
 #include <os/sched_mutex.h>
 #include <os/sched_thread.h>
 
-extern sched_thread_t * kthread_current[];
-extern sched_cpu_t*    current_cpus[];
 extern list_t   kthread_list[];
-extern uint64_t timer_ticks[];
-extern long     cpu_intr_flags[];
 extern spinlock_t reschedule_lock;
 
 #if 0
@@ -28,12 +24,17 @@ extern spinlock_t reschedule_lock;
 #define SCHED_UNLOCK()  
 #endif
 
-#define kurrent kthread_current[this_cpu()]
-#define kurrent_cpu current_cpus[this_cpu()] 
+#define kurrent ((sched_thread_t *)percpu_read(current_thread))
+#define kurrent_cpu ((sched_cpu_t *)percpu_read(current_cpu))
 #define kurrent_tsk kurrent->tsk
 #define kurrent_asp kurrent->asp
 
-#define __cpu_intr_flags cpu_intr_flags[this_cpu()]
+#define kurrent_set(thread) percpu_write(current_thread, (thread))
+
+#define __cpu_intr_flags percpu_read(intr_flags)
+
+/* Convert a time slice in scheduler ticks to nanoseconds */
+#define SCHED_TICKS2NSECS(ticks) ((abstime_t)(ticks) * HZ2NSECS(CONFIG_HZ))
 
 void sched_init(void);
 
@@ -47,10 +48,7 @@ void sched_thread_common_entry
     void *param
     );
 
-void cpu_heart_beat 
-    (
-    int cpu
-    );
+void sched_idle_loop (void);
 
 extern __attribute__ ((returns_twice)) 
     int context_save(sched_context_t *c);
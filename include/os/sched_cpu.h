@@ -6,6 +6,7 @@
 #include <sys.h>
 #include <arch.h>
 #include <os/sched_core.h>
+#include <os/seqlock.h>
 
 #define __CPU_SETSIZE 1024
 #define __NCPUBITS     (8 * sizeof (__cpu_mask))
@@ -116,6 +117,13 @@ typedef struct cpu_set
 
 struct sched_thread;
 struct sched_cpu_group;
+struct sched_runq;
+
+/* Max cpu_groups a CPU can serve its threads from without locking */
+#define SCHED_CPU_GROUP_MAX_PER_CPU     16
+
+/* Size of the per-policy runq table of a cpu_group, indexed by policy ID */
+#define SCHED_CPU_GROUP_POLICY_MAX      (SCHED_OTHER + 1)
 
 typedef struct sched_cpu 
     {
@@ -125,6 +133,18 @@ typedef struct sched_cpu
     /* Node of the cpu_group list */
     list_t                  cpu_group_list;  
 
+    /* Protects cpu_groups[] and nr_cpu_groups */
+    seqcount_t              cpu_group_seq;
+
+    /* Number of cpu_groups this CPU belongs to */
+    size_t                  nr_cpu_groups;
+
+    /* More cpu_groups than cpu_groups[] can hold, use the locked list */
+    BOOL                    cpu_groups_overflow;
+
+    /* cpu_groups this CPU belongs to */
+    struct sched_cpu_group * cpu_groups[SCHED_CPU_GROUP_MAX_PER_CPU];
+
     /* Lock for this CPU */
 	spinlock_t              lock;  
 
@@ -142,6 +162,18 @@ typedef struct sched_cpu
 
     /* Is the CPU idle */
     BOOL                    idle;
+
+    /* Is the periodic tick stopped while the CPU is idle */
+    BOOL                    tick_stopped;
+
+    /* Times the CPU went to sleep in the idle loop */
+    uint64_t                idle_count;
+
+    /* TSC cycles the CPU spent asleep in the idle loop */
+    uint64_t                idle_cycles;
+
+    /* TSC at the first entry to the idle loop */
+    uint64_t                idle_start_cycle;
         
     /* Schedule clock ID */
     clockid_t               clock;  
@@ -166,9 +198,12 @@ typedef struct sched_cpu_group
 
     /* ID of this cpu group */
     id_t        cpu_group_id;
+
+    /* Runq of each scheduling policy, indexed by policy ID */
+    struct sched_runq * volatile runq[SCHED_CPU_GROUP_POLICY_MAX];
     }sched_cpu_group_t;
 
-extern sched_cpu_t* current_cpus[];
+extern sched_cpu_t cpus[];
 
 void cpu_early_init(void); 
 
@@ -187,6 +222,27 @@ sched_cpu_group_t * sched_cpu_group_find
     cpu_set_t * cpu_set
     );
 
+bool sched_cpu_has_runnable
+    (
+    sched_cpu_t *   cpu
+    );
+
+void sched_cpu_wakeup
+    (
+    sched_cpu_t *   cpu
+    );
+
+void sched_cpu_set_wakeup
+    (
+    cpu_set_t *     cpu_set
+    );
+
+bool sched_cpu_group_has_runnable
+    (
+    sched_policy_t * policy,
+    sched_cpu_t *    cpu
+    );
+
 struct sched_thread * sched_cpu_group_find_best_thread 
     (
     sched_policy_t * policy,
@@ -35,9 +35,29 @@ typedef struct sched_mutex_attr
 
     /* How to handle the case if thread terminated while holding a lock? */
     int             robust;
+
+    /* Pass the mutex directly to the woken waiter on unlock? */
+    int             handoff;
     
     }sched_mutex_attr_t;
 
+/* Contention statistics of a mutex */
+
+typedef struct sched_mutex_stats
+    {
+    /* Lock attempts which found the mutex owned by another thread */
+    atomic64_t  contended;
+
+    /* Contended locks taken by spinning (adaptive mutex) */
+    atomic64_t  spin_acquired;
+
+    /* Contended locks which blocked on the waitq */
+    atomic64_t  blocked;
+
+    /* TSC cycles spent spinning */
+    atomic64_t  spin_cycles;
+    } sched_mutex_stats_t;
+
 /* Kernel mutex structure */
 
 typedef struct sched_mutex
@@ -51,6 +71,9 @@ typedef struct sched_mutex
     /* Thread owning the mutex */
     struct sched_thread *owner;
 
+    /* Node in the mutex_list of the owner thread */
+    list_t owner_node;
+
     /* Owner scheduling policy */
     struct sched_policy * owner_policy;
     
@@ -69,6 +92,9 @@ typedef struct sched_mutex
     /* Lock for the above list */
     spinlock_t lock;
 
+    /* Contention statistics */
+    struct sched_mutex_stats stats;
+
     /* Magic number */
     int magic;
     } sched_mutex_t;
@@ -76,10 +102,32 @@ typedef struct sched_mutex
 /* Default max recursive count */
 #define SCHED_MUTEX_MAX_RECURSIVES 32
 
+/* Spin budget of an adaptive mutex if the TSC frequency is unknown */
+#define SCHED_MUTEX_SPIN_CYCLES_DEFAULT    (50 * 1000)
+
+/* Max mutexes followed when propagating an inherited priority */
+#define SCHED_MUTEX_PI_CHAIN_MAX   16
+
+/* Mutex handoff attribute */
+#define PTHREAD_MUTEX_HANDOFF_NONE_NP   0
+#define PTHREAD_MUTEX_HANDOFF_NP        1
+
 int pthread_mutexattr_setname_np
     (
     sched_mutex_attr_t **attr, 
     char *name
     );
 
+int pthread_mutexattr_gethandoff_np
+    (
+    sched_mutex_attr_t **attr, 
+    int *handoff
+    );
+
+int pthread_mutexattr_sethandoff_np
+    (
+    sched_mutex_attr_t **attr, 
+    int handoff
+    );
+
 #endif /* _OS_SCHED_MUTEX_H */
@@ -102,6 +102,13 @@ typedef struct sched_policy
         struct sched_thread *       thread         
         );        
 
+    /* Take the best thread allowed to run on the cpu from a run queue */
+    struct sched_thread *  (*thread_steal)
+        (
+        struct sched_runq *         runq,
+        struct sched_cpu *          cpu
+        );
+
     /* Get the schedule parameter */
     status_t (*get_sched_param)
         (
@@ -126,10 +133,14 @@ typedef struct sched_policy
         struct sched_thread * thread
         );
 
-    /* Scheduling decisions at periodic clock tick */
+    /* 
+     * Scheduling decisions at periodic clock tick, the thread has run
+     * for 'ran_ns' nanoseconds since the last tick or its resume
+     */
     BOOL    (*sched_clock_tick)
         (
-        struct sched_thread * thread
+        struct sched_thread * thread,
+        abstime_t             ran_ns
         );
 
     /* Priority update */
@@ -170,12 +181,13 @@ typedef struct sched_policy
     
 /* TRUE if the policy1 has better precedence than policy2 */
 #define SCHED_POLICY_PRECEDENCE_COMPARE(policy1, policy2)\
-    ((policy1)->precedence < (policy1)->precedence)
+    ((policy1)->precedence < (policy2)->precedence)
 
 /* TRUE if the thread1 has better precedence than thread2 */
 #define SCHED_THREAD_PRECEDENCE_COMPARE(thread1, thread2)\
-    (((thread1)->sched_policy->precedence < (thread1)->sched_policy->precedence) ? \
-      TRUE :                                             \
+    (((thread1)->sched_policy != (thread2)->sched_policy) ? \
+     ((thread1)->sched_policy->precedence <              \
+      (thread2)->sched_policy->precedence) :             \
      (thread1)->sched_policy->thread_precedence_compare((thread1), (thread2)))
 
 status_t sched_policy_init (void);
@@ -192,4 +204,23 @@ struct sched_thread * sched_find_best_thread
     struct sched_thread * check
     );
 
+struct sched_cpu * sched_select_cpu
+    (
+    struct sched_thread * thread
+    );
+
+bool sched_thread_wakeup
+    (
+    struct sched_thread * thread
+    );
+
+bool sched_thread_handoff
+    (
+    struct sched_thread * thread
+    );
+
+struct sched_thread * sched_balance_idle (void);
+
+void sched_balance_tick (void);
+
 #endif /* _OS_SCHED_CLASS_H */
@@ -14,6 +14,9 @@ typedef struct sched_rr_param
     {
     /* Current scheduling priority */
 	int     sched_priority;
+
+    /* Set when the time slice ran out, until the thread is requeued */
+    BOOL    slice_expired;
     }sched_rr_param_t;
 
 extern sched_policy_t   sched_policy_rr;
@@ -36,5 +36,8 @@ typedef struct sched_semaphore
     int magic;
     } sched_semaphore_t;
 
+/* Semaphores allocated by the kernel rather than embedded by their user */
+extern kmem_cache_t sched_sem_cache;
+
 
 #endif /* _OS_SCHED_SEM_H */
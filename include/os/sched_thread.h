@@ -10,6 +10,7 @@
 #include <pthread.h>
 #include <os/queue.h>
 #include <os/list.h>
+#include <os/timer.h>
 
 /* Thread States */
 typedef enum sched_thread_state
@@ -71,6 +72,9 @@ typedef struct sched_thread
     /* The thread state */
     SCHED_THREAD_STATE   state;          
 
+    /* Set while a cpu runs the thread, until its context is saved */
+    volatile BOOL   on_cpu;
+
     /* Node to link to the global thread list */
     list_t          global_list_node;           
 
@@ -139,17 +143,20 @@ typedef struct sched_thread
     /* The thread resume cycle recorded at reschedule (in CPU HZ) */
     abstime_t        resume_cycle;
 
-    /* The expected thread resume time (in scheduler HZ) */
+    /* The CLOCK_MONOTONIC time a timed wait or a sleep ends at (in ns) */
     abstime_t        resume_time;
 
-    /* Wait timeout (mutex, semaphore, msgQ, ..., one at a time) */
-    int             timeout;
+    /* Timer waking the thread at resume_time */
+    ktimer_t        wait_timer;
+
+    /* Set by the first of the waker and the wait timer to wake the thread */
+    atomic_t        wait_woken;
 
     /* Initial time slice */
     int             sched_time_slice;  
 
-    /* Remianing time slice */
-    int             remain_time_slice;  
+    /* Remianing time slice (in nanosecond) */
+    abstime_t       remain_time_slice;  
 
     interval_timer_t * itimer_PROF;
     interval_timer_t * itimer_REAL;
@@ -158,9 +165,15 @@ typedef struct sched_thread
     /* Thread errno */
     int             err;
 
-    /* List of all mutexes owned by thread */
+    /* List of priority inheritance/ceiling mutexes owned by thread */
     list_t          mutex_list; 
 
+    /* Priority before any boosting by the mutexes in mutex_list */
+    int             base_priority;
+
+    /* Mutex the thread is pending on, for priority inheritance chains */
+    struct sched_mutex * pending_mutex;
+
     /* Wait queue node */
 
     qelement_t      waitq_node;
@@ -359,6 +372,30 @@ status_t sched_thread_remove_suspended
 
 char * sched_thread_state_name(int state);
 
+void sched_thread_wait_deadline_set
+    (
+    abstime_t deadline
+    );
+
+void sched_thread_wait_deadline_clear (void);
+
+void sched_thread_sleep_until
+    (
+    abstime_t deadline
+    );
+
+/*
+ * Claim the wakeup of a thread taken off a waitq. Only the first of its
+ * waker and its wait timer gets it, the other one shall leave it alone.
+ */
+static inline BOOL sched_thread_wait_claim
+    (
+    struct sched_thread * thread
+    )
+    {
+    return atomic_cmpxchg(&thread->wait_woken, 0, 1) == 0;
+    }
+
 /* Non-portable version interfaces are defined in private files */
 
 /* Flags for pthread_resume_np() */
@@ -0,0 +1,140 @@
+/* seqlock.h - sequence counters and sequential locks */
+
+#ifndef _OS_SEQLOCK_H
+#define _OS_SEQLOCK_H
+
+#include <sys.h>
+#include <arch.h>
+
+/*
+ * A sequence counter lets readers access data without taking any lock.
+ * The writer makes the counter odd while it updates the data and even
+ * again when it is done. A reader samples the counter before and after
+ * reading the data and retries if a writer was active meanwhile.
+ *
+ * Writers must be serialized by the caller (or use seqlock_t). Readers
+ * must only copy the protected data and act on it after a successful
+ * read_seqcount_retry().
+ *
+ * X86 does not reorder loads with other loads nor stores with other
+ * stores, so only compiler barriers are needed on the read side.
+ */
+
+typedef struct seqcount
+    {
+    volatile unsigned int sequence;
+    } seqcount_t;
+
+#define SEQCOUNT_INITIALIZER    { 0 }
+
+static inline void seqcount_init
+    (
+    seqcount_t * s
+    )
+    {
+    s->sequence = 0;
+    }
+
+/* Start a read section, waiting for a writer in progress to finish */
+static inline unsigned int read_seqcount_begin
+    (
+    const seqcount_t * s
+    )
+    {
+    unsigned int seq;
+
+    while ((seq = s->sequence) & 1)
+        cpu_relax();
+
+    COMPILER_ENTER_BARRIER();
+
+    return seq;
+    }
+
+/* Return non-zero if the read section started at <start> must be retried */
+static inline int read_seqcount_retry
+    (
+    const seqcount_t * s,
+    unsigned int       start
+    )
+    {
+    COMPILER_LEAVE_BARRIER();
+
+    return s->sequence != start;
+    }
+
+static inline void write_seqcount_begin
+    (
+    seqcount_t * s
+    )
+    {
+    s->sequence++;
+
+    write_barrier();
+    }
+
+static inline void write_seqcount_end
+    (
+    seqcount_t * s
+    )
+    {
+    write_barrier();
+
+    s->sequence++;
+    }
+
+/* A sequence counter whose writers are serialized by a spinlock */
+
+typedef struct seqlock
+    {
+    seqcount_t seqcount;
+    spinlock_t lock;
+    } seqlock_t;
+
+static inline void seqlock_init
+    (
+    seqlock_t * sl
+    )
+    {
+    seqcount_init(&sl->seqcount);
+    spinlock_init(&sl->lock);
+    }
+
+static inline unsigned int read_seqbegin
+    (
+    const seqlock_t * sl
+    )
+    {
+    return read_seqcount_begin(&sl->seqcount);
+    }
+
+static inline int read_seqretry
+    (
+    const seqlock_t * sl,
+    unsigned int      start
+    )
+    {
+    return read_seqcount_retry(&sl->seqcount, start);
+    }
+
+static inline void write_seqlock
+    (
+    seqlock_t * sl
+    )
+    {
+    spinlock_lock(&sl->lock);
+
+    write_seqcount_begin(&sl->seqcount);
+    }
+
+static inline void write_sequnlock
+    (
+    seqlock_t * sl
+    )
+    {
+    write_seqcount_end(&sl->seqcount);
+
+    spinlock_unlock(&sl->lock);
+    }
+
+#endif /* _OS_SEQLOCK_H */
@@ -7,6 +7,7 @@
 #include <sys/time.h>
 #include <os/clockeventer.h>
 #include <os/rbtree.h>
+#include <os/list.h>
 
 #if 0
 /*
@@ -88,11 +89,104 @@ static inline void timerchain_init_head(struct timerchain_head *head)
     head->earliest = NULL;
     }
 
+/*
+ * Each CPU keeps a hierarchical timer wheel of the kernel timers armed on
+ * it. Level 0 has one slot per TIMER_WHEEL_GRANULE_NS, each next level
+ * has slots TIMER_WHEEL_SLOTS times coarser, whose timers are cascaded
+ * down as the wheel turns. Arming and cancelling a timer is a list 
+ * operation under the lock of its CPU, and each tick of a CPU runs all 
+ * of its expired timers.
+ *
+ * Expiry times are CLOCK_MONOTONIC nanoseconds, and timers fire on the
+ * first tick at or after it. The timerchain rbtree above is kept for
+ * users which need the exact ordering of their expiry times.
+ */
+
+#define TIMER_WHEEL_BITS        6
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS      5
+#define TIMER_WHEEL_GRANULE_NS  HZ2NSECS(CONFIG_HZ)
+
+/*
+ * Granules the wheel spans, about 124 days at 100 Hz, later timers wait
+ * in the last level
+ */
+#define TIMER_WHEEL_SPAN        (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+struct timer_wheel;
+
+typedef void (*ktimer_func_t)(void * arg);
+
+typedef struct ktimer
+    {
+    list_t                  node;       /* node in its wheel slot */
+    struct timer_wheel *    wheel;      /* wheel it is armed on, or NULL */
+    abstime_t               expires;    /* CLOCK_MONOTONIC expiry, in ns */
+    ktimer_func_t           func;       /* function to call */
+    void *                  arg;        /* function argument */
+    } ktimer_t;
+
+typedef struct timer_wheel
+    {
+    spinlock_t  lock;
+    uint64_t    clk;            /* next granule to run */
+    size_t      nr_pending;     /* timers armed */
+    size_t      nr_fired;       /* timers run */
+    ktimer_t * volatile running; /* timer whose function is running */
+    list_t      slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    } __attribute__((aligned(X64_CACHE_LINE_SIZE))) timer_wheel_t;
+
+void timer_wheel_init (void);
+
+void timer_wheel_run (void);
+
+abstime_t timer_wheel_next_expiry (void);
+
+void ktimer_init
+    (
+    ktimer_t *      timer,
+    ktimer_func_t   func,
+    void *          arg
+    );
+
+void ktimer_arm
+    (
+    ktimer_t *      timer,
+    abstime_t       expires
+    );
+
+BOOL ktimer_cancel
+    (
+    ktimer_t *      timer
+    );
+
+BOOL ktimer_cancel_sync
+    (
+    ktimer_t *      timer
+    );
+
+static inline BOOL ktimer_pending
+    (
+    ktimer_t *      timer
+    )
+    {
+    return timer->wheel != NULL;
+    }
+
+int ktimer_deadline
+    (
+    clockid_t                   clock_id,
+    int                         flags,
+    const struct timespec *     ts,
+    abstime_t *                 deadline
+    );
+
 typedef void (*interval_timer_handler_t)(void * arg);
 
 typedef struct interval_timer
     {
-    struct timerchain_node timer_node; /* timer node */
+    ktimer_t timer;                    /* timer armed on the wheel */
     id_t timer_id;  /* ITIMER_PROF, ITIMER_REAL, and ITIMER_VIRTUAL */
     struct itimerval timerval;         /* current value */
     BOOL enabled;   /* Is this interval timer enabled */
@@ -102,8 +196,6 @@ typedef struct interval_timer
     void * arg;     /* argument to the fire handler */
     }interval_timer_t;
 
-void itimer_callback_handler(void);
-
 #define TWO_SECONDS_NS (NSECS_PER_SEC * 2)
 #define TWO_SECONDS_US (USECS_PER_SEC * 2)
 #define ABSTIME_INFINITY 0x7fffFfffFfffFfffLL
@@ -210,16 +302,16 @@ static inline abstime_t timeval_to_abstime(timeval_t * t)
 
 static inline timespec_t * abstime_to_timespec(abstime_t abst, timespec_t * ts)
     {
-    ts->tv_sec = (abst % NSECS_PER_SEC); 
-    ts->tv_nsec = (abst / NSECS_PER_SEC);
+    ts->tv_sec = (abst / NSECS_PER_SEC); 
+    ts->tv_nsec = (abst % NSECS_PER_SEC);
 
     return ts;
     }
 
 static inline timeval_t * abstime_to_timeval(abstime_t abst, timeval_t * tv)
     {
-    tv->tv_sec = (abst % USECS_PER_SEC); 
-    tv->tv_usec = (abst / USECS_PER_SEC);
+    tv->tv_sec = (abst / NSECS_PER_SEC); 
+    tv->tv_usec = NSECS2USECS(abst % NSECS_PER_SEC);
 
     return tv;
     }
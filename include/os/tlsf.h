@@ -24,6 +24,8 @@ extern size_t get_used_size(void *);
 extern size_t get_max_size(void *);
 extern void destroy_memory_pool(void *);
 extern size_t add_new_area(void *, size_t, void *);
+extern size_t add_new_area_unmerged(void *, size_t, void *);
+extern int remove_free_area(void *, void *);
 extern void *malloc_ex(size_t, void *);
 extern void free_ex(void *, void *);
 extern void *realloc_ex(void *, size_t, void *);
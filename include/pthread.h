@@ -125,6 +125,7 @@ struct pthread_key_data
 #define PTHREAD_MUTEX_ERRORCHECK	2
 #define PTHREAD_MUTEX_RECURSIVE		3
 #define PTHREAD_MUTEX_ADAPTIVE      4
+#define PTHREAD_MUTEX_ADAPTIVE_NP   PTHREAD_MUTEX_ADAPTIVE
 
 /* Mutex robus attribute */
 #define PTHREAD_MUTEX_STALLED       0
@@ -70,6 +70,7 @@ struct sigevent;
 #define CLOCK_MONOTONIC             0x02
 #define CLOCK_THREAD_CPUTIME_ID     0x03
 #define CLOCK_PROCESS_CPUTIME_ID    0x04
+#define CLOCK_MONOTONIC_RAW         0x05
 
 /*
  * TIMER_ABSTIME
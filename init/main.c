@@ -1,6 +1,7 @@
 #include <sys.h>
 #include <arch.h>
 #include <os.h>
+#include <os/mm_region.h>
 
 void defaul_sighandler(int sig)
     {
@@ -38,25 +39,6 @@ CELL_OS_CMD(
     "test itimer and thread based signal handling\n"
     );
 
-void cpu_heart_beat (int cpu)
-    {
-    volatile uint8_t *vidmem = (volatile uint8_t *)VGA_TEXT_MODE_KERN_BASE_ADDR;
-    int      count = 0;
-
-    /* Let's do a heart beat show! */
-
-    count = 0;
-    while (TRUE)
-        {
-        vidmem[86 + (cpu * 2)] = 'A' + count++;
-        
-        if (count >= 26) 
-            count = 0;
-        
-        sched_yield();
-        }
-    }
-
 void *sched_bsp_idle_thread (void *notused)
     {
     interrupts_disable();
@@ -92,11 +74,13 @@ void *sched_bsp_idle_thread (void *notused)
 
     interrupts_enable();
 
+    tlb_cpu_online();
+
     thread_create_test();
 
     lapic_ipi(1, 0, INTR_LAPIC_RESCHEDULE);
 
-    cpu_heart_beat(this_cpu());
+    sched_idle_loop();
     }
 
 void *sched_ap_idle_thread (void *notused)
@@ -107,14 +91,15 @@ void *sched_ap_idle_thread (void *notused)
 
     interrupts_enable();
 
+    tlb_cpu_online();
+
     thread_create_test();
     
-    cpu_heart_beat(this_cpu());
+    sched_idle_loop();
     }
 
 void main (uint32_t mboot_magic, uint32_t mboot_info)
     {
-    multiboot_memmap_t *first_free;
     uint64_t *new_stack;
 
     asm volatile ("cli");
@@ -123,6 +108,9 @@ void main (uint32_t mboot_magic, uint32_t mboot_info)
 
     x64_gdt_init();
 
+    /* The BSP is always CPU 0 */
+    percpu_init(0);
+
     x64_idt_init();
 
     vga_console_init();
@@ -131,27 +119,25 @@ void main (uint32_t mboot_magic, uint32_t mboot_info)
     printk("||==Welcome to CELLOS 64 bit==||");
     printk("\n================================\n");
     
-    /* Read mboot header */
+    /* Read mboot header and register the physical memory map */
 
-    first_free = mboot_init(mboot_info, mboot_magic);
+    mboot_init(mboot_info, mboot_magic);
 
-    if (first_free == NULL)
+    if (mm_region_usable_high() == 0)
         {
         panic("No free memory for use! STOP~!\n");
         }
 
     mb_parse_kernel_image();
     
-    paging_init(first_free->base_addr,
-                    first_free->base_addr + first_free->length);
+    paging_init(mm_region_usable_low(), mm_region_usable_high());
 
     /* Init page allocator */
 
     page_alloc_init(mem_get_low_addr(),mem_get_high_addr());
 
-    /* Initialize the memory pool */
-    init_memory_pool(CONFIG_KHEAP_SIZE,
-                    (void *)page_alloc_contig(CONFIG_KHEAP_SIZE/PAGE_SIZE));
+    /* Initialize the kernel heap arena of the boot CPU */
+    kmalloc_init();
 
     detect_cpu();
 
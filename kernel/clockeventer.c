@@ -2,10 +2,29 @@
 
 #include <sys.h>
 #include <arch.h>
+#include <os.h>
 #include <os/list.h>
 
 struct clockeventer * global_tick_eventer = NULL;
 
+/*
+ * The scheduling tick and the timer wheel of each CPU are driven by its
+ * own clock eventer. Once the clock counter is up, the eventer runs in
+ * one-shot mode: it is armed for the earlier of the next tick and the
+ * next timer expiry, so the timers fire when they are due rather than on
+ * the following tick.
+ */
+typedef struct tick_percpu
+    {
+    clockeventer_t *    eventer;
+    BOOL                oneshot;    /* The tick is emulated on one-shots */
+    abstime_t           next_tick;  /* CLOCK_MONOTONIC ns of the next tick */
+    abstime_t           next_event; /* CLOCK_MONOTONIC ns it is armed for */
+    uint64_t            nr_events;
+    }tick_percpu_t;
+
+static tick_percpu_t tick_percpu[CONFIG_NR_CPUS];
+
 static list_t clockeventer_list;
 static spinlock_t clockeventer_list_lock;
 
@@ -28,8 +47,6 @@ void clockeventer_tick_handler(struct clockeventer * eventer, void * arg)
      */
     real_wall_time_regular_update();
     
-    itimer_callback_handler();
-    
     if (eventer->mode == CLOCK_EVENTER_MODE_ONESHOT)
         eventer->start(eventer, eventer->mode, eventer->expire);
     }
@@ -173,7 +190,9 @@ status_t clockeventer_subsystem_init(void)
 
 void tick_eventer_init(void)
     {
-    global_tick_eventer = clockeventer_select(CLOCK_EVENTER_FLAGS_PERIODIC, 
+    /* The per-CPU eventers only interrupt their own CPU */
+    global_tick_eventer = clockeventer_select(CLOCK_EVENTER_FLAGS_PERIODIC |
+                                   CLOCK_EVENTER_FLAGS_PERCPU, 
                                    CLOCK_EVENTER_FLAGS_PERIODIC, MSECS2NSECS(1));
 
     if (global_tick_eventer)
@@ -187,3 +206,232 @@ void tick_eventer_init(void)
             CLOCK_EVENTER_MODE_PERIODIC, HZ2NSECS(CONFIG_HZ));
         }
     }
+
+/* One-shot events need CLOCK_MONOTONIC, which needs a clock counter */
+static inline BOOL tick_percpu_oneshot_usable
+    (
+    tick_percpu_t * tick
+    )
+    {
+    return (tick->eventer->flags & CLOCK_EVENTER_FLAGS_ONESHOT) &&
+           (global_clockcounter != NULL);
+    }
+
+/*
+ * Arm the eventer of this CPU for the next tick or the next timer expiry,
+ * whichever comes first. Called with interrupts disabled.
+ */
+static void tick_percpu_program
+    (
+    tick_percpu_t * tick,
+    abstime_t       now
+    )
+    {
+    abstime_t expires = timer_wheel_next_expiry();
+    abstime_t delta;
+
+    if (expires > tick->next_tick)
+        expires = tick->next_tick;
+
+    delta = expires - now;
+
+    if (delta < tick->eventer->min_period_ns)
+        delta = tick->eventer->min_period_ns;
+
+    /* A far event is split, the early interrupt arms the rest */
+    if (delta > tick->eventer->max_period_ns)
+        delta = tick->eventer->max_period_ns;
+
+    tick->next_event = now + delta;
+
+    clockeventer_start(tick->eventer, CLOCK_EVENTER_MODE_ONESHOT, delta);
+    }
+
+static void tick_percpu_handler
+    (
+    struct clockeventer *   eventer,
+    void *                  arg
+    )
+    {
+    tick_percpu_t * tick = &tick_percpu[this_cpu()];
+    abstime_t now;
+
+    tick->nr_events++;
+
+    if (!tick->oneshot)
+        {
+        /* Leave the boot time periodic tick once the clock counter is up */
+        if (tick_percpu_oneshot_usable(tick))
+            tick_percpu_start();
+        else if ((eventer->mode == CLOCK_EVENTER_MODE_ONESHOT) &&
+                 !kurrent_cpu->tick_stopped)
+            clockeventer_start(eventer, CLOCK_EVENTER_MODE_ONESHOT, 
+                               HZ2NSECS(CONFIG_HZ));
+
+        sched_tick(NULL);
+
+        return;
+        }
+
+    now = get_monotonic_nanosecond();
+
+    timer_wheel_run();
+
+    if (now < tick->next_tick)
+        {
+        tick_percpu_program(tick, now);
+
+        return;
+        }
+
+    tick->next_tick += HZ2NSECS(CONFIG_HZ);
+
+    if (tick->next_tick <= now)
+        tick->next_tick = now + HZ2NSECS(CONFIG_HZ);
+
+    /* Arm the next event first, sched_tick() may switch threads */
+    tick_percpu_program(tick, now);
+
+    sched_tick(NULL);
+    }
+
+/*
+ * tick_percpu_eventer_init - drive the tick and the timers of the current
+ * CPU with a per-CPU clock eventer, and start the tick
+ *
+ * Called on the CPU the eventer belongs to, with interrupts disabled.
+ */
+status_t tick_percpu_eventer_init
+    (
+    clockeventer_t *    eventer
+    )
+    {
+    tick_percpu_t * tick = &tick_percpu[this_cpu()];
+    status_t ret;
+
+    ret = clockeventer_setup(eventer, tick_percpu_handler, NULL);
+
+    if (ret != OK)
+        return ret;
+
+    tick->eventer = eventer;
+
+    printk("cpu%d - tick eventer %s\n", this_cpu(), eventer->name);
+
+    return tick_percpu_start();
+    }
+
+/*
+ * tick_percpu_start - (re)start the periodic tick of the current CPU
+ *
+ * Called with interrupts disabled.
+ */
+status_t tick_percpu_start (void)
+    {
+    tick_percpu_t * tick = &tick_percpu[this_cpu()];
+    abstime_t now;
+
+    if (tick->eventer == NULL)
+        return ENODEV;
+
+    if (tick_percpu_oneshot_usable(tick))
+        {
+        now = get_monotonic_nanosecond();
+
+        tick->oneshot = TRUE;
+        tick->next_tick = now + HZ2NSECS(CONFIG_HZ);
+
+        tick_percpu_program(tick, now);
+
+        return OK;
+        }
+
+    tick->oneshot = FALSE;
+
+    if (tick->eventer->flags & CLOCK_EVENTER_FLAGS_PERIODIC)
+        return clockeventer_start(tick->eventer, 
+                                  CLOCK_EVENTER_MODE_PERIODIC, 
+                                  HZ2NSECS(CONFIG_HZ));
+
+    /* Re-armed on each event by tick_percpu_handler() */
+    return clockeventer_start(tick->eventer, CLOCK_EVENTER_MODE_ONESHOT, 
+                              HZ2NSECS(CONFIG_HZ));
+    }
+
+/*
+ * tick_percpu_stop - stop the periodic tick of the current CPU and get
+ * one tick after 'sleep_ns' instead; the timers still fire on time
+ *
+ * Called with interrupts disabled.
+ */
+status_t tick_percpu_stop
+    (
+    abstime_t   sleep_ns
+    )
+    {
+    tick_percpu_t * tick = &tick_percpu[this_cpu()];
+    abstime_t now;
+
+    if (tick->eventer == NULL)
+        return ENODEV;
+
+    if (!tick->oneshot)
+        return clockeventer_start(tick->eventer, 
+                                  CLOCK_EVENTER_MODE_ONESHOT, sleep_ns);
+
+    now = get_monotonic_nanosecond();
+
+    tick->next_tick = now + sleep_ns;
+
+    tick_percpu_program(tick, now);
+
+    return OK;
+    }
+
+/*
+ * tick_percpu_timer_armed - a timer was armed on the wheel of the current
+ * CPU, bring its event forward if the timer expires earlier
+ *
+ * Called with interrupts disabled.
+ */
+void tick_percpu_timer_armed
+    (
+    abstime_t   expires
+    )
+    {
+    tick_percpu_t * tick = &tick_percpu[this_cpu()];
+
+    if (!tick->oneshot || (expires >= tick->next_event))
+        return;
+
+    tick_percpu_program(tick, get_monotonic_nanosecond());
+    }
+
+int do_tickdev (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    tick_percpu_t * tick;
+    int i;
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        tick = &tick_percpu[i];
+
+        if (tick->eventer == NULL)
+            continue;
+
+        printk("cpu%d - %s %s, next tick %lld ns, next event %lld ns, "
+            "%lld events\n", i, tick->eventer->name,
+            tick->oneshot ? "one-shot" : "periodic",
+            (long long)tick->next_tick, (long long)tick->next_event,
+            (long long)tick->nr_events);
+        }
+
+    return 0;
+    }
+
+CELL_OS_CMD(
+    tickdev,   1,        1,    do_tickdev,
+    "show the per-CPU tick eventers",
+    "show the clock eventer driving the tick and the timers of each CPU,\n"
+    "its mode, the next tick and event times and the number of events\n"
+    );
@@ -0,0 +1,231 @@
+/* epoch.c - epoch based deferred reclamation */
+
+#include <sys.h>
+#include <arch.h>
+#include <os.h>
+#include <os/epoch.h>
+
+/*
+ * Each CPU publishes the global epoch it entered its read section in, or
+ * 0 outside of one. The global epoch only advances when every CPU in a
+ * read section has entered it in the current epoch. An object unlinked in
+ * epoch e may be seen by readers of e - 1 and e, which are all gone once
+ * the global epoch reaches e + 2.
+ */
+
+typedef struct epoch_cpu
+    {
+    volatile uint64_t   epoch;
+    uint64_t            nest;
+    } __attribute__((aligned(X64_CACHE_LINE_SIZE))) epoch_cpu_t;
+
+typedef struct epoch_defer_item
+    {
+    struct epoch_defer_item *   next;
+    epoch_func_t                func;
+    void *                      arg;
+    uint64_t                    epoch;
+    } epoch_defer_item_t;
+
+static epoch_cpu_t          epoch_cpus[CONFIG_NR_CPUS];
+static volatile uint64_t    epoch_global = 1;
+
+/* Deferred items, oldest first */
+static epoch_defer_item_t * epoch_head = NULL;
+static epoch_defer_item_t * epoch_tail = NULL;
+static SPINLOCK_DECLARE(epoch_lock);
+
+static atomic64_t epoch_nr_deferred = ATOMIC64_INIT(0);
+static atomic64_t epoch_nr_reclaimed = ATOMIC64_INIT(0);
+
+static KMEM_CACHE_DECLARE(epoch_defer_cache, "epoch_defer",
+                          sizeof(epoch_defer_item_t), 0, NULL);
+
+/* epoch_enter - enter a read section, returns the interrupt state to restore */
+ipl_t epoch_enter(void)
+    {
+    epoch_cpu_t * ec;
+    ipl_t flags;
+
+    flags = interrupts_disable();
+
+    ec = &epoch_cpus[this_cpu()];
+
+    /* The locked exchange orders the epoch store before the reads */
+
+    if (ec->nest++ == 0)
+        (void)xchg(&ec->epoch, epoch_global);
+
+    return flags;
+    }
+
+/* epoch_exit - leave a read section entered by epoch_enter() */
+void epoch_exit
+    (
+    ipl_t   flags
+    )
+    {
+    epoch_cpu_t * ec = &epoch_cpus[this_cpu()];
+
+    ASSERT(ec->nest);
+
+    if (--ec->nest == 0)
+        {
+        /* The reads of the section are done before the epoch is cleared */
+        barrier();
+
+        ec->epoch = 0;
+        }
+
+    interrupts_restore(flags);
+    }
+
+/* Advance the global epoch if every CPU in a read section has seen it */
+static void epoch_advance(void)
+    {
+    uint64_t global = epoch_global;
+    uint64_t epoch;
+    int i;
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        epoch = epoch_cpus[i].epoch;
+
+        if (epoch && (epoch != global))
+            return;
+        }
+
+    (void)cmpxchg(&epoch_global, global, global + 1);
+    }
+
+/*
+ * epoch_synchronize - wait until the readers which may have seen what was
+ * unlinked before the call are gone, must not be called in a read section
+ */
+void epoch_synchronize(void)
+    {
+    uint64_t target;
+
+    ASSERT(!epoch_cpus[this_cpu()].nest);
+
+    memory_barrier();
+
+    target = epoch_global + 2;
+
+    while (epoch_global < target)
+        {
+        epoch_advance();
+
+        cpu_relax();
+        }
+    }
+
+/*
+ * epoch_defer - call func(arg) once the readers which may have seen what
+ * was unlinked before the call are gone
+ *
+ * Waits for them if no deferral record can be allocated.
+ */
+void epoch_defer
+    (
+    epoch_func_t    func,
+    void *          arg
+    )
+    {
+    epoch_defer_item_t * item;
+
+    item = kmem_cache_alloc(&epoch_defer_cache);
+
+    if (!item)
+        {
+        epoch_synchronize();
+
+        func(arg);
+
+        return;
+        }
+
+    item->next = NULL;
+    item->func = func;
+    item->arg = arg;
+
+    memory_barrier();
+
+    spinlock_lock(&epoch_lock);
+
+    item->epoch = epoch_global;
+
+    if (epoch_tail)
+        epoch_tail->next = item;
+    else
+        epoch_head = item;
+
+    epoch_tail = item;
+
+    spinlock_unlock(&epoch_lock);
+
+    atomic64_inc(&epoch_nr_deferred);
+
+    epoch_reclaim();
+    }
+
+/*
+ * epoch_reclaim - advance the epoch and run the deferred calls which are
+ * safe, called from thread context only
+ */
+void epoch_reclaim(void)
+    {
+    epoch_defer_item_t * done = NULL;
+    epoch_defer_item_t * item;
+
+    if (!epoch_head)
+        return;
+
+    epoch_advance();
+
+    spinlock_lock(&epoch_lock);
+
+    while (epoch_head && (epoch_head->epoch + 2 <= epoch_global))
+        {
+        item = epoch_head;
+
+        epoch_head = item->next;
+
+        item->next = done;
+        done = item;
+        }
+
+    if (!epoch_head)
+        epoch_tail = NULL;
+
+    spinlock_unlock(&epoch_lock);
+
+    while (done)
+        {
+        item = done;
+        done = item->next;
+
+        item->func(item->arg);
+
+        kmem_cache_free(&epoch_defer_cache, item);
+
+        atomic64_inc(&epoch_nr_reclaimed);
+        }
+    }
+
+int do_epoch (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    printk("epoch %lld, %lld deferred, %lld reclaimed\n",
+        (long long)epoch_global,
+        (long long)atomic64_read(&epoch_nr_deferred),
+        (long long)atomic64_read(&epoch_nr_reclaimed));
+
+    return 0;
+    }
+
+CELL_OS_CMD(
+    epoch,   1,        1,    do_epoch,
+    "show deferred reclamation state",
+    "show the global epoch and the number of deferred and reclaimed\n"
+    "objects\n"
+    );
@@ -0,0 +1,424 @@
+/* kmem_cache.c - slab object caches */
+
+#include <sys.h>
+#include <arch.h>
+#include <os.h>
+#include <os/kmem_cache.h>
+
+/*
+ * A slab starts with its header, followed by the free index array and
+ * the objects. The free objects of a slab are chained through the index
+ * array rather than through the objects, which keeps them constructed.
+ * Slabs are a power of two pages, so the page allocator aligns them on
+ * their size and the slab of an object is found by masking its address.
+ */
+
+#define KMEM_SLAB_FREE_END      0xFFFF
+
+typedef struct kmem_slab
+    {
+    list_t          node;
+    kmem_cache_t *  cache;
+    unsigned int    nr_inuse;
+    unsigned int    free;
+    uint16_t        next[];
+    } kmem_slab_t;
+
+static LIST_DECLARE(kmem_cache_list);
+static SPINLOCK_DECLARE(kmem_cache_list_lock);
+
+static inline size_t kmem_slab_bytes
+    (
+    kmem_cache_t *  cache
+    )
+    {
+    return cache->slab_pages * PAGE_SIZE;
+    }
+
+static inline kmem_slab_t * kmem_obj_to_slab
+    (
+    kmem_cache_t *  cache,
+    void *          obj
+    )
+    {
+    return (kmem_slab_t *)((cpu_addr_t)obj & ~(kmem_slab_bytes(cache) - 1));
+    }
+
+/* Set up the slab layout of a cache, called with the cache lock held */
+static void kmem_cache_layout
+    (
+    kmem_cache_t *  cache
+    )
+    {
+    size_t bytes, n;
+
+    if (cache->align < sizeof(void *))
+        cache->align = sizeof(void *);
+
+    cache->obj_size = ALIGN_UP(cache->size, cache->align);
+
+    for (cache->slab_pages = 1; ; cache->slab_pages <<= 1)
+        {
+        bytes = kmem_slab_bytes(cache);
+
+        n = (bytes - sizeof(kmem_slab_t)) /
+            (cache->obj_size + sizeof(uint16_t));
+
+        if (n >= KMEM_SLAB_FREE_END)
+            n = KMEM_SLAB_FREE_END - 1;
+
+        while (n && (ALIGN_UP(sizeof(kmem_slab_t) + n * sizeof(uint16_t),
+                              cache->align) + n * cache->obj_size > bytes))
+            n--;
+
+        if ((n >= KMEM_SLAB_MIN_OBJS) ||
+            (cache->slab_pages >= KMEM_SLAB_MAX_PAGES))
+            break;
+        }
+
+    cache->objs_per_slab = n;
+    cache->objs_offset = ALIGN_UP(sizeof(kmem_slab_t) + n * sizeof(uint16_t),
+                                  cache->align);
+
+    spinlock_lock(&kmem_cache_list_lock);
+
+    list_append(&kmem_cache_list, &cache->node);
+
+    spinlock_unlock(&kmem_cache_list_lock);
+    }
+
+/* Create a slab and construct its objects, called with the cache lock held */
+static kmem_slab_t * kmem_slab_create
+    (
+    kmem_cache_t *  cache
+    )
+    {
+    kmem_slab_t * slab;
+    unsigned int i;
+
+    if (!cache->objs_per_slab)
+        {
+        kmem_cache_layout(cache);
+
+        if (!cache->objs_per_slab)
+            {
+            printk("kmem_cache %s: %lld bytes objects do not fit a slab\n",
+                cache->name, (long long)cache->size);
+
+            return NULL;
+            }
+        }
+
+    slab = page_alloc_contig((int)cache->slab_pages);
+
+    if (!slab)
+        return NULL;
+
+    ASSERT(((cpu_addr_t)slab & (kmem_slab_bytes(cache) - 1)) == 0);
+
+    slab->cache = cache;
+    slab->nr_inuse = 0;
+    slab->free = 0;
+
+    for (i = 0; i < cache->objs_per_slab; i++)
+        {
+        slab->next[i] = (i + 1 < cache->objs_per_slab) ?
+                        (uint16_t)(i + 1) : KMEM_SLAB_FREE_END;
+
+        if (cache->ctor)
+            cache->ctor((char *)slab + cache->objs_offset +
+                        i * cache->obj_size);
+        }
+
+    list_append(&cache->slabs_empty, &slab->node);
+
+    cache->nr_slabs++;
+    cache->nr_empty++;
+
+    return slab;
+    }
+
+/* Take an object out of the slabs, called with the cache lock held */
+static void * kmem_slab_obj_get
+    (
+    kmem_cache_t *  cache
+    )
+    {
+    kmem_slab_t * slab;
+    void * obj;
+
+    if (!LIST_EMPTY(&cache->slabs_partial))
+        slab = LIST_ENTRY(cache->slabs_partial.next, kmem_slab_t, node);
+    else if (!LIST_EMPTY(&cache->slabs_empty))
+        slab = LIST_ENTRY(cache->slabs_empty.next, kmem_slab_t, node);
+    else if ((slab = kmem_slab_create(cache)) == NULL)
+        return NULL;
+
+    obj = (char *)slab + cache->objs_offset + slab->free * cache->obj_size;
+
+    slab->free = slab->next[slab->free];
+
+    if (slab->nr_inuse++ == 0)
+        {
+        cache->nr_empty--;
+
+        list_remove(&slab->node);
+        list_append(&cache->slabs_partial, &slab->node);
+        }
+
+    if (slab->nr_inuse == cache->objs_per_slab)
+        {
+        list_remove(&slab->node);
+        list_append(&cache->slabs_full, &slab->node);
+        }
+
+    cache->nr_active++;
+
+    return obj;
+    }
+
+/*
+ * Give an object back to its slab, called with the cache lock held.
+ * Only one empty slab is kept, the others go back to the page allocator.
+ */
+static void kmem_slab_obj_put
+    (
+    kmem_cache_t *  cache,
+    void *          obj
+    )
+    {
+    kmem_slab_t * slab = kmem_obj_to_slab(cache, obj);
+    unsigned int idx;
+
+    ASSERT(slab->cache == cache);
+
+    idx = ((char *)obj - ((char *)slab + cache->objs_offset)) /
+          cache->obj_size;
+
+    slab->next[idx] = (uint16_t)slab->free;
+    slab->free = idx;
+
+    if (slab->nr_inuse-- == cache->objs_per_slab)
+        {
+        list_remove(&slab->node);
+        list_append(&cache->slabs_partial, &slab->node);
+        }
+
+    if (slab->nr_inuse == 0)
+        {
+        list_remove(&slab->node);
+
+        if (cache->nr_empty)
+            {
+            cache->nr_slabs--;
+
+            page_free(slab);
+            }
+        else
+            {
+            list_append(&cache->slabs_empty, &slab->node);
+
+            cache->nr_empty++;
+            }
+        }
+
+    cache->nr_active--;
+    }
+
+void kmem_cache_init
+    (
+    kmem_cache_t *      cache,
+    const char *        name,
+    size_t              size,
+    size_t              align,
+    kmem_cache_ctor_t   ctor
+    )
+    {
+    memset(cache, 0, sizeof(*cache));
+
+    cache->name = name;
+    cache->size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+
+    spinlock_init(&cache->lock);
+
+    list_init(&cache->slabs_partial);
+    list_init(&cache->slabs_full);
+    list_init(&cache->slabs_empty);
+    list_init(&cache->node);
+    }
+
+/* kmem_cache_create - create an object cache, objects are aligned on align */
+kmem_cache_t * kmem_cache_create
+    (
+    const char *        name,
+    size_t              size,
+    size_t              align,
+    kmem_cache_ctor_t   ctor
+    )
+    {
+    kmem_cache_t * cache;
+
+    if (!size)
+        return NULL;
+
+    cache = kmalloc(sizeof(*cache));
+
+    if (!cache)
+        return NULL;
+
+    kmem_cache_init(cache, name, size, align, ctor);
+
+    return cache;
+    }
+
+/*
+ * kmem_cache_destroy - destroy an object cache created by kmem_cache_create
+ *
+ * All objects must have been freed and the cache must no longer be used.
+ */
+void kmem_cache_destroy
+    (
+    kmem_cache_t *      cache
+    )
+    {
+    kmem_slab_t * slab;
+    int i;
+
+    spinlock_lock(&cache->lock);
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        while (cache->magazine[i].nr)
+            kmem_slab_obj_put(cache,
+                cache->magazine[i].objs[--cache->magazine[i].nr]);
+        }
+
+    if (cache->nr_active)
+        printk("kmem_cache_destroy(): %s still has %lld objects in use\n",
+            cache->name, (long long)cache->nr_active);
+
+    while (!LIST_EMPTY(&cache->slabs_empty))
+        {
+        slab = LIST_ENTRY(cache->slabs_empty.next, kmem_slab_t, node);
+
+        list_remove(&slab->node);
+
+        page_free(slab);
+        }
+
+    spinlock_unlock(&cache->lock);
+
+    spinlock_lock(&kmem_cache_list_lock);
+
+    if (cache->objs_per_slab)
+        list_remove(&cache->node);
+
+    spinlock_unlock(&kmem_cache_list_lock);
+
+    kfree(cache);
+    }
+
+/*
+ * kmem_cache_alloc - allocate an object from the magazine of the current
+ * CPU, refilling half of the magazine from the slabs when it is empty
+ */
+void * kmem_cache_alloc
+    (
+    kmem_cache_t *      cache
+    )
+    {
+    kmem_magazine_t * mag;
+    void * obj = NULL;
+    ipl_t flags;
+
+    flags = interrupts_disable();
+
+    mag = &cache->magazine[this_cpu()];
+
+    if (!mag->nr)
+        {
+        spinlock_lock(&cache->lock);
+
+        while (mag->nr < KMEM_CACHE_MAGAZINE_SIZE / 2)
+            {
+            if ((obj = kmem_slab_obj_get(cache)) == NULL)
+                break;
+
+            mag->objs[mag->nr++] = obj;
+            }
+
+        spinlock_unlock(&cache->lock);
+        }
+
+    obj = mag->nr ? mag->objs[--mag->nr] : NULL;
+
+    interrupts_restore(flags);
+
+    return obj;
+    }
+
+/*
+ * kmem_cache_free - free an object to the magazine of the current CPU,
+ * flushing half of the magazine to the slabs when it is full
+ */
+void kmem_cache_free
+    (
+    kmem_cache_t *      cache,
+    void *              obj
+    )
+    {
+    kmem_magazine_t * mag;
+    ipl_t flags;
+
+    if (!obj)
+        return;
+
+    flags = interrupts_disable();
+
+    mag = &cache->magazine[this_cpu()];
+
+    if (mag->nr == KMEM_CACHE_MAGAZINE_SIZE)
+        {
+        spinlock_lock(&cache->lock);
+
+        while (mag->nr > KMEM_CACHE_MAGAZINE_SIZE / 2)
+            kmem_slab_obj_put(cache, mag->objs[--mag->nr]);
+
+        spinlock_unlock(&cache->lock);
+        }
+
+    mag->objs[mag->nr++] = obj;
+
+    interrupts_restore(flags);
+    }
+
+int do_slab (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    kmem_cache_t * cache;
+
+    spinlock_lock(&kmem_cache_list_lock);
+
+    LIST_FOREACH(&kmem_cache_list, iter)
+        {
+        cache = LIST_ENTRY(iter, kmem_cache_t, node);
+
+        printk("%s - %lld bytes objects, %d per %lld pages slab, "
+            "%lld slabs, %lld objects active\n",
+            cache->name, (long long)cache->obj_size, cache->objs_per_slab,
+            (long long)cache->slab_pages, (long long)cache->nr_slabs,
+            (long long)cache->nr_active);
+        }
+
+    spinlock_unlock(&kmem_cache_list_lock);
+
+    return 0;
+    }
+
+CELL_OS_CMD(
+    slab,   1,        1,    do_slab,
+    "show object caches",
+    "show the object size, the slab layout and the number of slabs and\n"
+    "active objects of each object cache\n"
+    );
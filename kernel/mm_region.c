@@ -0,0 +1,244 @@
+/* mm_region.c - physical memory map */
+
+#include <sys.h>
+#include <arch.h>
+#include <os.h>
+#include <os/mm_region.h>
+
+/* Both tables are sorted by start address, usable ranges never overlap */
+
+static mm_region_t mm_usable[MM_REGION_MAX];
+static int         mm_nr_usable = 0;
+
+static mm_region_t mm_reserved[MM_REGION_MAX];
+static int         mm_nr_reserved = 0;
+
+/* Insert a range in a sorted region table */
+static status_t mm_region_insert
+    (
+    mm_region_t *   table,
+    int *           nr,
+    cpu_addr_t      start,
+    cpu_addr_t      end
+    )
+    {
+    int i;
+
+    if (*nr >= MM_REGION_MAX)
+        return ERROR;
+
+    for (i = *nr; (i > 0) && (table[i - 1].start > start); i--)
+        table[i] = table[i - 1];
+
+    table[i].start = start;
+    table[i].end = end;
+
+    (*nr)++;
+
+    return OK;
+    }
+
+/* Merge the overlapping or adjacent usable ranges */
+static void mm_region_usable_merge(void)
+    {
+    int i, j;
+
+    for (i = 0, j = 1; j < mm_nr_usable; j++)
+        {
+        if (mm_usable[j].start <= mm_usable[i].end)
+            {
+            if (mm_usable[j].end > mm_usable[i].end)
+                mm_usable[i].end = mm_usable[j].end;
+            }
+        else
+            mm_usable[++i] = mm_usable[j];
+        }
+
+    if (mm_nr_usable)
+        mm_nr_usable = i + 1;
+    }
+
+/*
+ * mm_region_add - add a range to the physical memory map
+ *
+ * Usable ranges are shrunk and reserved ranges are grown to whole pages.
+ */
+
+status_t mm_region_add
+    (
+    cpu_addr_t  start,
+    cpu_addr_t  end,
+    int         type
+    )
+    {
+    status_t ret;
+
+    if (type == MM_REGION_USABLE)
+        {
+        start = PAGE_ALIGN(start);
+        end &= PAGE_MASK;
+
+        if (start >= end)
+            return OK;
+
+        ret = mm_region_insert(mm_usable, &mm_nr_usable, start, end);
+
+        mm_region_usable_merge();
+        }
+    else
+        {
+        start &= PAGE_MASK;
+        end = PAGE_ALIGN(end);
+
+        if (start >= end)
+            return OK;
+
+        ret = mm_region_insert(mm_reserved, &mm_nr_reserved, start, end);
+        }
+
+    if (ret != OK)
+        printk("mm_region_add(): no room for %p - %p\n", start, end);
+
+    return ret;
+    }
+
+cpu_addr_t mm_region_usable_low(void)
+    {
+    return mm_nr_usable ? mm_usable[0].start : 0;
+    }
+
+cpu_addr_t mm_region_usable_high(void)
+    {
+    return mm_nr_usable ? mm_usable[mm_nr_usable - 1].end : 0;
+    }
+
+/*
+ * mm_region_walk_free - call func on each usable range minus the reserved
+ * ranges, in ascending address order
+ */
+
+void mm_region_walk_free
+    (
+    mm_region_func_t    func,
+    void *              arg
+    )
+    {
+    cpu_addr_t cur, end;
+    int i, j;
+
+    for (i = 0; i < mm_nr_usable; i++)
+        {
+        cur = mm_usable[i].start;
+        end = mm_usable[i].end;
+
+        for (j = 0; (j < mm_nr_reserved) && (cur < end); j++)
+            {
+            if (mm_reserved[j].end <= cur)
+                continue;
+
+            if (mm_reserved[j].start >= end)
+                break;
+
+            if (mm_reserved[j].start > cur)
+                func(cur, mm_reserved[j].start, arg);
+
+            cur = mm_reserved[j].end;
+            }
+
+        if (cur < end)
+            func(cur, end, arg);
+        }
+    }
+
+typedef struct mm_region_fit
+    {
+    size_t      size;
+    cpu_addr_t  low;
+    cpu_addr_t  high;
+    cpu_addr_t  found;
+    } mm_region_fit_t;
+
+static void mm_region_fit_check
+    (
+    cpu_addr_t  start,
+    cpu_addr_t  end,
+    void *      arg
+    )
+    {
+    mm_region_fit_t * fit = arg;
+
+    if (fit->found)
+        return;
+
+    if (start < fit->low)
+        start = fit->low;
+
+    if (end > fit->high)
+        end = fit->high;
+
+    if ((start < end) && (end - start >= fit->size))
+        fit->found = start;
+    }
+
+/*
+ * mm_region_alloc_early - reserve free physical memory before the page
+ * allocator is up
+ *
+ * Returns the page aligned physical address of the lowest fit within
+ * [low, high), or 0 if there is none.
+ */
+
+cpu_addr_t mm_region_alloc_early
+    (
+    size_t      size,
+    cpu_addr_t  low,
+    cpu_addr_t  high
+    )
+    {
+    mm_region_fit_t fit;
+
+    fit.size = PAGE_ALIGN(size);
+    fit.low = PAGE_ALIGN(low);
+    fit.high = high;
+    fit.found = 0;
+
+    mm_region_walk_free(mm_region_fit_check, &fit);
+
+    if (!fit.found)
+        return 0;
+
+    if (mm_region_add(fit.found, fit.found + fit.size,
+                      MM_REGION_RESERVED) != OK)
+        return 0;
+
+    return fit.found;
+    }
+
+int do_memmap (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    int i;
+
+    for (i = 0; i < mm_nr_usable; i++)
+        {
+        if (i > 0)
+            printk("hole     %p - %p\n",
+                mm_usable[i - 1].end, mm_usable[i].start);
+
+        printk("usable   %p - %p (%lld KB)\n",
+            mm_usable[i].start, mm_usable[i].end,
+            (long long)((mm_usable[i].end - mm_usable[i].start) / 1024));
+        }
+
+    for (i = 0; i < mm_nr_reserved; i++)
+        printk("reserved %p - %p\n",
+            mm_reserved[i].start, mm_reserved[i].end);
+
+    return 0;
+    }
+
+CELL_OS_CMD(
+    memmap,   1,        1,    do_memmap,
+    "show the physical memory map",
+    "show the usable ranges, the holes between them and the reserved\n"
+    "ranges of physical memory\n"
+    );
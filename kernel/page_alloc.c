@@ -1,71 +1,327 @@
 #include <sys.h>
 #include <arch.h>
 #include <os.h>
+#include <os/mm_region.h>
+
+/*
+ * Binary buddy page allocator
+ *
+ * Free pages are kept in blocks of 2^order pages, aligned on their size
+ * in page frame numbers, on one free list per order. An allocation takes
+ * a block of the smallest sufficient order, splitting bigger blocks as
+ * needed, and gives back the pages it does not use; a free merges each 
+ * block with its buddy as long as the buddy is free too. Both are 
+ * O(log N) in the number of pages.
+ *
+ * Only the head page of a block carries its state: AVAIL with the order
+ * for a free block, ALLOCATED with the page count for an allocation.
+ * Every other page is CHAINED. Pages that are not usable RAM (holes and
+ * reserved ranges of the physical memory map) are RESERVED and never
+ * merged.
+ *
+ * Physical memory is split in zones, each with its own free lists and
+ * lock: DMA32 below 4GB and NORMAL above. Zone boundaries are aligned
+ * far beyond the biggest block, so a block never spans two zones.
+ * Allocations are served from the NORMAL zone first and fall back to the
+ * DMA32 zone, which keeps the memory below 4GB for the users that need it.
+ *
+ * Single pages are served by per-CPU page caches in front of the buddy
+ * allocator, which take a zone lock only to refill or drain a batch
+ * of pages. Freed pages go to the hot list and are reused first, while
+ * they are likely still in the CPU cache; pages refilled from the buddy 
+ * allocator go to the cold list. Cached pages are CACHED.
+ */
 
 #define MM_PAGE_STATUS_AVAIL         0x0
-#define MM_PAGE_STATUS_CHAINED         0x1
-#define MM_PAGE_STATUS_CHAINED_LAST 0x2
+#define MM_PAGE_STATUS_CHAINED       0x1
+#define MM_PAGE_STATUS_CACHED        0x2
 #define MM_PAGE_STATUS_ALLOCATED     0x3
+#define MM_PAGE_STATUS_RESERVED      0x4
+
+/* Per-CPU page cache watermarks and batch size */
+#define PAGE_PCP_LOW                 0
+#define PAGE_PCP_HIGH                128
+#define PAGE_PCP_BATCH               32
 
 typedef struct page
     {
     list_t          list;
     cpu_addr_t      phys_addr;
     uint64_t        status;
+    uint32_t        order;      /* Order of a free block */
+    uint32_t        count;      /* Number of pages of an allocation */
     } __attribute__((packed)) page_t;
 
-spinlock_t  page_alloc_lock;
-list_t      page_alloc_free_page_list;
-page_t *    page_array;
+typedef struct page_free_area
+    {
+    list_t          free_list;
+    size_t          nr_free;
+    } page_free_area_t;
+
+typedef struct page_zone
+    {
+    const char *        name;
+
+    /* Physical address range of the zone */
+    cpu_addr_t          start;
+    cpu_addr_t          end;
+
+    spinlock_t          lock;
+    page_free_area_t    free_area[PAGE_ALLOC_MAX_ORDER + 1];
+
+    /* Pages managed, and pages taken out including the per-CPU caches */
+    size_t              nr_pages;
+    size_t              nr_allocated;
+    } page_zone_t;
+
+typedef struct page_pcp
+    {
+    /* Recently freed pages, likely cache warm */
+    list_t          hot;
+    
+    /* Pages refilled from the buddy allocator */
+    list_t          cold;
+
+    size_t          nr_hot;
+    size_t          nr_cold;
+    } __attribute__((aligned(X64_CACHE_LINE_SIZE))) page_pcp_t;
+
+static page_zone_t  page_zones[PAGE_ZONE_MAX] =
+    {
+    { "DMA32",  0,                   PAGE_ZONE_DMA32_END },
+    { "NORMAL", PAGE_ZONE_DMA32_END, (cpu_addr_t)-1 },
+    };
+
+page_t *            page_array;
 
-cpu_addr_t     mm_lowest_addr = 0 ;
+static page_pcp_t   page_pcp[CONFIG_NR_CPUS];
+
+/* Page frame number of page_array[0] */
+static size_t  mm_base_pfn = 0;
+
+/* Number of entries of page_array, holes included */
+static size_t  mm_nr_pages = 0;
 
 size_t         mm_pages_available = 0;
-size_t         mm_bytes_allocated = 0;
 int         track_free_page = 0;
 
-static inline void page_add_to_free_list
+static inline page_zone_t * page_zone
+    (
+    size_t  pfn
+    )
+    {
+    if (((cpu_addr_t)pfn << PAGE_SHIFT) < PAGE_ZONE_DMA32_END)
+        return &page_zones[PAGE_ZONE_DMA32];
+
+    return &page_zones[PAGE_ZONE_NORMAL];
+    }
+
+static inline void page_free_area_add
     (
-    page_t *pp
+    page_zone_t *   zone,
+    page_t *        pp,
+    unsigned int    order
     )
     {
     pp->status = MM_PAGE_STATUS_AVAIL;
+    pp->order = order;
     
     /* The node should be initialized before appending it to the list */
     
     list_init(&pp->list);
     
-    list_append(&page_alloc_free_page_list, &pp->list);
+    list_append(&zone->free_area[order].free_list, &pp->list);
+
+    zone->free_area[order].nr_free++;
 
     if (track_free_page)
-        printk("add free page %p\n", pp->phys_addr);
+        printk("add free block %p order %d\n", pp->phys_addr, order);
     }
 
-static inline page_t * page_get_from_free_list(void)
+static inline void page_free_area_del
+    (
+    page_zone_t *   zone,
+    page_t *        pp,
+    unsigned int    order
+    )
     {
-    page_t *pp = NULL;
-    
-    if (LIST_EMPTY(&page_alloc_free_page_list))
+    list_remove(&pp->list);
+
+    zone->free_area[order].nr_free--;
+
+    pp->status = MM_PAGE_STATUS_CHAINED;
+
+    if (track_free_page)
+        printk("get free block %p order %d\n", pp->phys_addr, order);
+    }
+
+/* Get the order of the smallest block with at least num_pages pages */
+static inline unsigned int page_order
+    (
+    size_t num_pages
+    )
+    {
+    unsigned int order = 0;
+
+    while (((size_t)1 << order) < num_pages)
+        order++;
+
+    return order;
+    }
+
+/*
+ * Free the block of 2^order pages at the page index, merging it with its
+ * buddy as long as the buddy is a free block of the same order.
+ */
+static void page_block_free
+    (
+    page_zone_t *   zone,
+    size_t          index,
+    unsigned int    order
+    )
+    {
+    size_t pfn = mm_base_pfn + index;
+    size_t buddy_pfn;
+    page_t * buddy;
+
+    while (order < PAGE_ALLOC_MAX_ORDER)
         {
-        printk("NO free page!\n");
+        buddy_pfn = pfn ^ ((size_t)1 << order);
+
+        if ((buddy_pfn < mm_base_pfn) ||
+            (buddy_pfn - mm_base_pfn >= mm_nr_pages))
+            break;
+
+        buddy = &page_array[buddy_pfn - mm_base_pfn];
+
+        if ((buddy->status != MM_PAGE_STATUS_AVAIL) || 
+            (buddy->order != order))
+            break;
+
+        page_free_area_del(zone, buddy, order);
+
+        page_array[pfn - mm_base_pfn].status = MM_PAGE_STATUS_CHAINED;
+
+        /* The merged block starts at the lower buddy */
+        pfn &= ~((size_t)1 << order);
         
-        return NULL;
+        order++;
         }
-    else
+
+    page_free_area_add(zone, &page_array[pfn - mm_base_pfn], order);
+    }
+
+/*
+ * Free a page range as the biggest aligned blocks it can be split into,
+ * the range must be in one zone
+ */
+static void page_range_free
+    (
+    page_zone_t *   zone,
+    size_t          index,
+    size_t          count
+    )
+    {
+    size_t pfn = mm_base_pfn + index;
+    size_t end = pfn + count;
+    unsigned int order;
+
+    while (pfn < end)
         {
-        pp = (page_t *)LIST_ENTRY(page_alloc_free_page_list.next, page_t, list);
+        order = 0;
 
-        /* Remove it from the free list */
-        
-        list_remove(&pp->list);
-        
-        if (track_free_page)
-            printk("get free page %p\n", pp->phys_addr);
+        while ((order < PAGE_ALLOC_MAX_ORDER) &&
+               !(pfn & ((size_t)1 << order)) &&
+               (pfn + ((size_t)2 << order) <= end))
+            order++;
+
+        page_block_free(zone, pfn - mm_base_pfn, order);
+
+        pfn += (size_t)1 << order;
+        }
+    }
+
+/* 
+ * Take a free block of 2^order pages, splitting a bigger block and
+ * giving back its upper halves if there is no block of that order.
+ */
+static page_t * page_block_alloc
+    (
+    page_zone_t *   zone,
+    unsigned int    order
+    )
+    {
+    unsigned int o;
+    page_t * pp;
+    size_t index;
+
+    for (o = order; o <= PAGE_ALLOC_MAX_ORDER; o++)
+        {
+        if (zone->free_area[o].nr_free)
+            break;
+        }
+
+    if (o > PAGE_ALLOC_MAX_ORDER)
+        return NULL;
+
+    pp = LIST_ENTRY(zone->free_area[o].free_list.next, page_t, list);
+
+    page_free_area_del(zone, pp, o);
+
+    index = pp - page_array;
+
+    while (o > order)
+        {
+        o--;
         
-        return pp;
+        page_free_area_add(zone, &page_array[index + ((size_t)1 << o)], o);
         }
+
+    return pp;
     }
 
+/* Give a free range of the physical memory map to its zones */
+static void page_alloc_add_range
+    (
+    cpu_addr_t  start,
+    cpu_addr_t  end,
+    void *      arg
+    )
+    {
+    cpu_addr_t limit = *(cpu_addr_t *)arg;
+    page_zone_t * zone;
+    cpu_addr_t zone_end;
+    size_t i;
+
+    if (end > limit)
+        end = limit;
+
+    while (start < end)
+        {
+        zone = page_zone(start >> PAGE_SHIFT);
+
+        zone_end = (end < zone->end) ? end : zone->end;
+
+        for (i = start >> PAGE_SHIFT; i < zone_end >> PAGE_SHIFT; i++)
+            page_array[i - mm_base_pfn].status = MM_PAGE_STATUS_CHAINED;
+
+        page_range_free(zone, (start >> PAGE_SHIFT) - mm_base_pfn,
+                        (zone_end - start) >> PAGE_SHIFT);
+
+        zone->nr_pages += (zone_end - start) >> PAGE_SHIFT;
+        mm_pages_available += (zone_end - start) >> PAGE_SHIFT;
+
+        start = zone_end;
+        }
+    }
+
+/*
+ * page_alloc_init - give the free ranges of the physical memory map to the
+ * page allocator
+ *
+ * Everything below first_address is in use by the kernel, and nothing at
+ * or above last_address is mapped by the kernel physical map.
+ */
 
 void page_alloc_init
     (
@@ -73,191 +329,408 @@ void page_alloc_init
     cpu_addr_t last_address
     )
     {
-    page_t *p;
-    size_t pages_available;
-    ssize_t i;
+    cpu_addr_t low, high, array;
+    size_t i, o;
 
-    mm_bytes_allocated = 0;
+    first_address = PAGE_ALIGN(first_address);
 
-    first_address = (first_address + PAGE_SIZE) & PAGE_MASK;
+    mm_region_add(0, first_address, MM_REGION_RESERVED);
 
-    pages_available = (last_address - first_address) / PAGE_SIZE;
+    low = mm_region_usable_low();
+    high = mm_region_usable_high();
 
-    mm_lowest_addr = first_address + (pages_available * sizeof(page_t));
-    mm_lowest_addr = (mm_lowest_addr + PAGE_SIZE) & PAGE_MASK;
-    pages_available = (last_address - mm_lowest_addr) / PAGE_SIZE;
-    mm_pages_available = pages_available;
+    if (low < first_address)
+        low = first_address;
 
-    printk("page_alloc_init(): pages_available=%d lowest_addr=%p\n",
-            pages_available,mm_lowest_addr);
+    if (high > last_address)
+        high = last_address;
 
-    spinlock_init(&page_alloc_lock);
+    /* The page map array spans from the lowest to the highest free page */
 
-    list_init(&page_alloc_free_page_list);
-    
-    /* Carve the first address as the page map array */
-    
-    page_array = (page_t *)PA2VA(first_address);
-    
-    for (i = pages_available - 1 ; i >= 0 ; i --)
+    mm_base_pfn = low >> PAGE_SHIFT;
+    mm_nr_pages = (high - low) >> PAGE_SHIFT;
+
+    array = mm_region_alloc_early(mm_nr_pages * sizeof(page_t), low, high);
+
+    if (!array)
+        panic("page_alloc_init(): no room for the page map array\n");
+
+    printk("page_alloc_init(): %lld pages from %p, page map array at %p\n",
+            (long long)mm_nr_pages, low, array);
+
+    for (i = 0; i < PAGE_ZONE_MAX; i++)
         {
-        page_array[i].phys_addr = (mm_lowest_addr + (i * PAGE_SIZE));
-        page_array[i].status = MM_PAGE_STATUS_AVAIL;
+        spinlock_init(&page_zones[i].lock);
         
-        p = (page_t *)&page_array[i];
+        for (o = 0; o <= PAGE_ALLOC_MAX_ORDER; o++)
+            {
+            list_init(&page_zones[i].free_area[o].free_list);
+
+            page_zones[i].free_area[o].nr_free = 0;
+            }
+
+        page_zones[i].nr_pages = 0;
+        page_zones[i].nr_allocated = 0;
+        }
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        list_init(&page_pcp[i].hot);
+        list_init(&page_pcp[i].cold);
         
-        page_add_to_free_list((page_t*)p);
+        page_pcp[i].nr_hot = 0;
+        page_pcp[i].nr_cold = 0;
         }
+    
+    page_array = (page_t *)PA2VA(array);
+    
+    for (i = 0; i < mm_nr_pages; i++)
+        {
+        page_array[i].phys_addr = ((mm_base_pfn + i) << PAGE_SHIFT);
+        page_array[i].status = MM_PAGE_STATUS_RESERVED;
+        page_array[i].order = 0;
+        page_array[i].count = 0;
+        }
+
+    mm_pages_available = 0;
 
-    track_free_page = 1;
+    mm_region_walk_free(page_alloc_add_range, &high);
+
+    for (i = 0; i < PAGE_ZONE_MAX; i++)
+        printk("page_alloc_init(): zone %s %lld pages\n",
+                page_zones[i].name, (long long)page_zones[i].nr_pages);
 
     printk("page_alloc_init(): done!\n");
     }
 
-void *page_alloc_contig
+/*
+ * Refill the per-CPU page cache with a batch of cold pages, from the
+ * NORMAL zone first
+ */
+static void page_pcp_refill
     (
-    int num_pages
+    page_pcp_t *    pcp
     )
     {
+    page_zone_t *zone;
     page_t *page;
-    size_t i, found,curr;
-    void *addr;
+    int i = 0;
+    int z, n;
 
-    spinlock_lock(&page_alloc_lock);
-    
-    found = curr = i = 0;
-    
-    while (curr < mm_pages_available)
+    for (z = PAGE_ZONE_MAX - 1; (z >= 0) && (i < PAGE_PCP_BATCH); z--)
         {
-        page = (page_t *)&page_array[curr];
-        /* 
-             * If we found one free page then we need to check if the 
-             * next num_pages are also free 
-             */
-                
-        if (page->status == MM_PAGE_STATUS_AVAIL)
+        zone = &page_zones[z];
+
+        spinlock_lock(&zone->lock);
+
+        for (n = 0; i < PAGE_PCP_BATCH; i++, n++)
             {
-            found = curr;
-            while (page->status == MM_PAGE_STATUS_AVAIL && i < num_pages)
-                {
-                curr ++;
-                i++;
-                page = (page_t *)&page_array[curr];
-                }
+            page = page_block_alloc(zone, 0);
+
+            if (!page)
+                break;
+
+            page->status = MM_PAGE_STATUS_CACHED;
+
+            list_append(&pcp->cold, &page->list);
+
+            pcp->nr_cold++;
             }
-        /* Found num_pages contiguous pages */
-        
-        if (i == num_pages)
+
+        zone->nr_allocated += n;
+
+        spinlock_unlock(&zone->lock);
+        }
+    }
+
+/* 
+ * Give a batch of pages of the per-CPU page cache back to the buddy 
+ * allocator, the cold ones first, then the least recently freed hot ones
+ */
+static void page_pcp_drain
+    (
+    page_pcp_t *    pcp
+    )
+    {
+    page_zone_t *zone = NULL;
+    page_zone_t *z;
+    page_t *page;
+    size_t index;
+    int i;
+
+    for (i = 0; i < PAGE_PCP_BATCH; i++)
+        {
+        if (pcp->nr_cold)
+            {
+            page = LIST_ENTRY(pcp->cold.next, page_t, list);
+            pcp->nr_cold--;
+            }
+        else if (pcp->nr_hot)
             {
-            #if 0
-            printk("page_alloc_contig(): found %i pages at index #%i mem %p start\n",
-                i, found, addr);
-            #endif
-            for (i = 0; i < num_pages; i++)
-                {
-                page = (page_t *)&page_array[i + found];
-                
-                list_remove(&page->list);
-                
-                page->status = MM_PAGE_STATUS_CHAINED;
-                }
-
-            page = (page_t*)&page_array[found];
-
-            /* Return the corresponding kernel physical map address */
-            
-            addr = (void*)PA2VA(page->phys_addr);
-            
-            spinlock_unlock(&page_alloc_lock);
-
-            #if 0
-            printk("page_alloc_contig(): found %i pages at index #%i mem %p done\n",
-                i, found, addr);
-            #endif
-            
-            return (void*)addr;
+            page = LIST_ENTRY(pcp->hot.prev, page_t, list);
+            pcp->nr_hot--;
             }
         else
+            break;
+
+        list_remove(&page->list);
+
+        index = page - page_array;
+
+        /* Only switch zone locks when the zone changes */
+
+        z = page_zone(mm_base_pfn + index);
+
+        if (z != zone)
             {
-            found = i = 0;
-            curr ++;
+            if (zone)
+                spinlock_unlock(&zone->lock);
+
+            zone = z;
+
+            spinlock_lock(&zone->lock);
             }
+
+        page->status = MM_PAGE_STATUS_CHAINED;
+
+        page_block_free(zone, index, 0);
+
+        zone->nr_allocated--;
+        }
+
+    if (zone)
+        spinlock_unlock(&zone->lock);
+    }
+
+/* 
+ * Allocate pages from the buddy allocator of a zone, the pages past
+ * num_pages in the block are given back
+ */
+static void *page_buddy_alloc
+    (
+    page_zone_t *   zone,
+    int             num_pages
+    )
+    {
+    unsigned int order;
+    page_t *page;
+    size_t index;
+    void *addr;
+
+    order = page_order(num_pages);
+
+    spinlock_lock(&zone->lock);
+        
+    page = page_block_alloc(zone, order);
+
+    if (!page)
+        {
+        spinlock_unlock(&zone->lock);
+        
+        return NULL;
         }
 
-    spinlock_unlock(&page_alloc_lock);
+    page->status = MM_PAGE_STATUS_ALLOCATED;
+    page->count = num_pages;
+
+    index = page - page_array;
+
+    /* Give back the pages of the block beyond num_pages */
     
+    if ((size_t)num_pages < ((size_t)1 << order))
+        page_range_free(zone, index + num_pages,
+                        ((size_t)1 << order) - num_pages);
+
+    zone->nr_allocated += num_pages;
+
+    /* Return the corresponding kernel physical map address */
+    
+    addr = (void*)PA2VA(page->phys_addr);
+    
+    spinlock_unlock(&zone->lock);
+
+    return addr;
+    }
+
+/*
+ * page_alloc_zone_contig - allocate contiguous pages in a zone or, if it
+ * has none, in the zones below it
+ *
+ * At most PAGE_ALLOC_MAX_CONTIG_PAGES pages are allocated at once, the
+ * size of the biggest buddy block.
+ *
+ * When all of them are out of memory, the free areas of the kernel heap
+ * are taken back and the allocation is retried once.
+ */
+void *page_alloc_zone_contig
+    (
+    int zone_idx,
+    int num_pages
+    )
+    {
+    int shrunk = 0;
+    void *addr;
+    int z;
+
+    if ((num_pages <= 0) || (zone_idx < 0) || (zone_idx >= PAGE_ZONE_MAX))
+        return NULL;
+
+    if (page_order(num_pages) > PAGE_ALLOC_MAX_ORDER)
+        {
+        printk("page_alloc_contig(): %d pages exceed the max block "
+            "of %d pages\n", num_pages, PAGE_ALLOC_MAX_CONTIG_PAGES);
+
+        return NULL;
+        }
+
+retry:
+    for (z = zone_idx; z >= 0; z--)
+        {
+        addr = page_buddy_alloc(&page_zones[z], num_pages);
+
+        if (addr)
+            return addr;
+        }
+
+    if (!shrunk++ && kmalloc_shrink())
+        goto retry;
+
     return NULL;
     }
 
+void *page_alloc_contig
+    (
+    int num_pages
+    )
+    {
+    if (num_pages == 1)
+        return page_alloc();
+
+    return page_alloc_zone_contig(PAGE_ZONE_NORMAL, num_pages);
+    }
 
+/* 
+ * page_alloc - allocate a page from the per-CPU page cache 
+ *
+ * Interrupts are disabled while the cache is used, so that neither an 
+ * interrupt handler nor a migration to another cpu can interleave.
+ */
 void *page_alloc(void)
     {
-    page_t *page;
-    cpu_addr_t addr;
+    page_pcp_t * pcp;
+    page_t * page;
+    int shrunk = 0;
+    ipl_t flags;
 
-    spinlock_lock(&page_alloc_lock);
+retry:
+    page = NULL;
+
+    flags = interrupts_disable();
+
+    pcp = &page_pcp[this_cpu()];
+
+    if (pcp->nr_hot + pcp->nr_cold <= PAGE_PCP_LOW)
+        page_pcp_refill(pcp);
+
+    if (pcp->nr_hot)
+        {
+        page = LIST_ENTRY(pcp->hot.next, page_t, list);
+        pcp->nr_hot--;
+        }
+    else if (pcp->nr_cold)
+        {
+        page = LIST_ENTRY(pcp->cold.next, page_t, list);
+        pcp->nr_cold--;
+        }
+
+    if (page)
+        {
+        list_remove(&page->list);
+        
+        page->status = MM_PAGE_STATUS_ALLOCATED;
+        page->count = 1;
+        }
+
+    interrupts_restore(flags);
+
+    if (!page && !shrunk++ && kmalloc_shrink())
+        goto retry;
 
-    page = (page_t *) page_get_from_free_list();
-    
     if (!page)
         {
-        spinlock_unlock(&page_alloc_lock);
-        printk("page_get_from_free_list NULL!\n");
+        printk("page_alloc(): NO free page!\n");
+
         return NULL;
         }
 
-    if (page->status != MM_PAGE_STATUS_AVAIL)
-        printk("WARNING:page_alloc() page %p status=%i\n",
-                page->phys_addr, page->status);
-
-    page->status = MM_PAGE_STATUS_ALLOCATED;
+    if (track_free_page)
+        printk("get free page %p\n", page->phys_addr);
 
     /* Return the corresponding kernel physical map address */
 
-    addr = (cpu_addr_t) PA2VA(page->phys_addr);
-    
-    spinlock_unlock(&page_alloc_lock);
-    
-    return (void*)(addr);
+    return (void*)PA2VA(page->phys_addr);
     }
 
+/* page_free_contig - free the pages allocated at the page index */
 void page_free_contig
     (
     size_t index
     )
     {
+    page_zone_t *zone;
     page_t *page;
-    size_t curr;
 
-    /* kmalloc lock should already be held... */
+    zone = page_zone(mm_base_pfn + index);
 
-    curr = index;
-    page = (page_t*)&page_array[curr];
+    spinlock_lock(&zone->lock);
 
-    if (page->status != MM_PAGE_STATUS_CHAINED && 
-        page->status != MM_PAGE_STATUS_CHAINED_LAST)
-        {
-        printk("WARNING: page_free_contig() first page %p not chained!\n", page->phys_addr);
-        return;
-        }
-    
-    /* Set the page status as free */
-    
-    while (page->status == MM_PAGE_STATUS_CHAINED)
+    page = (page_t*)&page_array[index];
+
+    if (page->status != MM_PAGE_STATUS_ALLOCATED)
         {
-        /* If this page has been popped off, stick it back on now */
-        
-        page_add_to_free_list(page);
+        printk("WARNING: page_free_contig() page %p status=%i\n", 
+                page->phys_addr, page->status);
 
-        curr ++;
+        spinlock_unlock(&zone->lock);
         
-        page = (page_t*)&page_array[curr];
+        return;
         }
 
+    page->status = MM_PAGE_STATUS_CHAINED;
 
-    printk("page_free_contig() freed %i pages\n",curr - index);
-    
-    return;
+    zone->nr_allocated -= page->count;
+
+    page_range_free(zone, index, page->count);
+
+    spinlock_unlock(&zone->lock);
+    }
+
+/* Free a single page to the hot list of the per-CPU page cache */
+static void page_pcp_free
+    (
+    page_t *    page
+    )
+    {
+    page_pcp_t * pcp;
+    ipl_t flags;
+
+    if (track_free_page)
+        printk("add free page %p\n", page->phys_addr);
+
+    flags = interrupts_disable();
+
+    pcp = &page_pcp[this_cpu()];
+
+    page->status = MM_PAGE_STATUS_CACHED;
+
+    list_prepend(&pcp->hot, &page->list);
+
+    pcp->nr_hot++;
+
+    if (pcp->nr_hot + pcp->nr_cold > PAGE_PCP_HIGH)
+        page_pcp_drain(pcp);
+
+    interrupts_restore(flags);
     }
 
 /* page_free - free pages that were allocated by page_alloc or page_alloc_contig
@@ -267,9 +740,8 @@ void page_free
     void *addr
     )
     {
-    page_t *p;
-    cpu_addr_t offset;
     size_t index;
+    page_t *page;
     
     if (!addr)
         {
@@ -279,42 +751,74 @@ void page_free
         
     /* Calculate the page index in the page map array */
     
-    offset = ((cpu_addr_t)addr - PA2VA(mm_lowest_addr));
+    index = (VA2PA(addr) >> PAGE_SHIFT) - mm_base_pfn;
     
-    index = (offset & PAGE_MASK) / PAGE_SIZE;
-
-    if (index >= mm_pages_available)
+    if (index >= mm_nr_pages)
         {
         printk("WARNING: page_free() out of range address %p, index=%i\n", 
                 addr, index);
         return ;
         }
 
-    spinlock_lock(&page_alloc_lock);
+    page = &page_array[index];
 
-    p = (page_t *)&page_array[index];
-    
-    if (p->status != MM_PAGE_STATUS_ALLOCATED &&
-        p->status != MM_PAGE_STATUS_CHAINED)
-        {
-        printk("WARNING: page_free() bad address %p, status=%i\n",
-                addr, p->status);
-                
-        spinlock_unlock(&page_alloc_lock);
-        
-        return;
-        }
+    if ((page->status == MM_PAGE_STATUS_ALLOCATED) && (page->count == 1))
+        page_pcp_free(page);
+    else
+        page_free_contig(index);
+    }
+
+int do_buddy (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    page_zone_t * zone;
+    size_t free_pages;
+    int order;
+    int i;
 
-    if (p->status == MM_PAGE_STATUS_ALLOCATED)
+    for (i = 0; i < PAGE_ZONE_MAX; i++)
         {
-        page_add_to_free_list(p);
+        zone = &page_zones[i];
+        free_pages = 0;
+
+        spinlock_lock(&zone->lock);
+
+        printk("zone %s %p - %p\n", zone->name, zone->start, zone->end);
+
+        for (order = 0; order <= PAGE_ALLOC_MAX_ORDER; order++)
+            {
+            if (!zone->free_area[order].nr_free)
+                continue;
+
+            printk("order %d - %lld free blocks\n", order,
+                (long long)zone->free_area[order].nr_free);
+
+            free_pages += zone->free_area[order].nr_free << order;
+            }
+
+        printk("%lld of %lld pages free, %lld pages allocated\n",
+            (long long)free_pages, (long long)zone->nr_pages,
+            (long long)zone->nr_allocated);
+
+        spinlock_unlock(&zone->lock);
         }
-    else
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
         {
-        page_free_contig(index);
+        if (!page_pcp[i].nr_hot && !page_pcp[i].nr_cold)
+            continue;
+
+        printk("cpu%d - %lld hot, %lld cold pages cached\n", i,
+            (long long)page_pcp[i].nr_hot, 
+            (long long)page_pcp[i].nr_cold);
         }
-    
-    spinlock_unlock(&page_alloc_lock);
-    
-    return;
+
+    return 0;
     }
+
+CELL_OS_CMD(
+    buddy,   1,        1,    do_buddy,
+    "show page allocator free blocks",
+    "show the number of free blocks of each order of the buddy\n"
+    "page allocator per zone, the pages cached by each cpu and the\n"
+    "number of free pages\n"
+    );
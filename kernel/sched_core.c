@@ -1,14 +1,8 @@
 #include <sys.h>
 #include <arch.h>
 #include <os.h>
-long cpu_intr_flags[CONFIG_NR_CPUS];
-
-uint64_t timer_ticks[CONFIG_NR_CPUS];
-
 spinlock_t reschedule_lock;
 
-sched_thread_t * kthread_current[CONFIG_NR_CPUS];
-
 extern void *sched_bsp_idle_thread (void *notused);
 extern void *sched_ap_idle_thread (void *notused);
 
@@ -37,7 +31,7 @@ CELL_OS_CMD(
 int do_ticks (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
     {
     for (int i = 0; i < smp_total_cpu_count(); i++)
-        printk("cpu%d - %lld\n", i, timer_ticks[i]);
+        printk("cpu%d - %lld\n", i, percpu_of(i)->timer_ticks);
     
     return 0;
     }
@@ -49,8 +43,6 @@ CELL_OS_CMD(
     "get the current ticks that has passed"
     );
 
-extern sched_cpu_t* current_cpus[];
-
 void sched_core_init(void)
     {
     spinlock_init(&reschedule_lock);
@@ -68,9 +60,10 @@ void sched_init(void)
     {
     char name[NAME_MAX];
     pthread_attr_t thread_attr;
+    pthread_t idle_thread;
     ulong flags;
     
-    timer_ticks[this_cpu()] = 0;
+    percpu_write(timer_ticks, 0);
     
     snprintf(name, NAME_MAX, "INIT_CPU%d", this_cpu());
     
@@ -91,24 +84,27 @@ void sched_init(void)
 
     if (this_cpu() == 0)
         {
-        pthread_create(&kurrent,
+        pthread_create(&idle_thread,
                        &thread_attr,
                        sched_bsp_idle_thread,
                        NULL);
         }
     else
         {
-        pthread_create(&kurrent,
+        pthread_create(&idle_thread,
                        &thread_attr,
                        sched_ap_idle_thread,
                        NULL);
         }
+
+    kurrent_set(idle_thread);
     
     sched_thread_remove_suspended(kurrent);
     
     spinlock_lock(&kurrent->thread_lock);
 
     kurrent->state = STATE_RUNNING;
+    kurrent->on_cpu = TRUE;
 
     kurrent_cpu->prev_thread = kurrent_cpu->current = kurrent;
     
@@ -134,6 +130,66 @@ void sched_context_dump (sched_context_t * contxt)
 
 #undef SCHED_DETAIL        
 
+/* The longest time an idle CPU sleeps without a tick */
+#define SCHED_IDLE_MAX_SLEEP_NS     NSECS_PER_SEC
+
+/*
+ * Charge the CPU time used since the thread resumed or was last charged
+ * to the thread, and return it in nanoseconds.
+ */
+static abstime_t sched_thread_charge
+    (
+    sched_thread_t * thread
+    )
+    {
+    abstime_t now = rdtsc();
+    abstime_t cycles = now - thread->resume_cycle;
+
+    thread->cycles += cycles;
+    thread->resume_cycle = now;
+
+    return sched_cpu_arch_cycles_to_ns(&kurrent_cpu->cpu_arch, cycles);
+    }
+
+/*
+ * Stop the periodic tick when the CPU goes idle, and program one tick
+ * for the next timer wheel expiry instead.
+ */
+static void sched_tick_stop (void)
+    {
+    abstime_t sleep_ns = SCHED_IDLE_MAX_SLEEP_NS;
+    abstime_t expires;
+    abstime_t now;
+
+    if (kurrent_cpu->tick_stopped)
+        return;
+
+    expires = timer_wheel_next_expiry();
+
+    if (expires != ABSTIME_INFINITY)
+        {
+        now = get_monotonic_nanosecond();
+
+        if (expires <= now)
+            sleep_ns = HZ2NSECS(CONFIG_HZ);
+        else if (expires - now < sleep_ns)
+            sleep_ns = expires - now;
+        }
+
+    if (sched_cpu_arch_tick_stop(sleep_ns) == OK)
+        kurrent_cpu->tick_stopped = TRUE;
+    }
+
+/* Restart the periodic tick when the CPU leaves idle */
+static void sched_tick_restart (void)
+    {
+    if (!kurrent_cpu->tick_stopped)
+        return;
+
+    if (sched_cpu_arch_tick_start() == OK)
+        kurrent_cpu->tick_stopped = FALSE;
+    }
+
 /* The SCHED_LOCK is called in reschedule */
 void sched_thread_common_entry
     (
@@ -152,6 +208,16 @@ void sched_thread_common_entry
     
     spinlock_unlock(&kurrent->thread_lock);
 
+    /* 
+     * The context of the previous thread is saved, its wakers may now
+     * enqueue it; before interrupts are on, as one may wake it 
+     */
+    if (kurrent != kurrent_cpu->prev_thread)
+        {
+        write_barrier();
+        kurrent_cpu->prev_thread->on_cpu = FALSE;
+        }
+
     interrupts_restore(kurrent->saved_context.ipl);
 
     if (kurrent != kurrent_cpu->prev_thread)
@@ -211,6 +277,9 @@ void reschedule(void)
         case STATE_PENDING:
             check_thread = NULL;
             break;
+        case STATE_DELAY:
+            check_thread = NULL;
+            break;
         case STATE_SUSPENDED:
             check_thread = NULL;
             break;
@@ -225,15 +294,34 @@ void reschedule(void)
     
     new_thread = sched_find_best_thread(check_thread);
 
+    if (new_thread == NULL)
+        {
+        if ((kurrent->state == STATE_READY) &&
+            (kurrent != kurrent_cpu->idle_thread))
+            {
+            /* Nothing better to run, keep running the current thread */
+            new_thread = kurrent;
+            }
+        else
+            {
+            /* Nothing to run locally, try to pull a thread from a busy cpu */
+            new_thread = sched_balance_idle();
+            }
+        }
+
     if (new_thread == NULL)
         {
         new_thread = kurrent_cpu->idle_thread;
 
         kurrent_cpu->idle = TRUE;
+
+        sched_tick_stop();
         }
     else
         {
         kurrent_cpu->idle = FALSE;
+
+        sched_tick_restart();
         }
 
     if (new_thread != kurrent)
@@ -241,11 +329,13 @@ void reschedule(void)
         kurrent_cpu->prev_thread = kurrent;
         kurrent->saved_context.ipl = ipl;
         
-        kurrent = new_thread;
+        kurrent_set(new_thread);
         
         kurrent_cpu->current = kurrent;
+        kurrent->on_cpu = TRUE;
         kurrent->cpu_idx = kurrent_cpu->cpu_idx;
         kurrent->sched_cpu = kurrent_cpu;
+        kurrent->sched_runq = kurrent->sched_policy->get_cpu_runq(kurrent_cpu);
 
         kurrent->runcount++;
         
@@ -300,6 +390,10 @@ void reschedule(void)
         this_cpu(), kurrent_cpu->prev_thread->name);
 #endif  
 
+        /* Its context is saved, its wakers may now enqueue it */
+        write_barrier();
+        kurrent_cpu->prev_thread->on_cpu = FALSE;
+
         spinlock_unlock(&kurrent_cpu->prev_thread->thread_lock);
         
         if (!(kurrent_cpu->prev_thread->flags & THREAD_STANDALONE))
@@ -349,31 +443,48 @@ void sched_tick
     )
     { 
     BOOL sched = TRUE;
+    abstime_t ran_ns;
+
+    percpu_inc(timer_ticks);
 
-    timer_ticks[this_cpu()]++;
+    /* Run the timers which expired on this CPU */
+    timer_wheel_run();
 
 #ifdef SCHED_DETAIL        
-    if ((timer_ticks[this_cpu()] % (CONFIG_HZ * 10)) == 0)
+    if ((percpu_read(timer_ticks) % (CONFIG_HZ * 10)) == 0)
         sched_thread_global_show();
 #endif
 
-#define SCHED_SELDOM
-#ifdef SCHED_SELDOM
-    if ((timer_ticks[this_cpu()] % (CONFIG_HZ)) == 0)
-#endif        
+    /* Periodically pull threads from the busiest cpu */
+    if ((percpu_read(timer_ticks) % CONFIG_SCHED_BALANCE_TICKS) == 0)
+        sched_balance_tick();
+
+    /* 
+     * The one-shot tick of an idle CPU expired, go back to the periodic
+     * tick and let reschedule() decide whether to stop it again.
+     */
+    if (kurrent_cpu->tick_stopped)
         {
+        sched_tick_restart();
+
+        reschedule();
+        
+        return;
+        }
+
 #ifdef SCHED_DETAIL        
-        printk("cpu%d - tick %d\n", this_cpu(), timer_ticks[this_cpu()]);
+    printk("cpu%d - tick %d\n", this_cpu(), percpu_read(timer_ticks));
 #endif
+
+    ran_ns = sched_thread_charge(kurrent);
         
-        if (kurrent->sched_policy->sched_clock_tick)
-            {
-            sched = kurrent->sched_policy->sched_clock_tick(kurrent);
-            }
-        
-        if (sched)
-            reschedule();
+    if (kurrent->sched_policy->sched_clock_tick)
+        {
+        sched = kurrent->sched_policy->sched_clock_tick(kurrent, ran_ns);
         }
+    
+    if (sched)
+        reschedule();
     }
 
 /*
@@ -3,18 +3,30 @@
 #include <os.h>
 
 sched_cpu_t     cpus[CONFIG_NR_CPUS];
-sched_cpu_t*    current_cpus[CONFIG_NR_CPUS];
 
 static spinlock_t cpu_group_list_lock;
 static list_t cpu_group_list;
 static size_t cpu_group_cout = 0;
 static id_t   cpu_group_id_next = 0;
 
-#define SCHED_CPU_GROUP_LOCK()    \
-    spinlock_lock(&cpu_group_list_lock)
+/*
+ * The cpu group list lock is taken with interrupts disabled, as its
+ * holders publish the per-CPU cpu_group arrays read by reschedule()
+ */
+
+#define SCHED_CPU_GROUP_LOCK(ipl)               \
+    do                                          \
+        {                                       \
+        (ipl) = interrupts_disable();           \
+        spinlock_lock(&cpu_group_list_lock);    \
+        } while (0)
     
-#define SCHED_CPU_GROUP_UNLOCK()  \
-    spinlock_unlock(&cpu_group_list_lock)
+#define SCHED_CPU_GROUP_UNLOCK(ipl)             \
+    do                                          \
+        {                                       \
+        spinlock_unlock(&cpu_group_list_lock);  \
+        interrupts_restore(ipl);                \
+        } while (0)
     
 /* 
  * Initialize CPUs
@@ -35,9 +47,12 @@ void cpu_early_init(void)
 		spinlock_init(&cpus[i].lock);
         
         list_init(&cpus[i].cpu_group_list);
+
+        seqcount_init(&cpus[i].cpu_group_seq);
         
-        current_cpus[i] = &cpus[i];
-        current_cpus[i]->cpu_idx = i;
+        cpus[i].cpu_idx = i;
+
+        percpu_of(i)->current_cpu = &cpus[i];
 	    }
         
     spinlock_init(&cpu_group_list_lock);
@@ -45,15 +60,69 @@ void cpu_early_init(void)
     list_init(&cpu_group_list);
     }
 
+/*
+ * sched_cpu_group_publish - rebuild the cpu_group array of every CPU
+ *
+ * Each CPU keeps the cpu_groups it belongs to in an array read without
+ * any lock by sched_cpu_group_find_best_thread(). The array is rewritten
+ * under its sequence counter, so readers retry if they raced with us.
+ * cpu_groups are never freed, so a stale pointer read before the retry
+ * is still safe to dereference.
+ *
+ * Must be called with the cpu group list locked, which also disables
+ * interrupts. The writer must not be interruptible: a reschedule() on
+ * this CPU in the middle of the update would spin forever in the reader
+ * with interrupts off.
+ */
+
+static void sched_cpu_group_publish (void)
+    {
+    sched_cpu_group_t * cpu_group;
+    sched_cpu_t * cpu;
+    size_t nr;
+    int i;
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        cpu = &cpus[i];
+
+        write_seqcount_begin(&cpu->cpu_group_seq);
+
+        nr = 0;
+        cpu->cpu_groups_overflow = FALSE;
+
+        LIST_FOREACH(&cpu_group_list, iter)
+            {
+            cpu_group = LIST_ENTRY(iter, sched_cpu_group_t, cpu_group_node);
+
+            if (!CPU_ISSET(i, &cpu_group->cpu_set))
+                continue;
+
+            if (nr == SCHED_CPU_GROUP_MAX_PER_CPU)
+                {
+                cpu->cpu_groups_overflow = TRUE;
+                break;
+                }
+
+            cpu->cpu_groups[nr++] = cpu_group;
+            }
+
+        cpu->nr_cpu_groups = nr;
+
+        write_seqcount_end(&cpu->cpu_group_seq);
+        }
+    }
+
 sched_cpu_group_t * sched_cpu_group_find 
     (
     cpu_set_t * cpu_set
     )
     {
     sched_cpu_group_t * cpu_group = NULL;
+    ipl_t ipl;
 
     /* Lock the cpu group list */
-    SCHED_CPU_GROUP_LOCK();
+    SCHED_CPU_GROUP_LOCK(ipl);
 
     LIST_FOREACH(&cpu_group_list, iter)
         {
@@ -67,7 +136,7 @@ sched_cpu_group_t * sched_cpu_group_find
         }
         
     /* Unlock the cpu group list */
-    SCHED_CPU_GROUP_UNLOCK();
+    SCHED_CPU_GROUP_UNLOCK(ipl);
 
     return cpu_group;
     }
@@ -79,9 +148,10 @@ sched_cpu_group_t * sched_cpu_group_add
     )
     {
     sched_cpu_group_t * cpu_group = NULL;
+    ipl_t ipl;
 
     /* Lock the cpu group list */
-    SCHED_CPU_GROUP_LOCK();
+    SCHED_CPU_GROUP_LOCK(ipl);
 
     LIST_FOREACH(&cpu_group_list, iter)
         {
@@ -97,7 +167,7 @@ sched_cpu_group_t * sched_cpu_group_add
     if (cpu_group)
         {
         /* Unlock the cpu group list */
-        SCHED_CPU_GROUP_UNLOCK();
+        SCHED_CPU_GROUP_UNLOCK(ipl);
         
         return cpu_group;
         }
@@ -107,7 +177,7 @@ sched_cpu_group_t * sched_cpu_group_add
     if (!cpu_group)
         {
         /* Unlock the cpu group list */
-        SCHED_CPU_GROUP_UNLOCK();
+        SCHED_CPU_GROUP_UNLOCK(ipl);
         
         return NULL;
         }
@@ -124,9 +194,11 @@ sched_cpu_group_t * sched_cpu_group_add
     
     /* Add the new cpu group to the cpu group list */
     list_append(&cpu_group_list, &cpu_group->cpu_group_node);
+
+    sched_cpu_group_publish();
     
     /* Unlock the cpu group list */
-    SCHED_CPU_GROUP_UNLOCK();
+    SCHED_CPU_GROUP_UNLOCK(ipl);
 
     return cpu_group;
     }
@@ -138,9 +210,10 @@ void sched_cpu_group_remove
     )
     {
     sched_cpu_group_t * cpu_group = NULL;
+    ipl_t ipl;
 
     /* Lock the cpu group list */
-    SCHED_CPU_GROUP_LOCK();
+    SCHED_CPU_GROUP_LOCK(ipl);
 
     LIST_FOREACH(&cpu_group_list, iter)
         {
@@ -160,13 +233,15 @@ void sched_cpu_group_remove
         cpu_group_cout--;
         
         list_remove(&cpu_group->cpu_group_node);
+
+        sched_cpu_group_publish();
         }
     
     /* Unlock the cpu group list */
-    SCHED_CPU_GROUP_UNLOCK();
+    SCHED_CPU_GROUP_UNLOCK(ipl);
     }
 
-sched_thread_t * sched_cpu_group_find_best_thread 
+static sched_thread_t * sched_cpu_group_find_best_thread_locked
     (
     sched_policy_t * policy,
     sched_cpu_t *    cpu,
@@ -176,9 +251,10 @@ sched_thread_t * sched_cpu_group_find_best_thread
     sched_cpu_group_t * cpu_group;
     sched_runq_t * runq;
     sched_thread_t * best_thread;
+    ipl_t ipl;
 
     /* Lock the cpu group list */
-    SCHED_CPU_GROUP_LOCK();
+    SCHED_CPU_GROUP_LOCK(ipl);
 
     LIST_FOREACH(&cpu_group_list, iter)
         {
@@ -196,6 +272,9 @@ sched_thread_t * sched_cpu_group_find_best_thread
              */
             runq = policy->get_cpu_group_runq(cpu_group);
 
+            if (!runq)
+                continue;
+
             /* Check if this cpu_group has a better thread to run */
             if (policy->preemption_check(runq, check))
                 {
@@ -204,7 +283,7 @@ sched_thread_t * sched_cpu_group_find_best_thread
                 if (best_thread) 
                     {
                     /* Unlock the cpu group list */
-                    SCHED_CPU_GROUP_UNLOCK();
+                    SCHED_CPU_GROUP_UNLOCK(ipl);
                     
                     return best_thread;
                     }
@@ -213,8 +292,150 @@ sched_thread_t * sched_cpu_group_find_best_thread
         }
         
     /* Unlock the cpu group list */
-    SCHED_CPU_GROUP_UNLOCK();
+    SCHED_CPU_GROUP_UNLOCK(ipl);
 
     return NULL;
     }
 
+
+/* 
+ * Read the cpu_groups of <cpu> published by sched_cpu_group_publish(),
+ * returns how many there are. <overflow> is set if they did not all fit.
+ */
+
+static size_t sched_cpu_groups_read
+    (
+    sched_cpu_t *       cpu,
+    sched_cpu_group_t * cpu_groups[],
+    BOOL *              overflow
+    )
+    {
+    unsigned int seq;
+    size_t nr;
+    size_t i;
+
+    do
+        {
+        seq = read_seqcount_begin(&cpu->cpu_group_seq);
+
+        nr = cpu->nr_cpu_groups;
+        *overflow = cpu->cpu_groups_overflow;
+
+        for (i = 0; i < nr; i++)
+            cpu_groups[i] = cpu->cpu_groups[i];
+        } while (read_seqcount_retry(&cpu->cpu_group_seq, seq));
+
+    return nr;
+    }
+
+/*
+ * sched_cpu_group_has_runnable - check if a thread is waiting on the
+ * runq of a policy of any cpu_group <cpu> belongs to
+ *
+ * Used by the idle loop before it puts the CPU to sleep; the runnable
+ * counts are read without the runq locks.
+ */
+
+bool sched_cpu_group_has_runnable
+    (
+    sched_policy_t * policy,
+    sched_cpu_t *    cpu
+    )
+    {
+    sched_cpu_group_t * cpu_groups[SCHED_CPU_GROUP_MAX_PER_CPU];
+    sched_cpu_group_t * cpu_group;
+    sched_runq_t * runq;
+    bool runnable = FALSE;
+    BOOL overflow;
+    size_t nr;
+    ipl_t ipl;
+    size_t i;
+
+    nr = sched_cpu_groups_read(cpu, cpu_groups, &overflow);
+
+    if (!overflow)
+        {
+        for (i = 0; i < nr; i++)
+            {
+            runq = policy->get_cpu_group_runq(cpu_groups[i]);
+
+            if (runq && runq->runnable)
+                return TRUE;
+            }
+
+        return FALSE;
+        }
+
+    /* Too many cpu_groups for the array, walk the list */
+    SCHED_CPU_GROUP_LOCK(ipl);
+
+    LIST_FOREACH(&cpu_group_list, iter)
+        {
+        cpu_group = LIST_ENTRY(iter, sched_cpu_group_t, cpu_group_node);
+
+        if (!CPU_ISSET(cpu->cpu_idx, &cpu_group->cpu_set))
+            continue;
+
+        runq = policy->get_cpu_group_runq(cpu_group);
+
+        if (runq && runq->runnable)
+            {
+            runnable = TRUE;
+            break;
+            }
+        }
+
+    SCHED_CPU_GROUP_UNLOCK(ipl);
+
+    return runnable;
+    }
+
+/*
+ * sched_cpu_group_find_best_thread - dequeue a better thread than <check>
+ *
+ * Looks through the runqs of the cpu_groups <cpu> belongs to. This is on
+ * the pick-next-thread path, so the cpu_groups are read from the per-CPU
+ * array published by sched_cpu_group_publish() instead of walking the
+ * global cpu_group list under its lock.
+ */
+
+sched_thread_t * sched_cpu_group_find_best_thread 
+    (
+    sched_policy_t * policy,
+    sched_cpu_t *    cpu,
+    sched_thread_t * check
+    )
+    {
+    sched_cpu_group_t * cpu_groups[SCHED_CPU_GROUP_MAX_PER_CPU];
+    sched_runq_t * runq;
+    sched_thread_t * best_thread;
+    size_t nr;
+    BOOL overflow;
+    size_t i;
+
+    nr = sched_cpu_groups_read(cpu, cpu_groups, &overflow);
+
+    /* Too many cpu_groups for the array, fall back to the locked walk */
+    if (overflow)
+        return sched_cpu_group_find_best_thread_locked(policy, cpu, check);
+
+    for (i = 0; i < nr; i++)
+        {
+        runq = policy->get_cpu_group_runq(cpu_groups[i]);
+
+        /* The policy has not attached a runq to this cpu_group yet */
+        if (!runq)
+            continue;
+
+        /* Check if this cpu_group has a better thread to run */
+        if (policy->preemption_check(runq, check))
+            {
+            best_thread = policy->thread_dequeue(runq);
+
+            if (best_thread) 
+                return best_thread;
+            }
+        }
+
+    return NULL;
+    }
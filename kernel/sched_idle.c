@@ -0,0 +1,158 @@
+/* sched_idle.c - CPU idle loop management */
+
+#include <sys.h>
+#include <arch.h>
+#include <os.h>
+
+/*
+ * sched_idle_loop - idle loop of the idle thread of each CPU
+ *
+ * The idle thread only runs when no other thread is runnable on the CPU.
+ * It reschedules to pick up threads enqueued (or stolen) meanwhile, and
+ * if there are still none, puts the CPU to sleep until an interrupt or a
+ * wakeup from sched_cpu_wakeup() arrives.
+ */
+
+void sched_idle_loop (void)
+    {
+    sched_cpu_t * cpu = kurrent_cpu;
+    uint64_t start;
+
+    cpu->idle_start_cycle = rdtsc();
+
+    while (TRUE)
+        {
+        /* Wakeups after this point are seen by sched_cpu_arch_idle() */
+        percpu_write(need_resched, 0);
+
+        sched_yield();
+
+        /* Free what lockless readers may no longer see */
+        epoch_reclaim();
+
+        interrupts_disable();
+
+        /* Make sure the idle flag is visible before the runq check */
+        memory_barrier();
+
+        if (sched_cpu_has_runnable(cpu))
+            {
+            interrupts_enable();
+
+            continue;
+            }
+
+        start = rdtsc();
+
+        /* Returns with interrupts enabled */
+        sched_cpu_arch_idle();
+
+        cpu->idle_cycles += rdtsc() - start;
+        cpu->idle_count++;
+        }
+    }
+
+/*
+ * sched_cpu_wakeup - wake an idle CPU to run a thread enqueued on its runq
+ *
+ * Nothing is done if the CPU is the current CPU or it is not idle.
+ */
+
+void sched_cpu_wakeup
+    (
+    sched_cpu_t * cpu
+    )
+    {
+    if (cpu == kurrent_cpu)
+        return;
+
+    /* Make sure the enqueue is visible before the idle flag check */
+    memory_barrier();
+
+    if (!cpu->idle)
+        return;
+
+    sched_cpu_arch_wakeup(cpu->cpu_idx);
+    }
+
+/*
+ * sched_cpu_set_wakeup - wake an idle CPU of a cpu_set to run a thread
+ * enqueued on a cpu_group or system runq
+ *
+ * Any idle CPU is woken if the cpu_set is empty. Nothing is done if the
+ * current CPU is in the cpu_set, as it looks at these runqs as well.
+ */
+
+void sched_cpu_set_wakeup
+    (
+    cpu_set_t * cpu_set
+    )
+    {
+    sched_cpu_t * cpu;
+    bool empty = TRUE;
+    int i;
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        if (CPU_ISSET(i, cpu_set))
+            {
+            empty = FALSE;
+            break;
+            }
+        }
+
+    if (!empty && CPU_ISSET(this_cpu(), cpu_set))
+        return;
+
+    /* Make sure the enqueue is visible before the idle flag checks */
+    memory_barrier();
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        cpu = &cpus[i];
+
+        if ((cpu == kurrent_cpu) || !cpu->idle_thread || !cpu->idle)
+            continue;
+
+        if (empty || CPU_ISSET(i, cpu_set))
+            {
+            sched_cpu_arch_wakeup(cpu->cpu_idx);
+            return;
+            }
+        }
+    }
+
+int do_idle (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    sched_cpu_t * cpu;
+    uint64_t now = rdtsc();
+    uint64_t total;
+
+    for (int i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        cpu = &cpus[i];
+
+        if (!cpu->idle_thread)
+            continue;
+
+        total = now - cpu->idle_start_cycle;
+
+        printk("cpu%d - %s, sleeps %lld, idle %lld ms, residency %lld%%\n",
+            i,
+            (percpu_of(i)->idle_state == SCHED_CPU_IDLE_NONE) ?
+                "running" : "sleeping",
+            cpu->idle_count,
+            NSECS2MSECS(sched_cpu_arch_cycles_to_ns(&cpu->cpu_arch,
+                                                    cpu->idle_cycles)),
+            total ? (cpu->idle_cycles * 100) / total : 0);
+        }
+
+    return 0;
+    }
+
+CELL_OS_CMD(
+    idle,   1,        1,    do_idle,
+    "show cpu idle residency",
+    "show the sleep count, the time asleep and the idle residency\n"
+    "of each cpu since it entered its idle loop\n"
+    );
@@ -6,6 +6,31 @@
 
 #undef MUTEX_DETAL
 
+/* List of all mutexes - debug show */
+static LIST_DECLARE(sched_mutex_list);
+static SPINLOCK_DECLARE(sched_mutex_list_lock);
+
+static KMEM_CACHE_DECLARE(sched_mutex_cache, "sched_mutex", 
+                          sizeof(struct sched_mutex), X64_CACHE_LINE_SIZE,
+                          NULL);
+
+/* Serializes priority inheritance chain walks and the owners' mutex_list */
+static SPINLOCK_DECLARE(sched_mutex_pi_lock);
+
+/* Only mutexes with a priority protocol take part in priority boosting */
+#define SCHED_MUTEX_PI(mutexP)  \
+    ((mutexP)->attr.protocol != PTHREAD_PRIO_NONE)
+
+#define SCHED_MUTEX_PI_LOCK(mutexP)     do {        \
+        if (SCHED_MUTEX_PI(mutexP))                 \
+            spinlock_lock(&sched_mutex_pi_lock);    \
+        } while (0)
+
+#define SCHED_MUTEX_PI_UNLOCK(mutexP)   do {        \
+        if (SCHED_MUTEX_PI(mutexP))                 \
+            spinlock_unlock(&sched_mutex_pi_lock);  \
+        } while (0)
+
 /*
   NAME
   
@@ -105,7 +130,13 @@ int pthread_mutex_destroy(pthread_mutex_t *mutex)
     
     mutexP->magic = MAGIC_INVALID;
 
-    kfree(mutexP);
+    spinlock_lock(&sched_mutex_list_lock);
+
+    list_remove(&mutexP->node);
+
+    spinlock_unlock(&sched_mutex_list_lock);
+
+    kmem_cache_free(&sched_mutex_cache, mutexP);
     
     return OK;
     }
@@ -122,7 +153,7 @@ int pthread_mutex_init
     if (attrP->magic != MAGIC_VALID)
         return EINVAL;
 
-    mutexP = kmalloc(sizeof(*mutexP));
+    mutexP = kmem_cache_alloc(&sched_mutex_cache);
 
     if (!mutexP)
         return ENOMEM;
@@ -139,15 +170,273 @@ int pthread_mutex_init
     
     mutexP->owner = NULL;
 
+    list_init(&mutexP->owner_node);
+
     mutexP->magic = MAGIC_VALID;
     
     memcpy(&mutexP->attr, attrP, sizeof(*attrP));
 
+    spinlock_lock(&sched_mutex_list_lock);
+
+    list_append(&sched_mutex_list, &mutexP->node);
+
+    spinlock_unlock(&sched_mutex_list_lock);
+
     *mutex = mutexP;
     
     return OK;
     }
 
+/* 
+ * Find the best thread pending on the mutexP. 
+ * Called with the mutexP lock held.
+ */
+static void sched_mutex_best_waiter_update
+    (
+    pthread_mutex_t mutexP
+    )
+    {
+    pthread_t waiter;
+    pthread_t best = NULL;
+
+    QUEUE_ITERATE(&mutexP->waitq, iter)
+        {
+        waiter = queue_entry(iter, sched_thread_t, waitq_node);
+
+        if (!best || SCHED_THREAD_PRECEDENCE_COMPARE(waiter, best))
+            best = waiter;
+        }
+
+    mutexP->best_waiter = best;
+    }
+
+/*
+ * Get the priority the thread shall run at: its base priority raised to 
+ * the ceiling of each PTHREAD_PRIO_PROTECT mutex it owns and to the 
+ * priority of the best waiter of each PTHREAD_PRIO_INHERIT mutex it owns.
+ * Called with sched_mutex_pi_lock held.
+ */
+static int sched_mutex_boosted_priority
+    (
+    pthread_t thread
+    )
+    {
+    sched_policy_t * policy = thread->sched_policy;
+    pthread_mutex_t mutexP;
+    pthread_t waiter;
+    int prio = thread->base_priority;
+    int boost;
+
+    LIST_FOREACH(&thread->mutex_list, iter)
+        {
+        mutexP = LIST_ENTRY(iter, sched_mutex_t, owner_node);
+
+        if (mutexP->attr.protocol == PTHREAD_PRIO_PROTECT)
+            boost = mutexP->attr.prioceiling;
+        else
+            {
+            waiter = mutexP->best_waiter;
+
+            /* We currently support only inheriting in the same policy */
+            if (!waiter || (waiter->sched_policy != policy))
+                continue;
+
+            boost = policy->get_priority(waiter);
+            }
+
+        if (boost > prio)
+            prio = boost;
+        }
+
+    return prio;
+    }
+
+/*
+ * Change the priority of the thread. If the thread waits on the runq 
+ * of a remote cpu and now has better precedence than the thread running 
+ * there, ask that cpu to reschedule.
+ */
+static void sched_mutex_priority_set
+    (
+    pthread_t thread,
+    int       prio
+    )
+    {
+    sched_cpu_t * cpu = thread->sched_cpu;
+    pthread_t current;
+
+    if (prio == thread->sched_policy->get_priority(thread))
+        return;
+
+    thread->sched_policy->change_priority(thread, prio);
+
+    if ((thread->state != STATE_READY) || !cpu || (cpu == kurrent_cpu))
+        return;
+
+    current = cpu->current;
+
+    if (current && (current != thread) &&
+        SCHED_THREAD_PRECEDENCE_COMPARE(thread, current))
+        sched_cpu_arch_resched(cpu->cpu_idx);
+    }
+
+/*
+ * Propagate the priority of the thread to the owners along the chain of 
+ * PTHREAD_PRIO_INHERIT mutexes it is pending on: A pends on M1 owned by B,
+ * B pends on M2 owned by C, ... The walk is bounded so a deadlock cycle 
+ * can not loop forever. Called with sched_mutex_pi_lock held.
+ */
+static void sched_mutex_pi_chain_adjust
+    (
+    pthread_t thread
+    )
+    {
+    pthread_mutex_t mutexP;
+    pthread_t owner;
+    int depth;
+    int prio;
+
+    for (depth = 0; depth < SCHED_MUTEX_PI_CHAIN_MAX; depth++)
+        {
+        mutexP = thread->pending_mutex;
+
+        if (!mutexP || (mutexP->attr.protocol != PTHREAD_PRIO_INHERIT))
+            break;
+
+        spinlock_lock(&mutexP->lock);
+
+        sched_mutex_best_waiter_update(mutexP);
+
+        owner = mutexP->owner;
+
+        spinlock_unlock(&mutexP->lock);
+
+        if (!owner)
+            break;
+
+        prio = sched_mutex_boosted_priority(owner);
+
+        if (prio == owner->sched_policy->get_priority(owner))
+            break;
+
+        sched_mutex_priority_set(owner, prio);
+
+        thread = owner;
+        }
+    }
+
+/*
+ * Make the thread the owner of the mutexP. A thread owning priority 
+ * protocol mutexes runs at the priority of sched_mutex_boosted_priority().
+ * Called with sched_mutex_pi_lock held for priority protocol mutexes.
+ */
+static void sched_mutex_owner_set
+    (
+    pthread_mutex_t mutexP,
+    pthread_t       thread
+    )
+    {
+    sched_policy_t * policy = thread->sched_policy;
+
+    mutexP->owner = thread;
+    mutexP->owner_policy = policy;
+
+    if (!SCHED_MUTEX_PI(mutexP))
+        {
+        mutexP->owner_priority = policy->get_priority(thread);
+        return;
+        }
+
+    /* Not boosted by any mutex yet, so the current priority is the base */
+    if (LIST_EMPTY(&thread->mutex_list))
+        thread->base_priority = policy->get_priority(thread);
+
+    mutexP->owner_priority = thread->base_priority;
+
+    list_append(&thread->mutex_list, &mutexP->owner_node);
+
+    sched_mutex_priority_set(thread, sched_mutex_boosted_priority(thread));
+    }
+
+/*
+ * Drop the ownership of the mutexP and the priority the owner got 
+ * through it. Called with sched_mutex_pi_lock held for priority 
+ * protocol mutexes.
+ */
+static void sched_mutex_owner_clear
+    (
+    pthread_mutex_t mutexP
+    )
+    {
+    pthread_t thread = mutexP->owner;
+
+    mutexP->owner = NULL;
+    mutexP->owner_policy = NULL;
+    mutexP->owner_priority = 0;
+
+    if (!SCHED_MUTEX_PI(mutexP))
+        return;
+
+    list_remove(&mutexP->owner_node);
+
+    sched_mutex_priority_set(thread, sched_mutex_boosted_priority(thread));
+    }
+
+/*
+ * Spin on an adaptive mutexP while its owner is running on another cpu,
+ * as the owner is then likely to release it soon. Give up once the owner
+ * is descheduled or the spin budget runs out.
+ *
+ * Returns TRUE if the mutexP has been taken, FALSE if the caller shall 
+ * block.
+ */
+static BOOL sched_mutex_adaptive_spin
+    (
+    pthread_mutex_t mutexP
+    )
+    {
+    uint64_t tsc_freq = kurrent_cpu->cpu_arch.tsc_freq_hz;
+    uint64_t budget = SCHED_MUTEX_SPIN_CYCLES_DEFAULT;
+    uint64_t start = rdtsc();
+    uint64_t now = start;
+    pthread_t owner;
+    BOOL taken = FALSE;
+
+    if (tsc_freq)
+        budget = (CONFIG_MUTEX_ADAPTIVE_SPIN_NS * tsc_freq) / NSECS_PER_SEC;
+
+    while ((now - start) < budget)
+        {
+        if ((atomic_read(&mutexP->counter) == 0) &&
+            (atomic_cmpxchg(&mutexP->counter, 0, 1) == 0))
+            {
+            taken = TRUE;
+            break;
+            }
+
+        /* 
+         * The owner may not be recorded yet if it has just taken the
+         * mutexP, keep spinning then.
+         */
+        owner = mutexP->owner;
+
+        if (owner && ((owner->state != STATE_RUNNING) || 
+                      (owner->cpu_idx == this_cpu())))
+            break;
+
+        cpu_relax();
+
+        now = rdtsc();
+        }
+
+    atomic64_add((long)(rdtsc() - start), &mutexP->stats.spin_cycles);
+
+    if (taken)
+        atomic64_inc(&mutexP->stats.spin_acquired);
+
+    return taken;
+    }
+
 /*
   NAME
   
@@ -310,14 +599,62 @@ int pthread_mutex_init
   
   These functions shall not return an error code of [EINTR].
 */
-int pthread_mutex_lock
+
+/*
+ * Take the mutexP off the waitq once the wait timer has woken the thread
+ * up, and give back the priority the owner inherited through it. Returns
+ * FALSE if pthread_mutex_unlock() took the thread off the waitq first.
+ */
+static BOOL sched_mutex_wait_timeout
     (
-    pthread_mutex_t *mutex
+    pthread_mutex_t mutexP,
+    pthread_t       self_thread
+    )
+    {
+    SCHED_MUTEX_PI_LOCK(mutexP);
+
+    spinlock_lock(&mutexP->lock);
+
+    if (self_thread->waitq_node.head == NULL)
+        {
+        spinlock_unlock(&mutexP->lock);
+
+        SCHED_MUTEX_PI_UNLOCK(mutexP);
+
+        return FALSE;
+        }
+
+    queue_remove(&self_thread->waitq_node, FALSE);
+
+    sched_mutex_best_waiter_update(mutexP);
+
+    spinlock_unlock(&mutexP->lock);
+
+    /* The owner priority follows the new best waiter along the chain */
+    if (mutexP->attr.protocol == PTHREAD_PRIO_INHERIT)
+        sched_mutex_pi_chain_adjust(self_thread);
+
+    self_thread->pending_mutex = NULL;
+
+    SCHED_MUTEX_PI_UNLOCK(mutexP);
+
+    return TRUE;
+    }
+
+/*
+ * Lock the mutexP, blocking until 'deadline' CLOCK_MONOTONIC ns at most, 
+ * or for ever if it is ABSTIME_INFINITY
+ */
+static int sched_mutex_lock
+    (
+    pthread_mutex_t * mutex,
+    abstime_t         deadline
     )
     {
     pthread_t self_thread = pthread_self();
     sched_policy_t * self_policy = self_thread->sched_policy;
     pthread_mutex_t mutexP = *mutex;
+    ipl_t ipl;
 
     if (mutexP->magic != MAGIC_VALID)
         return EINVAL;
@@ -398,13 +735,23 @@ int pthread_mutex_lock
             }
         else /* (pthread_self() != mutexP->owner) */
             {
+            atomic64_inc(&mutexP->stats.contended);
+
             lable_wokenup_and_try_again:
+
+            /* An adaptive mutexP spins for a running owner first */
+            if ((mutexP->attr.type == PTHREAD_MUTEX_ADAPTIVE_NP) &&
+                sched_mutex_adaptive_spin(mutexP))
+                goto lable_become_owner;
+
             /*
              * The mutexP owner is not us, so the calling thread will 
              * be put on to the mutexP thread waitq! Take the 
              * queue lock so that we can safely modify the queue!
              */
 
+            SCHED_MUTEX_PI_LOCK(mutexP);
+
             spinlock_lock(&mutexP->lock);
             
             /*
@@ -414,77 +761,81 @@ int pthread_mutex_lock
              
             if (atomic_cmpxchg(&mutexP->counter, 0, 1) != 0)
                 {
-                /* Upon here, there must be a mutexP owner */
-                if (mutexP->owner == NULL)
+                /* Do not block past the deadline */
+                if ((deadline != ABSTIME_INFINITY) &&
+                    (deadline <= get_monotonic_nanosecond()))
                     {
                     spinlock_unlock(&mutexP->lock);
-                    
-                    return EINVAL;
+
+                    SCHED_MUTEX_PI_UNLOCK(mutexP);
+
+                    return ETIMEDOUT;
                     }
+
+                /* 
+                 * The owner may not have recorded itself yet if it has
+                 * just taken the mutexP; it picks up the best waiter in
+                 * sched_mutex_owner_set() then.
+                 */
                                 
                 /* Add the current thread to the waitq */  
                 enqueue(&mutexP->waitq, &self_thread->waitq_node, FALSE);
+
+                atomic64_inc(&mutexP->stats.blocked);
                 
                 /* Set the current self_thread as pending on mutexP */
                 self_thread->state = STATE_PENDING;
-                
-                /*
-                 * Release the lock so other threads can be added
-                 * onto the waiting list
-                 */
-                spinlock_unlock(&mutexP->lock);
+                self_thread->pending_mutex = mutexP;
+
+                atomic_set(&self_thread->wait_woken, 0);
+
+                /* The wait timer shall not fire here before we switch out */
+                ipl = interrupts_disable();
+
+                sched_thread_wait_deadline_set(deadline);
                 
                 /* Setup how we can wake up the self_thread */
                 if ((mutexP->attr.order == PTHREAD_ORDER_PRIO) ||
                     (mutexP->attr.protocol == PTHREAD_PRIO_INHERIT))
                     {
-                    BOOL better;
-                    
-                    /* If there is no other waiting, caller is the best! */
-                    if (mutexP->best_waiter == NULL)
-                        {
+                    if ((mutexP->best_waiter == NULL) ||
+                        SCHED_THREAD_PRECEDENCE_COMPARE(self_thread, 
+                                                        mutexP->best_waiter))
                         mutexP->best_waiter = self_thread;
-                        }
-                    else
-                        {
-                        better = SCHED_THREAD_PRECEDENCE_COMPARE(self_thread, 
-                                                        mutexP->best_waiter);
-                        if (better)
-                            mutexP->best_waiter = self_thread;
-                        }
-                    
-                    /* 
-                     * If the owner needs to inherit a better priority, 
-                     * do it now, before the caller goes to PEND! 
-                     */
-                    if (mutexP->attr.protocol == PTHREAD_PRIO_INHERIT)
-                        {
-                        better = SCHED_THREAD_PRECEDENCE_COMPARE(mutexP->best_waiter,
-                                                                 mutexP->owner);
-                        if (better)
-                            {
-                            int better_prio;
-                            sched_policy_t * better_policy;
-                            
-                            better_policy = 
-                                mutexP->best_waiter->sched_policy;
-                            better_prio = 
-                                better_policy->get_priority(mutexP->best_waiter);
-                            
-                            /*
-                             * We currently support only change priority
-                             * in the same policy 
-                             */
-                            if (better_policy->id == mutexP->owner_policy->id)
-                                mutexP->owner_policy->change_priority(mutexP->owner,
-                                                              better_prio);
-                            }
-                        }
                     }
+                
+                /*
+                 * Release the lock so other threads can be added
+                 * onto the waiting list
+                 */
+                spinlock_unlock(&mutexP->lock);
+                    
+                /* 
+                 * If the owner needs to inherit a better priority, do it 
+                 * now, before the caller goes to PEND! This also boosts 
+                 * the owners of the mutexes the owner is pending on.
+                 */
+                if (mutexP->attr.protocol == PTHREAD_PRIO_INHERIT)
+                    sched_mutex_pi_chain_adjust(self_thread);
+
+                SCHED_MUTEX_PI_UNLOCK(mutexP);
                                 
                 /* Reschedule for another thread to run on the CPU */
                 reschedule();
 
+                interrupts_restore(ipl);
+
+                sched_thread_wait_deadline_clear();
+
+                /* Still on the waitq, so the wait timer woke us up */
+                if ((self_thread->waitq_node.head != NULL) &&
+                    sched_mutex_wait_timeout(mutexP, self_thread))
+                    return ETIMEDOUT;
+
+                /* The unlocking thread has handed the mutexP over to us */
+                if (mutexP->owner == self_thread)
+                    return OK;
+
                 /* 
                  * Once we come here, someone has released the mutexP 
                  * and woken us up! Go and become the owner! However,
@@ -501,26 +852,35 @@ int pthread_mutex_lock
                 {
                 /* We have taken the chance to become the owner! */
                 spinlock_unlock(&mutexP->lock);
+
+                SCHED_MUTEX_PI_UNLOCK(mutexP);
                 }
             }
         }
     
-    /* Once here, we have been given the mutexP and become the owner */
-    mutexP->owner = self_thread;
-    mutexP->owner_policy = self_policy;
-    mutexP->owner_priority = self_policy->get_priority(self_thread);
-    
-    /* The mutexP owner shall run at its highest possible priority */
-    if ((mutexP->attr.protocol == PTHREAD_PRIO_PROTECT) &&
-        (self_policy->id == SCHED_FIFO))
-        {
-        if (mutexP->owner_priority < mutexP->attr.prioceiling)
-            self_policy->change_priority(self_thread, mutexP->attr.prioceiling);
-        }
+    lable_become_owner:
+
+    /* 
+     * Once here, we have been given the mutexP and become the owner. 
+     * The mutexP owner shall run at its highest possible priority.
+     */
+    SCHED_MUTEX_PI_LOCK(mutexP);
+
+    sched_mutex_owner_set(mutexP, self_thread);
+
+    SCHED_MUTEX_PI_UNLOCK(mutexP);
     
     return OK;
     }
 
+int pthread_mutex_lock
+    (
+    pthread_mutex_t *mutex
+    )
+    {
+    return sched_mutex_lock(mutex, ABSTIME_INFINITY);
+    }
+
 int pthread_mutex_trylock
     (
     pthread_mutex_t *mutex
@@ -596,18 +956,15 @@ int pthread_mutex_trylock
             }
         }
     
-    /* Once here, we have been given the mutexP and become the owner */
-    mutexP->owner = self_thread;
-    mutexP->owner_policy = self_policy;
-    mutexP->owner_priority = self_policy->get_priority(self_thread);
-    
-    /* The mutexP owner shall run at its highest possible priority */
-    if ((mutexP->attr.protocol == PTHREAD_PRIO_PROTECT) &&
-        (self_policy->id == SCHED_FIFO))
-        {
-        if (mutexP->owner_priority < mutexP->attr.prioceiling)
-            self_policy->change_priority(self_thread, mutexP->attr.prioceiling);
-        }
+    /* 
+     * Once here, we have been given the mutexP and become the owner. 
+     * The mutexP owner shall run at its highest possible priority.
+     */
+    SCHED_MUTEX_PI_LOCK(mutexP);
+
+    sched_mutex_owner_set(mutexP, self_thread);
+
+    SCHED_MUTEX_PI_UNLOCK(mutexP);
     
     return OK;
     }
@@ -618,9 +975,13 @@ int pthread_mutex_unlock
     )
     {
     pthread_mutex_t mutexP = *mutex;
+    pthread_t wake_thread = NULL;
+    BOOL handoff = FALSE;
 
     if (mutexP->magic != MAGIC_VALID)
         return EINVAL;
+
+    SCHED_MUTEX_PI_LOCK(mutexP);
     
     spinlock_lock(&mutexP->lock);
 
@@ -629,6 +990,8 @@ int pthread_mutex_unlock
         {
         spinlock_unlock(&mutexP->lock);
 
+        SCHED_MUTEX_PI_UNLOCK(mutexP);
+
         if ((mutexP->attr.type == PTHREAD_MUTEX_ERRORCHECK) ||
             (mutexP->attr.robust == PTHREAD_MUTEX_ROBUST))
             return EPERM;
@@ -639,90 +1002,83 @@ int pthread_mutex_unlock
             return EINVAL;
             }
 	    } 
-        
-    /* atomic_dec_and_test() returns TRUE when decreased to 0 */
-    if ((atomic_dec_and_test(&mutexP->counter) == TRUE) &&
-        (!queue_empty(&mutexP->waitq)))
+
+    /* Owned count (recusive) not reach 0 yet! */
+    if (atomic_read(&mutexP->counter) > 1)
         {
-        pthread_t wake_thread = NULL;
-        pthread_t next_thread = NULL;
-        pthread_t better_thread = NULL;
+        atomic_dec(&mutexP->counter);
 
-        if (mutexP->attr.order == PTHREAD_ORDER_FIFO)
-            {
+        spinlock_unlock(&mutexP->lock);
+
+        SCHED_MUTEX_PI_UNLOCK(mutexP);
+
+        return OK;
+        }
+        
+    if (!queue_empty(&mutexP->waitq))
+        {
+        if ((mutexP->attr.order == PTHREAD_ORDER_PRIO) && 
+            (mutexP->best_waiter))
+            wake_thread = mutexP->best_waiter;
+        else
             wake_thread = queue_entry(queue_first(&mutexP->waitq),
                                       sched_thread_t, waitq_node);
-            queue_remove(&wake_thread->waitq_node, FALSE);
-            }
-        else if (mutexP->attr.order == PTHREAD_ORDER_PRIO)
-            {
-            if (mutexP->best_waiter)
-                wake_thread = mutexP->best_waiter;
-            else
-                wake_thread = queue_entry(queue_first(&mutexP->waitq),
-                                          sched_thread_t, waitq_node);
-            
-            queue_remove(&wake_thread->waitq_node, FALSE);
-            
-            QUEUE_ITERATE(&mutexP->waitq, iter)
-                {
-                next_thread = queue_entry(iter, sched_thread_t, waitq_node);
+        
+        queue_remove(&wake_thread->waitq_node, FALSE);
 
-                if (next_thread)
-                    {
-                    if (!better_thread)
-                        better_thread = next_thread;
-                    else
-                        {
-                        BOOL better;
-                        
-                        better = SCHED_THREAD_PRECEDENCE_COMPARE(next_thread,
-                                                                 better_thread);
-                        if (better)
-                            better_thread = next_thread;
-                        }
-                    }
-                }
+        wake_thread->pending_mutex = NULL;
             
-            /* Save the next better thread */
-            mutexP->best_waiter = better_thread;
-            }
+        /* Save the next better thread */
+        sched_mutex_best_waiter_update(mutexP);
 
-        spinlock_unlock(&mutexP->lock);
+        handoff = (mutexP->attr.handoff == PTHREAD_MUTEX_HANDOFF_NP);
+        }
 
-        if (mutexP->owner_priority != 
-            mutexP->owner_policy->get_priority(mutexP->owner))
-            {
-            mutexP->owner_policy->change_priority(mutexP->owner, 
-                mutexP->owner_priority);
-            }
+    /* 
+     * Drop the ownership before the mutexP can be taken again, 
+     * along with any priority inherited through the mutexP 
+     */
+    sched_mutex_owner_clear(mutexP);
+
+    /* 
+     * In handoff mode the woken thread becomes the owner right away, 
+     * so no new comer can take the mutexP before it runs; the owned 
+     * count stays 1 for it. 
+     */
+    if (handoff)
+        sched_mutex_owner_set(mutexP, wake_thread);
+    else
+        atomic_dec(&mutexP->counter);
+
+    spinlock_unlock(&mutexP->lock);
+
+    SCHED_MUTEX_PI_UNLOCK(mutexP);
         
-        mutexP->owner = NULL;
-        mutexP->owner_policy = NULL;
-        mutexP->owner_priority = 0;
+    /* 
+     * If its wait timer has already woken it, the thread finds itself off
+     * the waitq and takes the mutexP, or the handoff, all the same
+     */
+    if (wake_thread && sched_thread_wait_claim(wake_thread))
+        {
+        #ifdef MUTEX_DETAL
+        printk("wakeup thread %s\n", wake_thread->name);
+        #endif
         
-        if (wake_thread)
+        wake_thread->state = STATE_READY;
+
+        /* Switch straight to a better new owner on this cpu if we can */
+        if (handoff)
             {
-            #ifdef MUTEX_DETAL
-            printk("wakeup thread %s\n", wake_thread->name);
-            #endif
-            
-            wake_thread->state = STATE_READY;
-            
-            wake_thread->sched_policy->thread_enqueue(wake_thread->sched_runq, 
-                                                      wake_thread, TRUE);
-            
-            reschedule();
+            if (sched_thread_handoff(wake_thread))
+                reschedule();
             }
-        return OK;
+        else if (sched_thread_wakeup(wake_thread))
+            reschedule();
         }
-    else /* Owned count (recusive) not reach 0 yet! */
-        {
-        spinlock_unlock(&mutexP->lock);
 
-        return OK;
-        }
+    return OK;
     }
+
 /*
   NAME
   
@@ -845,11 +1201,23 @@ int pthread_mutex_timedlock
     )
     {
     pthread_mutex_t mutexP = *mutex;
+    abstime_t deadline;
+    int ret;
 
     if (mutexP->magic != MAGIC_VALID)
         return EINVAL;
+
+    ret = ktimer_deadline(CLOCK_REALTIME, TIMER_ABSTIME, abstime, &deadline);
+
+    /* The abstime need not be valid if the mutex can be locked at once */
+    if (ret != OK)
+        {
+        ret = pthread_mutex_trylock(mutex);
+
+        return (ret == EBUSY) ? EINVAL : ret;
+        }
     
-    return OK;
+    return sched_mutex_lock(mutex, deadline);
     }
 
 /*
@@ -941,6 +1309,7 @@ int pthread_mutexattr_init
     attrP->type = PTHREAD_MUTEX_RECURSIVE;
     attrP->pshared = PTHREAD_PROCESS_PRIVATE;
     attrP->robust = PTHREAD_MUTEX_STALLED;
+    attrP->handoff = PTHREAD_MUTEX_HANDOFF_NONE_NP;
     attrP->magic = MAGIC_VALID;
     
     *attr = attrP;
@@ -1539,3 +1908,89 @@ int pthread_mutexattr_setname_np
     return OK;
     }
 
+/*
+ * pthread_mutexattr_gethandoff_np - get the handoff attribute of mutex
+ * pthread_mutexattr_sethandoff_np - set the handoff attribute of mutex
+ *
+ * With PTHREAD_MUTEX_HANDOFF_NP, pthread_mutex_unlock() passes the mutex 
+ * directly to the waiter it wakes up, and switches to that waiter at once 
+ * if it has better precedence than the unlocking thread. The default is 
+ * PTHREAD_MUTEX_HANDOFF_NONE_NP, where the woken waiter competes for the 
+ * mutex again.
+ */
+int pthread_mutexattr_gethandoff_np
+    (
+    pthread_mutexattr_t *attr, 
+    int *handoff
+    )
+    {
+    pthread_mutexattr_t attrP = *attr;
+
+    if (attrP->magic != MAGIC_VALID)
+        return EINVAL;
+
+    *handoff = attrP->handoff;
+
+    return OK;
+    }
+
+int pthread_mutexattr_sethandoff_np
+    (
+    pthread_mutexattr_t *attr, 
+    int handoff
+    )
+    {
+    pthread_mutexattr_t attrP = *attr;
+
+    if (attrP->magic != MAGIC_VALID)
+        return EINVAL;
+
+    if ((handoff != PTHREAD_MUTEX_HANDOFF_NONE_NP) && 
+        (handoff != PTHREAD_MUTEX_HANDOFF_NP))
+        return EINVAL;
+
+    attrP->handoff = handoff;
+
+    return OK;
+    }
+
+int do_mutex (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    pthread_mutex_t mutexP;
+    pthread_t owner;
+    long contended;
+    long spun;
+
+    spinlock_lock(&sched_mutex_list_lock);
+
+    LIST_FOREACH(&sched_mutex_list, iter)
+        {
+        mutexP = LIST_ENTRY(iter, sched_mutex_t, node);
+
+        owner = mutexP->owner;
+        contended = atomic64_read(&mutexP->stats.contended);
+        spun = atomic64_read(&mutexP->stats.spin_acquired);
+
+        printk("%s - type %d owner %s, contended %lld, "
+               "spin acquired %lld (%lld%%), blocked %lld, spin cycles %lld\n",
+            mutexP->attr.name,
+            mutexP->attr.type,
+            owner ? owner->name : "none",
+            contended,
+            spun,
+            contended ? (spun * 100) / contended : 0,
+            atomic64_read(&mutexP->stats.blocked),
+            atomic64_read(&mutexP->stats.spin_cycles));
+        }
+
+    spinlock_unlock(&sched_mutex_list_lock);
+
+    return 0;
+    }
+
+CELL_OS_CMD(
+    mutex,   1,        1,    do_mutex,
+    "show mutex contention statistics",
+    "show the owner, the contended lock count, the locks taken by\n"
+    "spinning and the locks which blocked of each mutex\n"
+    );
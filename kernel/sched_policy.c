@@ -63,28 +63,50 @@ sched_policy_t * sched_policy_get_by_id
     return policy;
     }
 
+/* Dequeue the head of a runq if it is better than <check> */
+static sched_thread_t * sched_policy_runq_take
+    (
+    sched_policy_t * policy,
+    sched_runq_t *   runq,
+    sched_thread_t * check
+    )
+    {
+    if (!policy->preemption_check(runq, check))
+        return NULL;
+
+    return policy->thread_dequeue(runq);
+    }
+
 sched_thread_t * sched_policy_find_best_thread 
     (
     sched_policy_t * policy,
     sched_thread_t * check
     )
     {
-    sched_runq_t * runq;
+    sched_runq_t * cpu_runq;
+    sched_runq_t * sys_runq;
     sched_thread_t * best_thread;
-    sched_cpu_group_t *cpu_group;
-    sched_cpu_t * cpu = current_cpus[this_cpu()];
+    sched_cpu_t * cpu = kurrent_cpu;
+    BOOL sys_first;
 
-    /* Find the local cpu runq */
-    runq = policy->get_cpu_runq(cpu);
+    cpu_runq = policy->get_cpu_runq(cpu);
+    sys_runq = policy->get_sys_runq();
 
-    /* Check if the local cpu has a better thread to run */
-    if (policy->preemption_check(runq, check))
-        {
-        best_thread = policy->thread_dequeue(runq);
+    /* 
+     * The local runq is served first, unless the head of the system
+     * runq is better: a thread of the system runq must not wait behind
+     * lower priority threads of the local cpu.
+     */
+    sys_first = (policy->runq_head_compare != NULL) &&
+                policy->runq_head_compare(sys_runq, cpu_runq);
 
-        if (best_thread) 
-            return best_thread;
-        }
+    if (sys_first && 
+        (best_thread = sched_policy_runq_take(policy, sys_runq, check)))
+        return best_thread;
+
+    /* Check if the local cpu has a better thread to run */
+    if ((best_thread = sched_policy_runq_take(policy, cpu_runq, check)))
+        return best_thread;
     
     /* Check if the cpu_group has a better thread to run */
     best_thread = sched_cpu_group_find_best_thread(policy, cpu, check);
@@ -92,17 +114,10 @@ sched_thread_t * sched_policy_find_best_thread
     if (best_thread) 
         return best_thread;
 
-    /* Find the system runq */
-    runq = policy->get_sys_runq();
-
     /* Check if the system has a better thread to run */
-    if (policy->preemption_check(runq, check))
-        {
-        best_thread = policy->thread_dequeue(runq);
-
-        if (best_thread) 
-            return best_thread;
-        }
+    if (!sys_first &&
+        (best_thread = sched_policy_runq_take(policy, sys_runq, check)))
+        return best_thread;
 
     return NULL;
     }
@@ -133,3 +148,345 @@ struct sched_thread * sched_find_best_thread
     
     return NULL;
     }
+
+/* Check if the cpu has started scheduling threads */
+#define SCHED_CPU_ONLINE(cpu)   ((cpu)->idle_thread != NULL)
+
+/* Get the number of threads waiting on the cpu runq of a policy */
+#define SCHED_CPU_LOAD(policy, cpu)  \
+    ((policy)->get_cpu_runq(cpu)->runnable)
+
+/* 
+ * Check if any thread the cpu could run is waiting on its cpu runqs, on
+ * the runqs of its cpu_groups or on the system runqs; the runnable
+ * counts are read without the runq locks.
+ */
+bool sched_cpu_has_runnable
+    (
+    sched_cpu_t * cpu
+    )
+    {
+    int idx;
+    sched_policy_t * policy;
+
+    for (idx = 0; idx < sched_policy_count; idx++)
+        {
+        policy = sched_policy_array[idx];
+
+        if (!policy)
+            continue;
+
+        if (SCHED_CPU_LOAD(policy, cpu) || 
+            policy->get_sys_runq()->runnable ||
+            sched_cpu_group_has_runnable(policy, cpu))
+            return TRUE;
+        }
+
+    return FALSE;
+    }
+
+/*
+ * Select the cpu on which a new thread is enqueued: the least loaded
+ * online cpu in its cpu_set, preferring the local cpu on ties. An empty
+ * cpu_set keeps the thread on the local cpu.
+ */
+sched_cpu_t * sched_select_cpu
+    (
+    sched_thread_t * thread
+    )
+    {
+    sched_policy_t * policy = thread->sched_policy;
+    sched_cpu_t * best_cpu = NULL;
+    sched_cpu_t * cpu;
+    size_t best_load = 0;
+    size_t load;
+    int idx;
+
+    cpu = kurrent_cpu;
+
+    if (CPU_ISSET(cpu->cpu_idx, &thread->cpu_set))
+        {
+        best_cpu = cpu;
+        best_load = SCHED_CPU_LOAD(policy, cpu);
+        }
+
+    for (idx = 0; idx < CONFIG_NR_CPUS; idx++)
+        {
+        cpu = &cpus[idx];
+
+        if (!SCHED_CPU_ONLINE(cpu) || 
+            !CPU_ISSET(cpu->cpu_idx, &thread->cpu_set))
+            continue;
+
+        load = SCHED_CPU_LOAD(policy, cpu);
+
+        if (!best_cpu || (load < best_load))
+            {
+            best_cpu = cpu;
+            best_load = load;
+            }
+        }
+
+    return best_cpu ? best_cpu : kurrent_cpu;
+    }
+
+/*
+ * Select the cpu to wake a thread on: its previous cpu if that is idle,
+ * otherwise any idle cpu in its cpu_set, otherwise its previous cpu, and
+ * the least loaded cpu in its cpu_set if the previous one is not in it.
+ * An empty cpu_set keeps the thread on its previous cpu.
+ */
+static sched_cpu_t * sched_wakeup_select_cpu
+    (
+    sched_thread_t * thread
+    )
+    {
+    sched_cpu_t * prev = thread->sched_cpu;
+    sched_cpu_t * cpu;
+    bool allowed = FALSE;
+    int idx;
+
+    if (CPU_ISSET(prev->cpu_idx, &thread->cpu_set) && prev->idle)
+        return prev;
+
+    for (idx = 0; idx < CONFIG_NR_CPUS; idx++)
+        {
+        cpu = &cpus[idx];
+
+        if (!SCHED_CPU_ONLINE(cpu) || 
+            !CPU_ISSET(cpu->cpu_idx, &thread->cpu_set))
+            continue;
+
+        if (cpu->idle)
+            return cpu;
+
+        allowed = TRUE;
+        }
+
+    if (!allowed || CPU_ISSET(prev->cpu_idx, &thread->cpu_set))
+        return prev;
+
+    return sched_select_cpu(thread);
+    }
+
+/*
+ * Wait until the cpu a woken thread last ran on has saved its context.
+ * A thread sets itself pending and drops its wait lock before it calls
+ * reschedule(), so it may still run there when it is woken, and another
+ * cpu must not restore its context before it is saved. The old cpu does
+ * not wait for anything we may hold, interrupts are disabled from the
+ * time the thread pends to its switch.
+ */
+static void sched_thread_wait_off_cpu
+    (
+    sched_thread_t * thread
+    )
+    {
+    while (thread->on_cpu)
+        cpu_relax();
+
+    read_barrier();
+    }
+
+/*
+ * sched_thread_wakeup - make a ready thread runnable on a selected cpu
+ *
+ * The thread is enqueued on the cpu runq of the cpu selected for it. If
+ * that is a remote busy cpu and the thread has better precedence than
+ * the thread running there, the remote cpu is asked to reschedule; an
+ * idle remote cpu is woken by the enqueue itself. The current thread,
+ * woken from an interrupt before it switched out, just keeps running.
+ *
+ * Returns TRUE if the thread should preempt the current thread of the
+ * local cpu, in which case the caller should call reschedule().
+ */
+bool sched_thread_wakeup
+    (
+    sched_thread_t * thread
+    )
+    {
+    sched_policy_t * policy = thread->sched_policy;
+    sched_thread_t * current;
+    sched_cpu_t * cpu;
+
+    if (thread == kurrent)
+        {
+        thread->state = STATE_RUNNING;
+
+        return FALSE;
+        }
+
+    sched_thread_wait_off_cpu(thread);
+
+    cpu = sched_wakeup_select_cpu(thread);
+
+    thread->sched_cpu = cpu;
+    thread->cpu_idx = cpu->cpu_idx;
+    thread->sched_runq = policy->get_cpu_runq(cpu);
+
+    policy->thread_enqueue(thread->sched_runq, thread, FALSE);
+
+    current = cpu->current;
+
+    if (cpu->idle || !current || (current == cpu->idle_thread))
+        return (cpu == kurrent_cpu);
+
+    if (!SCHED_THREAD_PRECEDENCE_COMPARE(thread, current))
+        return FALSE;
+
+    if (cpu == kurrent_cpu)
+        return TRUE;
+
+    sched_cpu_arch_resched(cpu->cpu_idx);
+
+    return FALSE;
+    }
+
+/*
+ * sched_thread_handoff - hand the local cpu over to a woken thread
+ *
+ * Used when the current thread passes a resource (e.g. a mutex) directly
+ * to the thread. If the thread may run on the local cpu and has better
+ * precedence than the current thread, it is put on the local cpu runq so
+ * the following reschedule() switches straight to it. Otherwise this is
+ * the same as sched_thread_wakeup().
+ *
+ * Returns TRUE if the caller should call reschedule().
+ */
+bool sched_thread_handoff
+    (
+    sched_thread_t * thread
+    )
+    {
+    sched_policy_t * policy = thread->sched_policy;
+    sched_cpu_t * cpu = kurrent_cpu;
+
+    if (((thread->sched_cpu != cpu) && 
+         !CPU_ISSET(cpu->cpu_idx, &thread->cpu_set)) ||
+        !SCHED_THREAD_PRECEDENCE_COMPARE(thread, kurrent))
+        return sched_thread_wakeup(thread);
+
+    sched_thread_wait_off_cpu(thread);
+
+    thread->sched_cpu = cpu;
+    thread->cpu_idx = cpu->cpu_idx;
+    thread->sched_runq = policy->get_cpu_runq(cpu);
+
+    policy->thread_enqueue(thread->sched_runq, thread, FALSE);
+
+    return TRUE;
+    }
+
+/*
+ * Find the online cpu other than the specified one with the most
+ * threads waiting on its runq of the policy. The runnable counts
+ * are read without the runq locks, they are only a hint.
+ */
+static sched_cpu_t * sched_find_busiest_cpu
+    (
+    sched_policy_t * policy,
+    sched_cpu_t *    local,
+    size_t *         busiest_load
+    )
+    {
+    sched_cpu_t * busiest = NULL;
+    sched_cpu_t * cpu;
+    size_t load;
+    int idx;
+
+    *busiest_load = 0;
+
+    for (idx = 0; idx < CONFIG_NR_CPUS; idx++)
+        {
+        cpu = &cpus[idx];
+
+        if ((cpu == local) || !SCHED_CPU_ONLINE(cpu))
+            continue;
+
+        load = SCHED_CPU_LOAD(policy, cpu);
+
+        if (load > *busiest_load)
+            {
+            busiest = cpu;
+            *busiest_load = load;
+            }
+        }
+
+    return busiest;
+    }
+
+/*
+ * Idle-time balancing: called when the local cpu has nothing to run,
+ * pull the best thread allowed to run here from the busiest cpu.
+ */
+sched_thread_t * sched_balance_idle (void)
+    {
+    int idx;
+    size_t load;
+    sched_policy_t * policy;
+    sched_cpu_t * busiest;
+    sched_thread_t * thread;
+    
+    for (idx = 0; idx < sched_policy_count; idx++)
+        {
+        policy = sched_policy_array[idx];
+
+        if (!policy || !policy->thread_steal)
+            continue;
+
+        busiest = sched_find_busiest_cpu(policy, kurrent_cpu, &load);
+
+        if (!busiest)
+            continue;
+
+        thread = policy->thread_steal(policy->get_cpu_runq(busiest), 
+                                      kurrent_cpu);
+
+        if (thread)
+            return thread;
+        }
+
+    return NULL;
+    }
+
+/*
+ * Periodic balancing: called from the clock tick, move one thread from
+ * the busiest cpu to the local cpu runq if the busiest cpu has at least
+ * two more threads waiting than the local cpu.
+ */
+void sched_balance_tick (void)
+    {
+    int idx;
+    size_t load;
+    sched_policy_t * policy;
+    sched_runq_t * runq;
+    sched_cpu_t * busiest;
+    sched_thread_t * thread;
+    
+    for (idx = 0; idx < sched_policy_count; idx++)
+        {
+        policy = sched_policy_array[idx];
+
+        if (!policy || !policy->thread_steal)
+            continue;
+
+        runq = policy->get_cpu_runq(kurrent_cpu);
+
+        busiest = sched_find_busiest_cpu(policy, kurrent_cpu, &load);
+
+        if (!busiest || (load < runq->runnable + 2))
+            continue;
+
+        thread = policy->thread_steal(policy->get_cpu_runq(busiest), 
+                                      kurrent_cpu);
+
+        if (thread)
+            {
+            thread->sched_cpu = kurrent_cpu;
+            thread->cpu_idx = kurrent_cpu->cpu_idx;
+            thread->sched_runq = runq;
+            
+            policy->thread_enqueue(runq, thread, FALSE);
+            }
+        }
+    }
@@ -34,12 +34,17 @@
 #define SCHED_RR_PRIO_MAX     (63)
 #define SCHED_RR_PRIO_COUNT   (SCHED_RR_PRIO_MAX - SCHED_RR_PRIO_MIN + 1)
 
+/* The occupancy bitmap has one bit per priority level */
+#if SCHED_RR_PRIO_COUNT > 64
+#error "SCHED_RR_PRIO_COUNT does not fit in the 64 bit priority bitmap"
+#endif
+
 /* Runq structure for this scheduling policy */
 typedef struct sched_rr_runq
     {
     sched_runq_t runq; /* Common runq interface - must be first */
     qhead_t prio_array[SCHED_RR_PRIO_COUNT];  /* Priority array */
-    int best_priority; /* The best priority (lowest value) */
+    uint64_t prio_bitmap; /* Bit N set if prio_array[N] is not empty */
     id_t owner_id;     /* The ID of the owner (cpu or cpu_group, or system) */
     list_t node;       /* Runq list node */
     }sched_rr_runq_t;
@@ -67,6 +72,24 @@ static spinlock_t sched_rr_cpu_group_runq_list_lock;
 #define RR_SCHED_RUNQ(runq)    \
     (sched_rr_runq_t *)(runq)
 
+/* 
+ * Get the best (highest) non-empty priority level of the runq, 
+ * or -1 if the runq is empty. Without the runq lock held, the result
+ * may already be stale.
+ */
+static inline int sched_rr_runq_best_priority
+    (
+    sched_rr_runq_t * sched_runq
+    )
+    {
+    uint64_t bitmap = *(volatile uint64_t *)&sched_runq->prio_bitmap;
+
+    if (bitmap == 0)
+        return -1;
+
+    return find_last_bit_set64(bitmap) - 1 + SCHED_RR_PRIO_MIN;
+    }
+
 /* Initialize the runq structure */
 status_t sched_rr_runq_init
     (
@@ -112,32 +135,8 @@ status_t  sched_rr_attach_cpu_group
      * If we have found the cpu_group, then we MAY have created a
      * runq for that cpu_group, so use it on the way!
      */
-    if (cpu_group)
-        {
-        /* Check if we already have a runq for this cpu_group */
-
-        SCHED_RR_CPU_GROUP_RUNQ_LOCK();
-        
-        cpu_group_runq = NULL;
-        LIST_FOREACH(&sched_rr_cpu_group_runq_list,iter)
-            {
-            cpu_group_runq = LIST_ENTRY(iter, sched_rr_runq_t, node);
-            if (cpu_group_runq->owner_id == cpu_group->cpu_group_id)
-                break;
-            cpu_group_runq = NULL;
-            }
-
-        SCHED_RR_CPU_GROUP_RUNQ_UNLOCK();
-
-        /* 
-         * We have found an already created runq for this cpu_group, 
-         * so return here.
-         */
-        if (cpu_group_runq)
-            return OK;
-
-        /* Otherwise, we have to create a runq for this cpu_group */
-        }
+    if (cpu_group && cpu_group->runq[SCHED_RR])
+        return OK;
     
     /* If we do not have a usable cpu_group, create one! */
     if (!cpu_group)
@@ -165,8 +164,23 @@ status_t  sched_rr_attach_cpu_group
     
     SCHED_RR_CPU_GROUP_RUNQ_LOCK();
 
+    /* Someone else attached this cpu_group meanwhile */
+    if (cpu_group->runq[SCHED_RR])
+        {
+        SCHED_RR_CPU_GROUP_RUNQ_UNLOCK();
+
+        kfree(cpu_group_runq);
+
+        return OK;
+        }
+
     list_append(&sched_rr_cpu_group_runq_list,
                 &cpu_group_runq->node);
+
+    /* The runq must be initialized before lock-free readers can see it */
+    write_barrier();
+
+    cpu_group->runq[SCHED_RR] = &cpu_group_runq->runq;
     
     SCHED_RR_CPU_GROUP_RUNQ_UNLOCK();
 
@@ -211,27 +225,8 @@ struct sched_runq *  sched_rr_get_cpu_group_runq
     struct sched_cpu_group * cpu_group
     )
     {
-    sched_rr_runq_t * cpu_group_runq = NULL;
-    
-    /* Check if we already have a runq for this cpu_group */
-    
-    SCHED_RR_CPU_GROUP_RUNQ_LOCK();
-    
-    cpu_group_runq = NULL;
-    
-    LIST_FOREACH(&sched_rr_cpu_group_runq_list,iter)
-        {
-        cpu_group_runq = LIST_ENTRY(iter, sched_rr_runq_t, node);
-        
-        if (cpu_group_runq->owner_id == cpu_group->cpu_group_id)
-            break;
-        
-        cpu_group_runq = NULL;
-        }
-    
-    SCHED_RR_CPU_GROUP_RUNQ_UNLOCK();
-
-    return (struct sched_runq *)cpu_group_runq;
+    /* Published by sched_rr_attach_cpu_group(), read without locking */
+    return cpu_group->runq[SCHED_RR];
     }
 
 /* Enqueue a thread to run */
@@ -258,6 +253,8 @@ bool    sched_rr_thread_enqueue
     /* Get the priority queue */
     prioq = &sched_runq->prio_array[sched_param->sched_priority];
 
+    sched_param->slice_expired = FALSE;
+
     /*
      * SCHED_RR:
      * 
@@ -267,16 +264,29 @@ bool    sched_rr_thread_enqueue
      */
     enqueue(prioq, &thread->runq_node, FALSE);
 
-    /* Record the best priority (with max priority value) */
-    if ((sched_param->sched_priority > sched_runq->best_priority) ||
-        (sched_runq->runq.runnable == 0))
-        sched_runq->best_priority = sched_param->sched_priority;
+    /* Mark the priority level as occupied */
+    sched_runq->prio_bitmap |= 
+        (1ULL << (sched_param->sched_priority - SCHED_RR_PRIO_MIN));
 
     sched_runq->runq.runnable++;
 
     /* Unlock the runq */
     SCHED_RUNQ_UNLOCK(runq);
 
+    /* 
+     * Wake the owner cpu if this is the runq of an idle cpu, or an idle
+     * cpu allowed to run the thread if this is a cpu_group or system runq
+     */
+    if ((sched_runq >= &sched_runq_rr_cpu[0]) &&
+        (sched_runq < &sched_runq_rr_cpu[CONFIG_NR_CPUS]))
+        {
+        sched_cpu_wakeup(&cpus[sched_runq->owner_id]);
+        }
+    else
+        {
+        sched_cpu_set_wakeup(&thread->cpu_set);
+        }
+
     if (!preemptable)
         {        
         return FALSE;
@@ -304,7 +314,7 @@ sched_thread_t *  sched_rr_thread_dequeue
     /* Lock the runq */
     SCHED_RUNQ_LOCK(runq);
 
-    if (sched_runq->runq.runnable == 0)
+    if (sched_runq->prio_bitmap == 0)
         {
         /* Unlock the runq */
         SCHED_RUNQ_UNLOCK(runq);
@@ -312,25 +322,19 @@ sched_thread_t *  sched_rr_thread_dequeue
         return NULL;
         }
     
-    for (prio = sched_runq->best_priority; 
-         prio >= SCHED_RR_PRIO_MIN; 
-         prio++)
-        {
-        prioq = &sched_runq->prio_array[prio];
+    /* The highest set bit is the best non-empty priority level */
+    prio = sched_rr_runq_best_priority(sched_runq);
 
-        if (!queue_empty(prioq))
-            {
-            qelement_t * entry = dequeue(prioq, TRUE);
-            
-            thread = queue_entry(entry, 
-                                 sched_thread_t, 
-                                 runq_node);
-            
-            sched_runq->runq.runnable--;
-            
-            break;
-            }
-        }
+    prioq = &sched_runq->prio_array[prio - SCHED_RR_PRIO_MIN];
+
+    thread = queue_entry(dequeue(prioq, TRUE), 
+                         sched_thread_t, 
+                         runq_node);
+
+    if (queue_empty(prioq))
+        sched_runq->prio_bitmap &= ~(1ULL << (prio - SCHED_RR_PRIO_MIN));
+    
+    sched_runq->runq.runnable--;
          
     /* Unlock the runq */
     SCHED_RUNQ_UNLOCK(runq);
@@ -345,18 +349,102 @@ void sched_rr_thread_rmqueue
     sched_thread_t *       thread         
     )
     {
+    sched_rr_runq_t * sched_runq = RR_SCHED_RUNQ(runq);
+    qhead_t * prioq;
+    
     /* Lock the runq */
     SCHED_RUNQ_LOCK(runq);
 
+    prioq = thread->runq_node.head;
+
+    /* The caller must only remove a thread from the runq it waits on */
+    ASSERT((prioq >= &sched_runq->prio_array[0]) &&
+           (prioq < &sched_runq->prio_array[SCHED_RR_PRIO_COUNT]));
+
+    if ((prioq < &sched_runq->prio_array[0]) ||
+        (prioq >= &sched_runq->prio_array[SCHED_RR_PRIO_COUNT]))
+        {
+        SCHED_RUNQ_UNLOCK(runq);
+
+        printk("sched_rr_thread_rmqueue - thread %s is not on the runq\n",
+               thread->name);
+
+        return;
+        }
+
     queue_remove(&thread->runq_node, TRUE);
+
+    if (queue_empty(prioq))
+        sched_runq->prio_bitmap &= 
+            ~(1ULL << (prioq - &sched_runq->prio_array[0]));
+
+    sched_runq->runq.runnable--;
     
     /* Unlock the runq */
     SCHED_RUNQ_UNLOCK(runq);
     }
 
+/* 
+ * Remove the best thread which is allowed to run on the specified 
+ * cpu from a run queue; this is used by the load balancer to pull 
+ * threads from a busy cpu.
+ */
+sched_thread_t * sched_rr_thread_steal
+    (
+    sched_runq_t *   runq,
+    sched_cpu_t *    cpu
+    )
+    {
+    sched_rr_runq_t * sched_runq = RR_SCHED_RUNQ(runq);
+    sched_thread_t * thread = NULL;
+    uint64_t bitmap;
+    qhead_t * prioq;
+    int level;
+    
+    /* Lock the runq */
+    SCHED_RUNQ_LOCK(runq);
+
+    /* Walk the non-empty priority levels from the best to the worst */
+    for (bitmap = sched_runq->prio_bitmap; 
+         (bitmap != 0) && (thread == NULL); 
+         bitmap &= ~(1ULL << level))
+        {
+        level = find_last_bit_set64(bitmap) - 1;
+
+        prioq = &sched_runq->prio_array[level];
+
+        QUEUE_ITERATE(prioq, iter)
+            {
+            thread = queue_entry(iter, sched_thread_t, runq_node);
+
+            if (!(thread->flags & THREAD_STANDALONE) &&
+                CPU_ISSET(cpu->cpu_idx, &thread->cpu_set))
+                break;
+
+            thread = NULL;
+            }
+        
+        if (thread)
+            {
+            queue_remove(&thread->runq_node, TRUE);
+            
+            if (queue_empty(prioq))
+                sched_runq->prio_bitmap &= ~(1ULL << level);
+
+            sched_runq->runq.runnable--;
+            }
+        }
+    
+    /* Unlock the runq */
+    SCHED_RUNQ_UNLOCK(runq);
+
+    return thread;
+    }
+
 /* 
  * Check if the specified thread can be preempted 
- * by the best thread on the runq 
+ * by the best thread on the runq. A thread whose time slice
+ * expired also yields to threads of its own priority.
  */
 bool sched_rr_preemption_check
     (
@@ -378,11 +466,12 @@ bool sched_rr_preemption_check
     /* Lock the runq */
     SCHED_RUNQ_LOCK(runq);
 
-    if (sched_runq->runq.runnable == 0)
-        preempt = FALSE;
+    if (sched_param->slice_expired)
+        preempt = (sched_rr_runq_best_priority(sched_runq) >= 
+                   sched_param->sched_priority);
     else
-        preempt = (sched_runq->best_priority > 
-                    sched_param->sched_priority);
+        preempt = (sched_rr_runq_best_priority(sched_runq) > 
+                   sched_param->sched_priority);
         
     /* Unlock the runq */
     SCHED_RUNQ_UNLOCK(runq);
@@ -390,6 +479,22 @@ bool sched_rr_preemption_check
     return preempt;
     }
 
+/* 
+ * Compare threads at the heads of two run queues; return TRUE if
+ * the head of runq1 has better priority than the head of runq2.
+ * The bitmaps are read without the runq locks, so this is only a hint
+ * for the order the runqs are looked at in.
+ */
+bool sched_rr_runq_head_compare
+    (
+    sched_runq_t *   runq1,
+    sched_runq_t *   runq2
+    )
+    {
+    return sched_rr_runq_best_priority(RR_SCHED_RUNQ(runq1)) > 
+           sched_rr_runq_best_priority(RR_SCHED_RUNQ(runq2));
+    }
+
 /* Compare precedence of threads with in this scheduling policy */
 bool sched_rr_thread_precedence_compare
     (
@@ -403,14 +508,64 @@ bool sched_rr_thread_precedence_compare
     return sched_param1->sched_priority > sched_param2->sched_priority;
     }
 
-/* Priority update */
+/* 
+ * Priority update, used by priority inheritance and ceiling mutexes. 
+ * A thread waiting on a runq is moved to the tail of the priority 
+ * level of its new priority.
+ */
 void sched_rr_change_priority
     (
     struct sched_thread *   thread,
     int                     prio
     )
     {
-    return;
+    sched_rr_param_t * sched_param = RR_SCHED_PARAM(thread);
+    sched_runq_t * runq = thread->sched_runq;
+    sched_rr_runq_t * sched_runq;
+    qhead_t * prioq;
+
+    /* Make sure the priority is in valid range */
+    if (prio < SCHED_RR_PRIO_MIN)
+        prio = SCHED_RR_PRIO_MIN;
+    else if (prio > SCHED_RR_PRIO_MAX)
+        prio = SCHED_RR_PRIO_MAX;
+
+    if (!runq)
+        {
+        sched_param->sched_priority = prio;
+        return;
+        }
+
+    sched_runq = RR_SCHED_RUNQ(runq);
+
+    /* Lock the runq */
+    SCHED_RUNQ_LOCK(runq);
+
+    prioq = thread->runq_node.head;
+
+    /* Requeue the thread only if it is really on this runq */
+    if ((prioq >= &sched_runq->prio_array[0]) &&
+        (prioq < &sched_runq->prio_array[SCHED_RR_PRIO_COUNT]))
+        {
+        queue_remove(&thread->runq_node, TRUE);
+
+        if (queue_empty(prioq))
+            sched_runq->prio_bitmap &= 
+                ~(1ULL << (prioq - &sched_runq->prio_array[0]));
+
+        sched_param->sched_priority = prio;
+
+        prioq = &sched_runq->prio_array[prio - SCHED_RR_PRIO_MIN];
+
+        enqueue(prioq, &thread->runq_node, FALSE);
+
+        sched_runq->prio_bitmap |= (1ULL << (prio - SCHED_RR_PRIO_MIN));
+        }
+    else
+        sched_param->sched_priority = prio;
+    
+    /* Unlock the runq */
+    SCHED_RUNQ_UNLOCK(runq);
     }
 
 /* Get thread current priority */
@@ -424,19 +579,32 @@ int sched_rr_get_priority
     return sched_param->sched_priority;
     }
 
-/* Scheduling decisions at periodic clock tick */
+/* 
+ * Scheduling decisions at periodic clock tick. The thread stays
+ * RUNNING when its slice expires, so reschedule() compares the
+ * candidates against it; it is switched out only for a thread of
+ * equal or better priority, and then requeued at the tail of its
+ * own priority level.
+ */
 BOOL sched_rr_sched_clock_tick
     (
-    struct sched_thread * thread
+    struct sched_thread * thread,
+    abstime_t             ran_ns
     )
     {    
-    thread->remain_time_slice--;
+    sched_rr_param_t * sched_param = RR_SCHED_PARAM(thread);
+
+    /* An expired slice that was kept running has been refilled */
+    sched_param->slice_expired = FALSE;
+
+    thread->remain_time_slice -= ran_ns;
 
     if (thread->remain_time_slice <= 0)
         {
-        thread->remain_time_slice = thread->sched_time_slice;
+        thread->remain_time_slice = 
+            SCHED_TICKS2NSECS(thread->sched_time_slice);
 
-        thread->state = STATE_READY;
+        sched_param->slice_expired = TRUE;
 
         return TRUE;
         }
@@ -491,6 +659,7 @@ status_t sched_policy_rr_init (void)
     policy->thread_enqueue = sched_rr_thread_enqueue;
     policy->thread_dequeue = sched_rr_thread_dequeue;
     policy->thread_rmqueue = sched_rr_thread_rmqueue;
+    policy->thread_steal = sched_rr_thread_steal;
 
     policy->get_sched_param = NULL;
     policy->set_sched_param = NULL;
@@ -502,7 +671,7 @@ status_t sched_policy_rr_init (void)
     policy->change_priority = sched_rr_change_priority;
     policy->get_priority = sched_rr_get_priority;
     
-    policy->runq_head_compare = NULL;
+    policy->runq_head_compare = sched_rr_runq_head_compare;
     
     policy->thread_precedence_compare = sched_rr_thread_precedence_compare;
     
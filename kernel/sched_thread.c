@@ -15,6 +15,11 @@ static spinlock_t sched_thread_global_list_lock;
 static int sched_thread_concurrency = 0;
 static id_t   sched_thread_id_next = 0;
 
+/* Thread control blocks, cache line aligned */
+static KMEM_CACHE_DECLARE(sched_thread_cache, "sched_thread", 
+                          sizeof(struct sched_thread), X64_CACHE_LINE_SIZE,
+                          NULL);
+
 #define SCHED_THREAD_ZOMBIE_LOCK()    \
     spinlock_lock(&sched_thread_zombie_list_lock)
     
@@ -134,6 +139,94 @@ char *sched_thread_state_name(int state)
         }
     }
 
+/*
+ * Wait timer function: wake the thread at the end of its timed wait or
+ * sleep, unless its waker got there first. It runs from the tick of the
+ * CPU the timer was armed on, so a better thread woken on that CPU gets
+ * it through a reschedule request.
+ */
+static void sched_thread_wait_timeout
+    (
+    void * arg
+    )
+    {
+    pthread_t thread = (pthread_t)arg;
+
+    if (!sched_thread_wait_claim(thread))
+        return;
+
+    thread->state = STATE_READY;
+
+    if (sched_thread_wakeup(thread))
+        sched_cpu_arch_resched(this_cpu());
+    }
+
+/*
+ * sched_thread_wait_deadline_set - arm the wait timer of the current
+ * thread, called before it pends until 'deadline' CLOCK_MONOTONIC ns or
+ * ABSTIME_INFINITY for no timeout
+ *
+ * The thread shall be made visible to its wakers, with its wait_woken
+ * reset, before the timer is armed.
+ */
+void sched_thread_wait_deadline_set
+    (
+    abstime_t deadline
+    )
+    {
+    kurrent->resume_time = deadline;
+
+    if (deadline != ABSTIME_INFINITY)
+        ktimer_arm(&kurrent->wait_timer, deadline);
+    }
+
+/*
+ * sched_thread_wait_deadline_clear - disarm it once the thread runs again
+ *
+ * A wait timer which fired too late to claim the wakeup may still be
+ * running on another CPU, it is waited for so that it can not claim the
+ * wakeup of the next wait instead.
+ */
+void sched_thread_wait_deadline_clear (void)
+    {
+    if (kurrent->resume_time != ABSTIME_INFINITY)
+        ktimer_cancel_sync(&kurrent->wait_timer);
+
+    kurrent->resume_time = ABSTIME_INFINITY;
+    }
+
+/*
+ * sched_thread_sleep_until - delay the current thread until 'deadline'
+ * CLOCK_MONOTONIC ns
+ *
+ * Interrupts stay disabled until the thread is switched out, so that the
+ * wait timer, armed on this CPU, can not fire before.
+ */
+void sched_thread_sleep_until
+    (
+    abstime_t deadline
+    )
+    {
+    ipl_t ipl;
+
+    if (deadline <= get_monotonic_nanosecond())
+        return;
+
+    ipl = interrupts_disable();
+
+    atomic_set(&kurrent->wait_woken, 0);
+
+    kurrent->state = STATE_DELAY;
+
+    sched_thread_wait_deadline_set(deadline);
+
+    reschedule();
+
+    sched_thread_wait_deadline_clear();
+
+    interrupts_restore(ipl);
+    }
+
 void sched_thread_show
     (
     pthread_t thread
@@ -298,7 +391,7 @@ int pthread_create
 	stack_size = attrP->stacksize;
 	stack_addr = attrP->stackaddr;
 
-	new_thread = (struct sched_thread *) kmalloc(sizeof(struct sched_thread));
+	new_thread = (struct sched_thread *) kmem_cache_alloc(&sched_thread_cache);
  	if (!new_thread) 
         {
         printk("No memory for a new thread structure\n");
@@ -323,13 +416,16 @@ int pthread_create
          */
         if (stack_size < CONFIG_KSTACK_SIZE)
             stack_size = CONFIG_KSTACK_SIZE;
+
+        /* Stacks are whole pages, single pages come from the per-CPU cache */
+        stack_size = ALIGN_UP(stack_size, PAGE_SIZE);
         
-		stack_addr = (char *) kmalloc(stack_size);
+		stack_addr = (char *) page_alloc_contig((int)(stack_size / PAGE_SIZE));
  		if (!stack_addr) 
             {
             printk("No memory for thread stack area\n");
             
-			kfree(new_thread);
+			kmem_cache_free(&sched_thread_cache, new_thread);
             
   			return EAGAIN;
   		    }
@@ -379,6 +475,8 @@ int pthread_create
 	new_thread->cleanup = 0;
 	new_thread->resume_time = ABSTIME_INFINITY;
 
+    ktimer_init(&new_thread->wait_timer, sched_thread_wait_timeout, new_thread);
+
     /* Copy the maxium scheduler parameters */
 	memcpy(new_thread->sched_param_area, 
            attrP->sched_param_area, SCHED_PARAM_AREA_SIZE);
@@ -395,7 +493,8 @@ int pthread_create
     if (new_thread->sched_policy_id == SCHED_RR)
         {
         new_thread->sched_time_slice = attrP->sched_time_slice;
-        new_thread->remain_time_slice = attrP->sched_time_slice;
+        new_thread->remain_time_slice = 
+            SCHED_TICKS2NSECS(attrP->sched_time_slice);
         }
     
     spinlock_init(&new_thread->thread_lock);
@@ -424,12 +523,14 @@ int pthread_create
         return EPERM;
         }
 
-    //sched_runq = sched_policy->get_cpu_runq(new_thread->sched_cpu);
-    sched_runq = sched_policy->get_sys_runq();
+    /* sched_thread_wakeup() moves it to the cpu selected to run it */
+    sched_runq = sched_policy->get_cpu_runq(new_thread->sched_cpu);
 
     new_thread->sched_runq = sched_runq;
 
     list_init(&new_thread->sig_handler_list);
+
+    list_init(&new_thread->mutex_list);
     
     sched_thread_add_global(new_thread);
 
@@ -440,7 +541,8 @@ int pthread_create
         {
         new_thread->state = STATE_READY;
         
-        sched_policy->thread_enqueue(sched_runq, new_thread, TRUE);
+        if (sched_thread_wakeup(new_thread))
+            reschedule();
         }
     else
         {
@@ -899,9 +1001,8 @@ int pthread_resume_np
     
     thread->state = STATE_READY;            
     
-    thread->sched_policy->thread_enqueue(thread->sched_runq,
-                                         thread, TRUE);
-    reschedule();
+    if (sched_thread_wakeup(thread))
+        reschedule();
 
 	return OK;
     }
@@ -970,12 +1071,15 @@ static void sched_thread_free_memory
     
 	if (thread->stack_base_free) 
         {
-		kfree (thread->stack_base_free);
+		page_free (thread->stack_base_free);
 	    }
 
     sched_thread_remove_global(thread);
+
+    /* Its wait timer function may still be running with the TCB */
+    ktimer_cancel_sync(&thread->wait_timer);
     
-	kfree (thread);
+	kmem_cache_free (&sched_thread_cache, thread);
     }
 
 int sched_thread_delete
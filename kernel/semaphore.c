@@ -9,6 +9,139 @@ static list_t           semaphore_list;
 static spinlock_t       semaphore_lock;
 static id_t             semaphore_id_next;
 
+KMEM_CACHE_DECLARE(sched_sem_cache, "sched_sem", sizeof(sched_semaphore_t),
+                   X64_CACHE_LINE_SIZE, NULL);
+
+/* Find the best thread pending on the semaphore, called with its lock held */
+static void sem_best_waiter_update
+    (
+    sem_t * sem
+    )
+    {
+    pthread_t next_thread;
+    pthread_t better_thread = NULL;
+
+    QUEUE_ITERATE(&sem->waitq, iter)
+        {
+        next_thread = queue_entry(iter, sched_thread_t, waitq_node);
+
+        if (!better_thread ||
+            SCHED_THREAD_PRECEDENCE_COMPARE(next_thread, better_thread))
+            better_thread = next_thread;
+        }
+
+    sem->best_waiter = better_thread;
+    }
+
+/*
+ * Lock the semaphore, waiting until 'deadline' CLOCK_MONOTONIC ns at
+ * most. A negative count is the number of threads pending on it.
+ */
+static int sem_wait_deadline
+    (
+    sem_t *     sem,
+    abstime_t   deadline
+    )
+    {
+    BOOL better;
+    ipl_t ipl;
+
+    if (!sem || sem->magic != MAGIC_VALID || LIST_EMPTY(&sem->node))
+        {
+        kurrent->err = EINVAL;
+        
+        return ERROR;
+        }
+    
+    spinlock_lock(&sem->lock);
+
+    if (sem->count > 0)
+        {
+        sem->count--;
+
+        spinlock_unlock(&sem->lock);
+
+        return OK;
+        }
+
+    if ((deadline != ABSTIME_INFINITY) &&
+        (deadline <= get_monotonic_nanosecond()))
+        {
+        spinlock_unlock(&sem->lock);
+
+        kurrent->err = ETIMEDOUT;
+
+        return ERROR;
+        }
+
+#ifdef SEMAPHORE_DETAL
+    printk("sem %s pend thread %s\n", sem->name, kurrent->name);
+#endif
+
+    /* Count the current thread as pending, sem_post() wakes it */
+    sem->count--;
+
+    /* Add the current thread to the waitq */  
+    enqueue(&sem->waitq, &kurrent->waitq_node, FALSE);
+    
+    /* If there is no other waiting, caller is the best! */
+    if (sem->best_waiter == NULL)
+        {
+        sem->best_waiter = kurrent;
+        }
+    else
+        {
+        better = SCHED_THREAD_PRECEDENCE_COMPARE(kurrent, 
+                                        sem->best_waiter);
+        if (better)
+            sem->best_waiter = kurrent;
+        }
+
+    /* Set the current self_thread as pending on mutexP */
+    kurrent->state = STATE_PENDING;
+
+    atomic_set(&kurrent->wait_woken, 0);
+
+    /* The wait timer shall not fire on this CPU before we switch out */
+    ipl = interrupts_disable();
+
+    sched_thread_wait_deadline_set(deadline);
+
+    spinlock_unlock(&sem->lock);
+
+    reschedule();
+
+    interrupts_restore(ipl);
+
+    sched_thread_wait_deadline_clear();
+
+    /* Still on the waitq, so it is the wait timer which woke us up */
+    if (kurrent->waitq_node.head != NULL)
+        {
+        spinlock_lock(&sem->lock);
+
+        if (kurrent->waitq_node.head != NULL)
+            {
+            queue_remove(&kurrent->waitq_node, FALSE);
+
+            sem->count++;
+
+            sem_best_waiter_update(sem);
+
+            spinlock_unlock(&sem->lock);
+
+            kurrent->err = ETIMEDOUT;
+
+            return ERROR;
+            }
+
+        /* sem_post() gave us the count meanwhile */
+        spinlock_unlock(&sem->lock);
+        }
+    
+    return OK;
+    }
+
 void semaphore_system_init(void)
     {
     list_init(&semaphore_list);
@@ -436,8 +569,6 @@ int sem_close(sem_t *sem)
 int sem_post(sem_t *sem)
     {
     pthread_t wake_thread = NULL;
-    pthread_t next_thread = NULL;
-    pthread_t better_thread = NULL;
 
     if (!sem || sem->magic != MAGIC_VALID || LIST_EMPTY(&sem->node))
         {
@@ -463,39 +594,24 @@ int sem_post(sem_t *sem)
 
         queue_remove(&wake_thread->waitq_node, FALSE);
         
-        QUEUE_ITERATE(&sem->waitq, iter)
-            {
-            next_thread = queue_entry(iter, sched_thread_t, waitq_node);
-        
-            if (next_thread)
-                {
-                if (!better_thread)
-                    better_thread = next_thread;
-                else
-                    {
-                    BOOL better;
-                    
-                    better = SCHED_THREAD_PRECEDENCE_COMPARE(next_thread,
-                                                             better_thread);
-                    if (better)
-                        better_thread = next_thread;
-                    }
-                }
-            }
-        
         /* Save the next better thread */
-        sem->best_waiter = better_thread;
+        sem_best_waiter_update(sem);
 
 #ifdef SEMAPHORE_DETAL
         printk("sem wakeup thread %s\n", wake_thread->name);
 #endif
         
-        wake_thread->state = STATE_READY;
-        
-        wake_thread->sched_policy->thread_enqueue(wake_thread->sched_runq, 
-                                                  wake_thread, TRUE);
+        /* 
+         * If its wait timer has already woken it, the thread finds 
+         * itself off the waitq and takes the count all the same 
+         */
+        if (sched_thread_wait_claim(wake_thread))
+            {
+            wake_thread->state = STATE_READY;
         
-        reschedule();
+            if (sched_thread_wakeup(wake_thread))
+                reschedule();
+            }
         }
     
     spinlock_unlock(&sem->lock);
@@ -575,7 +691,24 @@ int sem_post(sem_t *sem)
 
 int sem_timedwait(sem_t * sem, const struct timespec * abstime)
     {    
-    return sem_wait(sem);
+    abstime_t deadline;
+    int ret;
+
+    ret = ktimer_deadline(CLOCK_REALTIME, TIMER_ABSTIME, abstime, &deadline);
+
+    /* The abstime need not be valid if the semaphore can be locked at once */
+    if (ret != OK)
+        {
+        if (sem_trywait(sem) == OK)
+            return OK;
+
+        if (kurrent->err == EAGAIN)
+            kurrent->err = ret;
+
+        return ERROR;
+        }
+
+    return sem_wait_deadline(sem, deadline);
     }
 
 /*
@@ -668,54 +801,7 @@ int sem_trywait(sem_t *sem)
 
 int sem_wait(sem_t *sem)
     {
-    BOOL better;
-
-    if (!sem || sem->magic != MAGIC_VALID || LIST_EMPTY(&sem->node))
-        {
-        kurrent->err = EINVAL;
-        
-        return ERROR;
-        }
-    
-    spinlock_lock(&sem->lock);
-
-    if (sem->count > 0)
-        {
-        sem->count--;
-
-        spinlock_unlock(&sem->lock);
-
-        return OK;
-        }
-
-#ifdef SEMAPHORE_DETAL
-    printk("sem %s pend thread %s\n", sem->name, kurrent->name);
-#endif
-
-    /* Add the current thread to the waitq */  
-    enqueue(&sem->waitq, &kurrent->waitq_node, FALSE);
-    
-    /* If there is no other waiting, caller is the best! */
-    if (sem->best_waiter == NULL)
-        {
-        sem->best_waiter = kurrent;
-        }
-    else
-        {
-        better = SCHED_THREAD_PRECEDENCE_COMPARE(kurrent, 
-                                        sem->best_waiter);
-        if (better)
-            sem->best_waiter = kurrent;
-        }
-
-    /* Set the current self_thread as pending on mutexP */
-    kurrent->state = STATE_PENDING;
-
-    spinlock_unlock(&sem->lock);
-
-    reschedule();
-    
-    return OK;
+    return sem_wait_deadline(sem, ABSTIME_INFINITY);
     }
 
 /*
@@ -5,7 +5,8 @@
 #include <time.h>
 #include <os/timer.h>
 
-struct timerchain_head global_interval_timerchain;
+static KMEM_CACHE_DECLARE(itimer_cache, "itimer", sizeof(interval_timer_t),
+                          X64_CACHE_LINE_SIZE, NULL);
 
 /*
   NAME
@@ -347,57 +348,36 @@ int timer_settime(timer_t timerid, int flags, const struct itimerspec * value,
   The which argument is not recognized.
 */
 
-void itimer_callback_handler(void)
+/*
+ * Fire an interval timer from its timer wheel, and re-arm it one interval
+ * after the previous expiry when it is periodic, so that it does not drift
+ */
+static void itimer_fire(void * arg)
     {
-    interval_timer_t * itimer;
-    struct timeval now;
-    abstime_t cmp;
-    struct timerchain_node * timernode;
-
-    timernode = timerchain_get_earliest(&global_interval_timerchain);
+    interval_timer_t * itimer = (interval_timer_t *)arg;
 
-    if (!timernode)
-        return;
-       
-    gettimeofday(&now, NULL);
-    
-    cmp = timeval_to_abstime(&now);
-    
-    if (cmp < timernode->expires)
+    if (itimer->enabled != TRUE)
         return;
 
-    itimer = CONTAINER_OF(timernode, interval_timer_t, timer_node);
+    itimer->handler(itimer->arg);
 
-    if (itimer->enabled == TRUE)
+    /*
+     * If it_interval is non-zero, it shall specify a value to be 
+     * used in reloading it_value when the timer expires. 
+     *
+     * Setting it_interval to 0 shall disable a timer after its 
+     * next expiration (assuming it_value is non-zero).
+     */
+    if (timeval_nz(&itimer->timerval.it_interval))
         {
-        itimer->handler(itimer->arg);
-        
-        timerchain_remove(&global_interval_timerchain, &itimer->timer_node);
-
-        /*
-         * If it_interval is non-zero, it shall specify a value to be 
-         * used in reloading it_value when the timer expires. 
-         *
-         * Setting it_interval to 0 shall disable a timer after its 
-         * next expiration (assuming it_value is non-zero).
-         */
-        if (timeval_nz(&itimer->timerval.it_interval))
-            {            
-            itimer->timerval.it_value = itimer->timerval.it_interval;
-            
-            gettimeofday(&now, NULL);
-            timeval_add(&now, &itimer->timerval.it_value);
-            cmp = timeval_to_abstime(&now);
+        itimer->timerval.it_value = itimer->timerval.it_interval;
 
-            /* Setup expiry time */
-            itimer->timer_node.expires = cmp;
-
-            timerchain_add(&global_interval_timerchain, &itimer->timer_node);
-            }
-        else
-            {
-            itimer->enabled = FALSE;
-            }
+        ktimer_arm(&itimer->timer, itimer->timer.expires +
+                   timeval_to_abstime(&itimer->timerval.it_interval));
+        }
+    else
+        {
+        itimer->enabled = FALSE;
         }
     }
 
@@ -418,6 +398,15 @@ int getitimer(int which, struct itimerval *value)
         return ENODEV;
     
     *value = kurrent->itimer_REAL->timerval;
+
+    /* it_value is the time left until the next expiry */
+    if (kurrent->itimer_REAL->enabled == TRUE)
+        {
+        abstime_t left = kurrent->itimer_REAL->timer.expires -
+                         get_monotonic_nanosecond();
+
+        abstime_to_timeval(left > 0 ? left : 0, &value->it_value);
+        }
     
     return OK;
     }
@@ -444,7 +433,7 @@ int setitimer(int which, const struct itimerval * value,
 
     if (itimer == NULL)
         {        
-        itimer = kmalloc(sizeof(interval_timer_t));
+        itimer = kmem_cache_alloc(&itimer_cache);
 
         if (itimer == NULL)
             {
@@ -459,7 +448,7 @@ int setitimer(int which, const struct itimerval * value,
         itimer->handler = itimer_expire_handler;
         itimer->arg = itimer;
         
-        timerchain_init_node(&itimer->timer_node);
+        ktimer_init(&itimer->timer, itimer_fire, itimer);
         
         if (ovalue) 
             *ovalue = *value;
@@ -482,19 +471,11 @@ int setitimer(int which, const struct itimerval * value,
      */  
     if (timeval_nz(&value->it_value))
         {
-        struct timeval now;
-        abstime_t cmp;
-
-        gettimeofday(&now, NULL);
-        timeval_add(&now, &itimer->timerval.it_value);
-        cmp = timeval_to_abstime(&now);
-
-        /* Setup expiry time */        
-        itimer->timer_node.expires = cmp;
-        
         itimer->enabled = TRUE;
-        
-        timerchain_add(&global_interval_timerchain, &itimer->timer_node);
+
+        /* Expires on CLOCK_MONOTONIC, immune to wall time changes */
+        ktimer_arm(&itimer->timer, get_monotonic_nanosecond() +
+                   timeval_to_abstime(&itimer->timerval.it_value));
         
         return OK;
         }
@@ -503,15 +484,188 @@ int setitimer(int which, const struct itimerval * value,
         /* Disable the timer */
         itimer->enabled = FALSE;
         
-        timerchain_remove(&global_interval_timerchain, &itimer->timer_node);
+        ktimer_cancel(&itimer->timer);
         
         return OK;
         }
     }
 
+/*
+ * ktimer_deadline - get the CLOCK_MONOTONIC time, in ns, a timeout on a
+ * clock ends at. The timeout is relative unless TIMER_ABSTIME is set in
+ * flags. Returns OK, or EINVAL for an unsupported clock or a timespec out
+ * of range.
+ *
+ * An absolute CLOCK_REALTIME timeout is converted with the current wall
+ * time offset, later settings of the wall time do not move it. Timeouts
+ * too far away to ever end give ABSTIME_INFINITY.
+ */
+int ktimer_deadline
+    (
+    clockid_t                   clock_id,
+    int                         flags,
+    const struct timespec *     ts,
+    abstime_t *                 deadline
+    )
+    {
+    abstime_t base = 0;
+
+    if (!ts || (ts->tv_nsec < 0) || (ts->tv_nsec >= NSECS_PER_SEC))
+        return EINVAL;
+
+    switch (clock_id)
+        {
+        case CLOCK_REALTIME:
+            if (flags & TIMER_ABSTIME)
+                base = -get_wall_offset_nanosecond();
+            else
+                base = get_monotonic_nanosecond();
+            break;
+
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_RAW:
+            if (!(flags & TIMER_ABSTIME))
+                base = get_monotonic_nanosecond();
+            break;
+
+        default:
+            return EINVAL;
+        }
+
+    if (ts->tv_sec >= (ABSTIME_INFINITY / NSECS_PER_SEC) / 2)
+        {
+        *deadline = ABSTIME_INFINITY;
+
+        return OK;
+        }
+
+    *deadline = base + timespec_to_abstime((timespec_t *)ts);
+
+    return OK;
+    }
+
+/*
+  NAME
+  
+  clock_nanosleep - high resolution sleep with specifiable clock
+  
+  SYNOPSIS
+  
+  #include <time.h>
+  
+  int clock_nanosleep(clockid_t clock_id, int flags,
+         const struct timespec *rqtp, struct timespec *rmtp);
+  
+  DESCRIPTION
+  
+  If the flag TIMER_ABSTIME is not set in the flags argument, the 
+  clock_nanosleep() function shall cause the current thread to be suspended 
+  from execution until the time interval specified by the rqtp argument has 
+  elapsed, as measured by the clock specified by clock_id.
+  
+  If the flag TIMER_ABSTIME is set in the flags argument, the 
+  clock_nanosleep() function shall cause the current thread to be suspended 
+  from execution until the time value of the clock specified by clock_id 
+  reaches the absolute time specified by the rqtp argument. If, at the time 
+  of the call, the time value specified by rqtp is less than or equal to the 
+  time value of the specified clock, then clock_nanosleep() shall return 
+  immediately and the calling process shall not be suspended.
+  
+  If rmtp is not NULL and the sleep is relative, the remaining amount of 
+  time is returned in it. Sleeps are not interrupted by signals here, so it
+  is always zero.
+  
+  RETURN VALUE
+  
+  If clock_nanosleep() returns because the requested time has elapsed, its 
+  return value shall be zero.
+  
+  ERRORS
+  
+  The clock_nanosleep() function shall fail if:
+  
+  [EINVAL]
+  
+  The rqtp argument specified a nanosecond value less than zero or greater 
+  than or equal to 1000 million; or the TIMER_ABSTIME flag was specified in 
+  flags and the rqtp argument is outside the range for the clock specified 
+  by clock_id; or the clock_id argument does not specify a known clock, or 
+  specifies the CPU-time clock of the calling thread.
+*/
+
+int clock_nanosleep(clockid_t clock_id, int flags,
+                    const struct timespec * rqtp, struct timespec * rmtp)
+    {
+    abstime_t deadline;
+    int ret;
+
+    ret = ktimer_deadline(clock_id, flags, rqtp, &deadline);
+
+    if (ret != OK)
+        return ret;
+
+    sched_thread_sleep_until(deadline);
+
+    if (rmtp && !(flags & TIMER_ABSTIME))
+        rmtp->tv_sec = rmtp->tv_nsec = 0;
+
+    return OK;
+    }
+
+/*
+  NAME
+  
+  nanosleep - high resolution sleep
+  
+  SYNOPSIS
+  
+  #include <time.h>
+  
+  int nanosleep(const struct timespec *rqtp, struct timespec *rmtp);
+  
+  DESCRIPTION
+  
+  The nanosleep() function shall cause the current thread to be suspended 
+  from execution until the time interval specified by the rqtp argument has
+  elapsed. The suspension time may be longer than requested because the 
+  argument value is rounded up to an integer multiple of the sleep resolution
+  or because of the scheduling of other activity by the system.
+  
+  RETURN VALUE
+  
+  If the nanosleep() function returns because the requested time has 
+  elapsed, its return value shall be zero. Otherwise, it shall return a 
+  value of -1 and set errno to indicate the error.
+  
+  ERRORS
+  
+  The nanosleep() function shall fail if:
+  
+  [EINVAL]
+  
+  The rqtp argument specified a nanosecond value less than zero or greater 
+  than or equal to 1000 million.
+*/
+
+int nanosleep(const struct timespec * rqtp, struct timespec * rmtp)
+    {
+    int ret;
+
+    ret = clock_nanosleep(CLOCK_MONOTONIC, 0, rqtp, rmtp);
+
+    if (ret != OK)
+        {
+        kurrent->err = ret;
+
+        return ERROR;
+        }
+
+    return OK;
+    }
+
 void timerchain_subsystem_init(void)
     {
-    timerchain_init_head(&global_interval_timerchain);
+    timer_wheel_init();
     }
 
 int timerchain_compare(struct timerchain_node *t1, 
@@ -586,11 +740,6 @@ int do_timerchain (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
     struct timerchain_head timerchain;
     struct timerchain_node * eariliest;
     
-    printk("Showing global_interval_timerchain %d timers\n", 
-        global_interval_timerchain.rbtree.size);
-
-    timerchain_show_all(&global_interval_timerchain);
-    
     timerchain_init_head(&timerchain);
     
     timer[0].expires = 1;
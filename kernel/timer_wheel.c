@@ -0,0 +1,503 @@
+/* timer_wheel.c - per-CPU hierarchical timer wheels */
+
+#include <sys.h>
+#include <arch.h>
+#include <os.h>
+#include <os/timer.h>
+
+static timer_wheel_t timer_wheels[CONFIG_NR_CPUS];
+
+/* First granule at or after a time, so that timers never fire early */
+static inline uint64_t timer_wheel_granule
+    (
+    abstime_t   ns
+    )
+    {
+    if (ns <= 0)
+        return 0;
+
+    return ((uint64_t)ns + TIMER_WHEEL_GRANULE_NS - 1) / TIMER_WHEEL_GRANULE_NS;
+    }
+
+/* Slot index of a granule at a level */
+static inline int timer_wheel_index
+    (
+    uint64_t    granule,
+    int         level
+    )
+    {
+    return (int)((granule >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+    }
+
+/*
+ * Put a timer in the slot of its expiry at the finest level which spans
+ * it, called with the wheel lock held
+ */
+static void timer_wheel_enqueue
+    (
+    timer_wheel_t * wheel,
+    ktimer_t *      timer
+    )
+    {
+    uint64_t granule = timer_wheel_granule(timer->expires);
+    uint64_t delta;
+    int level;
+
+    /* Already expired, run it on the next granule */
+    if (granule < wheel->clk)
+        granule = wheel->clk;
+
+    delta = granule - wheel->clk;
+
+    if (delta >= TIMER_WHEEL_SPAN)
+        {
+        granule = wheel->clk + TIMER_WHEEL_SPAN - 1;
+        delta = TIMER_WHEEL_SPAN - 1;
+        }
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+        {
+        if (delta < (1ULL << ((level + 1) * TIMER_WHEEL_BITS)))
+            break;
+        }
+
+    list_append(&wheel->slots[level][timer_wheel_index(granule, level)],
+                &timer->node);
+
+    timer->wheel = wheel;
+    }
+
+/*
+ * Move the timers of the current slot of a level down to the finer
+ * levels, returns the slot index. Called with the wheel lock held.
+ */
+static int timer_wheel_cascade
+    (
+    timer_wheel_t * wheel,
+    int             level
+    )
+    {
+    int idx = timer_wheel_index(wheel->clk, level);
+    list_t * slot = &wheel->slots[level][idx];
+    ktimer_t * timer;
+
+    while (!LIST_EMPTY(slot))
+        {
+        timer = LIST_ENTRY(slot->next, ktimer_t, node);
+
+        list_remove(&timer->node);
+
+        timer_wheel_enqueue(wheel, timer);
+        }
+
+    return idx;
+    }
+
+/*
+ * Refill the finer levels when the current granule wraps them, called
+ * with the wheel lock held. Cascading the same granule twice is harmless,
+ * its coarser slots are empty the second time.
+ */
+static void timer_wheel_refill
+    (
+    timer_wheel_t * wheel
+    )
+    {
+    int level;
+
+    if (timer_wheel_index(wheel->clk, 0) != 0)
+        return;
+
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+        if (timer_wheel_cascade(wheel, level) != 0)
+            break;
+        }
+    }
+
+/* Lock the wheel a timer is armed on, NULL if it is not armed */
+static timer_wheel_t * ktimer_lock_wheel
+    (
+    ktimer_t *  timer
+    )
+    {
+    timer_wheel_t * wheel;
+
+    for (;;)
+        {
+        wheel = timer->wheel;
+
+        if (wheel == NULL)
+            return NULL;
+
+        spinlock_lock(&wheel->lock);
+
+        /* It may have fired or moved meanwhile */
+        if (timer->wheel == wheel)
+            return wheel;
+
+        spinlock_unlock(&wheel->lock);
+        }
+    }
+
+void timer_wheel_init (void)
+    {
+    timer_wheel_t * wheel;
+    uint64_t clk;
+    int i, level, idx;
+
+    clk = timer_wheel_granule(get_monotonic_nanosecond());
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        wheel = &timer_wheels[i];
+
+        spinlock_init(&wheel->lock);
+
+        wheel->clk = clk;
+        wheel->nr_pending = 0;
+        wheel->nr_fired = 0;
+        wheel->running = NULL;
+
+        for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+            for (idx = 0; idx < TIMER_WHEEL_SLOTS; idx++)
+                list_init(&wheel->slots[level][idx]);
+        }
+    }
+
+void ktimer_init
+    (
+    ktimer_t *      timer,
+    ktimer_func_t   func,
+    void *          arg
+    )
+    {
+    list_init(&timer->node);
+
+    timer->wheel = NULL;
+    timer->expires = 0;
+    timer->func = func;
+    timer->arg = arg;
+    }
+
+/*
+ * ktimer_arm - arm a timer on the wheel of the current CPU to fire at
+ * 'expires' CLOCK_MONOTONIC nanoseconds, re-arming it if it is pending
+ *
+ * Arming or cancelling the same timer from several CPUs at once must be
+ * serialized by the caller.
+ */
+void ktimer_arm
+    (
+    ktimer_t *      timer,
+    abstime_t       expires
+    )
+    {
+    timer_wheel_t * wheel;
+    ipl_t ipl;
+
+    ipl = interrupts_disable();
+
+    /* Take it off its old wheel, which may belong to another CPU */
+    if ((wheel = ktimer_lock_wheel(timer)) != NULL)
+        {
+        list_remove(&timer->node);
+
+        timer->wheel = NULL;
+        wheel->nr_pending--;
+
+        spinlock_unlock(&wheel->lock);
+        }
+
+    wheel = &timer_wheels[this_cpu()];
+
+    spinlock_lock(&wheel->lock);
+
+    timer->expires = expires;
+
+    timer_wheel_enqueue(wheel, timer);
+
+    wheel->nr_pending++;
+
+    spinlock_unlock(&wheel->lock);
+
+    tick_percpu_timer_armed(expires);
+
+    interrupts_restore(ipl);
+    }
+
+/*
+ * ktimer_cancel - disarm a timer, returns TRUE if it was pending
+ *
+ * The function of a timer which has already been taken off its wheel to
+ * run may still be running on its CPU, see ktimer_cancel_sync().
+ */
+BOOL ktimer_cancel
+    (
+    ktimer_t *      timer
+    )
+    {
+    timer_wheel_t * wheel;
+    ipl_t ipl;
+
+    ipl = interrupts_disable();
+
+    if ((wheel = ktimer_lock_wheel(timer)) == NULL)
+        {
+        interrupts_restore(ipl);
+
+        return FALSE;
+        }
+
+    list_remove(&timer->node);
+
+    timer->wheel = NULL;
+    wheel->nr_pending--;
+
+    spinlock_unlock(&wheel->lock);
+
+    interrupts_restore(ipl);
+
+    return TRUE;
+    }
+
+/*
+ * ktimer_cancel_sync - disarm a timer and wait for its function to return
+ * if it is running on another CPU, returns TRUE if it was pending
+ *
+ * Once it returns, the timer function no longer uses its argument, which
+ * may be freed or reused, unless the function re-armed its timer. It
+ * shall not be called from the timer function, nor with a lock held that
+ * the timer function takes.
+ */
+BOOL ktimer_cancel_sync
+    (
+    ktimer_t *      timer
+    )
+    {
+    BOOL pending;
+    int i;
+
+    pending = ktimer_cancel(timer);
+
+    read_barrier();
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        while (timer_wheels[i].running == timer)
+            cpu_relax();
+        }
+
+    return pending;
+    }
+
+/*
+ * Run a list of timers taken off the wheel, called with the wheel lock
+ * held. The lock is dropped around each timer function.
+ */
+static void timer_wheel_expire
+    (
+    timer_wheel_t * wheel,
+    list_t *        expired
+    )
+    {
+    ktimer_func_t func;
+    ktimer_t * timer;
+    void * arg;
+
+    while (!LIST_EMPTY(expired))
+        {
+        timer = LIST_ENTRY(expired->next, ktimer_t, node);
+
+        list_remove(&timer->node);
+
+        /* Seen running by ktimer_cancel_sync() once it is off the wheel */
+        wheel->running = timer;
+        write_barrier();
+
+        timer->wheel = NULL;
+        wheel->nr_pending--;
+        wheel->nr_fired++;
+
+        func = timer->func;
+        arg = timer->arg;
+
+        spinlock_unlock(&wheel->lock);
+
+        func(arg);
+
+        spinlock_lock(&wheel->lock);
+
+        wheel->running = NULL;
+        }
+    }
+
+/*
+ * timer_wheel_run - run the expired timers of the current CPU, called
+ * from its tick and its clock eventer
+ *
+ * The wheel turns one granule at a time up to now, cascading the coarser
+ * levels whenever the finer one wraps. The timers of the granule in 
+ * progress which are already due run as well, so that timers fire on
+ * time when the clock eventer is armed for them. The timer functions run
+ * without the wheel lock held, so they may re-arm their timer.
+ */
+void timer_wheel_run (void)
+    {
+    timer_wheel_t * wheel = &timer_wheels[this_cpu()];
+    abstime_t now_ns = get_monotonic_nanosecond();
+    uint64_t now = now_ns / TIMER_WHEEL_GRANULE_NS;
+    ktimer_t * timer;
+    list_t expired;
+    list_t * slot;
+    ipl_t ipl;
+
+    ipl = interrupts_disable();
+
+    spinlock_lock(&wheel->lock);
+
+    while (wheel->clk <= now)
+        {
+        /* Nothing to run, catch up at once, e.g. after a tickless idle */
+        if (!wheel->nr_pending)
+            {
+            wheel->clk = now + 1;
+            break;
+            }
+
+        timer_wheel_refill(wheel);
+
+        slot = &wheel->slots[0][timer_wheel_index(wheel->clk, 0)];
+
+        wheel->clk++;
+
+        if (LIST_EMPTY(slot))
+            continue;
+
+        /* Detach the whole slot, re-armed timers may land back in it */
+        list_init(&expired);
+        list_add_after(slot, &expired);
+        list_remove(slot);
+
+        timer_wheel_expire(wheel, &expired);
+        }
+
+    if (wheel->nr_pending)
+        {
+        timer_wheel_refill(wheel);
+
+        slot = &wheel->slots[0][timer_wheel_index(wheel->clk, 0)];
+
+        list_init(&expired);
+
+        LIST_FOREACH_SAFE(slot, iter)
+            {
+            timer = LIST_ENTRY(iter, ktimer_t, node);
+
+            if (timer->expires <= now_ns)
+                {
+                list_remove(&timer->node);
+                list_append(&expired, &timer->node);
+                }
+            }
+
+        timer_wheel_expire(wheel, &expired);
+        }
+
+    spinlock_unlock(&wheel->lock);
+
+    interrupts_restore(ipl);
+    }
+
+/* Get the earliest expiry of a slot, or 'next' if it is earlier */
+static abstime_t timer_wheel_slot_expiry
+    (
+    list_t *    slot,
+    abstime_t   next
+    )
+    {
+    ktimer_t * timer;
+
+    LIST_FOREACH(slot, iter)
+        {
+        timer = LIST_ENTRY(iter, ktimer_t, node);
+
+        if (timer->expires < next)
+            next = timer->expires;
+        }
+
+    return next;
+    }
+
+/*
+ * timer_wheel_next_expiry - get the earliest expiry time of the timers
+ * of the current CPU, or ABSTIME_INFINITY if there is none
+ *
+ * The slots following the current one of a level hold later timers slot
+ * after slot, so only the first non-empty one needs to be looked at. On
+ * the coarser levels, the current slot may hold timers a whole rotation
+ * of the level ahead rather than the earliest ones, so it is looked at
+ * on its own.
+ */
+abstime_t timer_wheel_next_expiry (void)
+    {
+    timer_wheel_t * wheel = &timer_wheels[this_cpu()];
+    abstime_t next = ABSTIME_INFINITY;
+    list_t * slot;
+    int level, i, idx;
+    ipl_t ipl;
+
+    ipl = interrupts_disable();
+
+    spinlock_lock(&wheel->lock);
+
+    for (level = 0; (level < TIMER_WHEEL_LEVELS) && wheel->nr_pending; level++)
+        {
+        idx = timer_wheel_index(wheel->clk, level);
+
+        if (level != 0)
+            next = timer_wheel_slot_expiry(&wheel->slots[level][idx], next);
+
+        for (i = (level != 0); i < TIMER_WHEEL_SLOTS; i++)
+            {
+            slot = &wheel->slots[level][(idx + i) & TIMER_WHEEL_MASK];
+
+            if (LIST_EMPTY(slot))
+                continue;
+
+            next = timer_wheel_slot_expiry(slot, next);
+
+            break;
+            }
+        }
+
+    spinlock_unlock(&wheel->lock);
+
+    interrupts_restore(ipl);
+
+    return next;
+    }
+
+int do_timerwheel (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    timer_wheel_t * wheel;
+    int i;
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        wheel = &timer_wheels[i];
+
+        printk("cpu%d - granule %lld, %lld timers pending, %lld fired\n",
+            i, (long long)wheel->clk, (long long)wheel->nr_pending,
+            (long long)wheel->nr_fired);
+        }
+
+    return 0;
+    }
+
+CELL_OS_CMD(
+    timerwheel,   1,        1,    do_timerwheel,
+    "show the timer wheels",
+    "show the current granule and the number of pending and fired timers\n"
+    "of the timer wheel of each CPU\n"
+    );
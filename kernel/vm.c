@@ -4,11 +4,29 @@
 #include <arch.h>
 #include <os.h>
 
+/* Translate a page of the current task, or of the kernel */
+static bool vm_page2phys
+    (
+    cpu_addr_t      page,
+    cpu_addr_t *    physp
+    )
+    {
+    pmap_t * asp = kurrent ? kurrent->asp : NULL;
+
+    if (asp && (page >= asp->start) && (page <= asp->end))
+        return pmap_find(asp, page, physp);
+
+    return pmap_kernel_find(page, physp);
+    }
+
 /* 
  * vm_virt2phys - translate virtual address of current task to physical address
  *
  * Translate virtual address of current task to physical address.
  * Returns physical address on success, or NULL if no mapped memory.
+ *
+ * All of [vaddr, vaddr + size) must be mapped to contiguous physical
+ * memory. The page tables are walked without lock.
  */
 
 cpu_addr_t vm_virt2phys
@@ -17,5 +35,20 @@ cpu_addr_t vm_virt2phys
     size_t size
     )
     {
+    cpu_addr_t page, end, first, phys;
+
+    page = vaddr & ~((cpu_addr_t)PAGE_SIZE - 1);
+    end = vaddr + (size ? size : 1);
+
+    if (!vm_page2phys(page, &first))
+        return 0;
+
+    for (page += PAGE_SIZE; page < end; page += PAGE_SIZE)
+        {
+        if (!vm_page2phys(page, &phys) || 
+            (phys != first + (page - (vaddr & ~((cpu_addr_t)PAGE_SIZE - 1)))))
+            return 0;
+        }
 
+    return first + (vaddr & (PAGE_SIZE - 1));
     }
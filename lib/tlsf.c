@@ -69,7 +69,7 @@
 #endif
 
 #ifndef TLSF_STATISTIC
-#define     TLSF_STATISTIC      (0)
+#define     TLSF_STATISTIC      (1)
 #endif
 
 #ifndef USE_MMAP
@@ -92,11 +92,13 @@
 #define TLSF_DESTROY_LOCK(l)    do {} while(0)
 #define TLSF_ACQUIRE_LOCK(l)    spinlock_lock(l)
 #define TLSF_RELEASE_LOCK(l)    spinlock_unlock(l)
+#define TLSF_TRY_LOCK(l)        spinlock_trylock(l)
 #else
 #define TLSF_CREATE_LOCK(_unused_)   do{}while(0)
 #define TLSF_DESTROY_LOCK(_unused_)  do{}while(0)
 #define TLSF_ACQUIRE_LOCK(_unused_)  do{}while(0)
 #define TLSF_RELEASE_LOCK(_unused_)  do{}while(0)
+#define TLSF_TRY_LOCK(_unused_)      (0)
 #endif
 
 #if TLSF_STATISTIC
@@ -531,14 +533,20 @@ size_t init_memory_pool(size_t mem_pool_size, void *mem_pool)
     }
 
 /******************************************************************/
-size_t add_new_area(void *area, size_t area_size, void *mem_pool)
+/*
+ * Add an area to a pool. An area that is merged with the physically
+ * contiguous ones can hold blocks spanning both, so unmerged areas are
+ * needed for remove_free_area() to give them back.
+ */
+static size_t add_area(void *area, size_t area_size, void *mem_pool,
+                       int merge)
     {
     tlsf_t *tlsf = (tlsf_t *) mem_pool;
     area_info_t *ptr, *ptr_prev, *ai;
     bhdr_t *ib0, *b0, *lb0, *ib1, *b1, *lb1, *next_b;
 
     memset(area, 0, area_size);
-    ptr = tlsf->area_head;
+    ptr = merge ? tlsf->area_head : NULL;
     ptr_prev = 0;
 
     ib0 = process_area(area, area_size);
@@ -619,11 +627,64 @@ size_t add_new_area(void *area, size_t area_size, void *mem_pool)
     ai->next = tlsf->area_head;
     ai->end = lb0;
     tlsf->area_head = ai;
+
+#if TLSF_STATISTIC
+    /* The block was never accounted as used, free_ex() discounts it */
+    tlsf->used_size += (b0->size & BLOCK_SIZE) + BHDR_OVERHEAD;
+#endif
+
     free_ex(b0->ptr.buffer, mem_pool);
 
     return (b0->size & BLOCK_SIZE);
     }
 
+/******************************************************************/
+size_t add_new_area(void *area, size_t area_size, void *mem_pool)
+    {
+    return add_area(area, area_size, mem_pool, 1);
+    }
+
+/******************************************************************/
+size_t add_new_area_unmerged(void *area, size_t area_size, void *mem_pool)
+    {
+    return add_area(area, area_size, mem_pool, 0);
+    }
+
+/******************************************************************/
+/*
+ * Take an unmerged area out of a pool if it is entirely free. Returns 0
+ * if it was removed, -1 if some of it is in use.
+ */
+int remove_free_area(void *area, void *mem_pool)
+    {
+    tlsf_t *tlsf = (tlsf_t *) mem_pool;
+    area_info_t **pp, *ai;
+    bhdr_t *ib, *b;
+    int fl, sl;
+
+    ib = (bhdr_t *) area;
+    ai = (area_info_t *) ib->ptr.buffer;
+    b = GET_NEXT_BLOCK(ib->ptr.buffer, ib->size & BLOCK_SIZE);
+
+    if (!(b->size & FREE_BLOCK) ||
+        (GET_NEXT_BLOCK(b->ptr.buffer, b->size & BLOCK_SIZE) != ai->end))
+        return -1;
+
+    MAPPING_INSERT(b->size & BLOCK_SIZE, &fl, &sl);
+    EXTRACT_BLOCK(b, tlsf, fl, sl);
+
+    for (pp = &tlsf->area_head; *pp; pp = &(*pp)->next)
+        {
+        if (*pp == ai)
+            {
+            *pp = ai->next;
+            break;
+            }
+        }
+
+    return 0;
+    }
+
 
 /******************************************************************/
 size_t get_used_size(void *mem_pool)
@@ -656,33 +717,393 @@ void destroy_memory_pool(void *mem_pool)
     }
 
 /******************************************************************/
-void *kmalloc(size_t size)
+/*
+ * Per-CPU kmalloc arenas
+ *
+ * Each CPU allocates from its own TLSF pool, carved from the page
+ * allocator on its first allocation, so CPUs do not serialize on one
+ * heap lock. The pool lock is kept, as a thread may migrate between
+ * picking its arena and locking it, but it is rarely contended.
+ *
+ * A block freed on another CPU than the one owning its pool is pushed
+ * lock-free on the remote free list of the owner, a multiple producer
+ * single consumer stack linked through the freed blocks. The owner
+ * takes the whole list on its next allocation and frees the blocks to
+ * its pool. The owner of a block is found from the table of the areas
+ * given to the arenas.
+ *
+ * An arena that runs out of memory grows by an unmerged area from the
+ * page allocator, sized by the CONFIG_KHEAP_GROW_* policy. Grown areas
+ * that are entirely free are given back by kmalloc_shrink() when the
+ * page allocator runs out of memory.
+ */
+
+#define KMALLOC_AREAS_MAX       (CONFIG_NR_CPUS * 16)
+
+/* Room for the headers of an area around its single free block */
+#define KMALLOC_AREA_OVERHEAD   (ROUNDUP_SIZE(sizeof(area_info_t)) + \
+                                 BHDR_OVERHEAD * 8)
+
+typedef struct kmalloc_arena
+    {
+    /* TLSF pool of the arena, NULL until it is created */
+    void *              pool;
+
+    /* Bytes of all the areas of the arena */
+    size_t              pool_size;
+
+    /* Blocks freed by other CPUs, pushed lock-free */
+    void * volatile     remote_free;
+
+    atomic64_t          remote_frees;
+
+    int                 nr_grown;
+    } __attribute__((aligned(X64_CACHE_LINE_SIZE))) kmalloc_arena_t;
+
+/*
+ * The area table is looked up without lock. A slot is published by
+ * setting its arena last, and retired by clearing its arena first.
+ */
+
+typedef struct kmalloc_area
+    {
+    cpu_addr_t                  start;
+    cpu_addr_t                  end;
+    kmalloc_arena_t * volatile  arena;
+    int                         grown;
+    } kmalloc_area_t;
+
+static kmalloc_arena_t  kmalloc_arenas[CONFIG_NR_CPUS];
+
+static kmalloc_area_t   kmalloc_areas[KMALLOC_AREAS_MAX];
+static volatile int     kmalloc_nr_areas = 0;
+static SPINLOCK_DECLARE(kmalloc_area_lock);
+
+/* Record an area of an arena, called with kmalloc_area_lock held */
+static int kmalloc_area_add(kmalloc_arena_t *arena, void *area, size_t size,
+                            int grown)
+    {
+    kmalloc_area_t *a = NULL;
+    int i;
+
+    /* Reuse a retired slot first */
+
+    for (i = 0; i < kmalloc_nr_areas; i++)
+        {
+        if (!kmalloc_areas[i].arena)
+            {
+            a = &kmalloc_areas[i];
+            break;
+            }
+        }
+
+    if (!a)
+        {
+        if (kmalloc_nr_areas >= KMALLOC_AREAS_MAX)
+            return -1;
+
+        a = &kmalloc_areas[kmalloc_nr_areas];
+        }
+
+    a->start = (cpu_addr_t)area;
+    a->end = (cpu_addr_t)area + size;
+    a->grown = grown;
+
+    /* Publish the entry before it can be looked up */
+    write_barrier();
+
+    a->arena = arena;
+
+    if (a == &kmalloc_areas[kmalloc_nr_areas])
+        kmalloc_nr_areas++;
+
+    return 0;
+    }
+
+/* Find the arena owning a block */
+static kmalloc_arena_t *kmalloc_arena_of(void *ptr)
+    {
+    kmalloc_arena_t *arena;
+    int i;
+
+    for (i = 0; i < kmalloc_nr_areas; i++)
+        {
+        arena = kmalloc_areas[i].arena;
+
+        if (arena &&
+            ((cpu_addr_t)ptr >= kmalloc_areas[i].start) &&
+            ((cpu_addr_t)ptr < kmalloc_areas[i].end))
+            return arena;
+        }
+
+    return NULL;
+    }
+
+/* Create the pool of an arena from the page allocator */
+static void *kmalloc_arena_create(kmalloc_arena_t *arena, size_t size)
+    {
+    void *area;
+
+    spinlock_lock(&kmalloc_area_lock);
+
+    if (arena->pool)
+        {
+        spinlock_unlock(&kmalloc_area_lock);
+
+        return arena->pool;
+        }
+
+    area = page_alloc_contig(size / PAGE_SIZE);
+
+    if (!area)
+        {
+        spinlock_unlock(&kmalloc_area_lock);
+
+        ERROR_MSG("kmalloc: no memory for a %p bytes arena\n", size);
+
+        return NULL;
+        }
+
+    if (kmalloc_area_add(arena, area, size, 0) != 0)
+        {
+        spinlock_unlock(&kmalloc_area_lock);
+
+        page_free(area);
+
+        return NULL;
+        }
+
+    /* Initialize a pool even if it has the signature of a stale one */
+
+    ((tlsf_t *)area)->tlsf_signature = 0;
+
+    init_memory_pool(size, area);
+
+    arena->pool_size = size;
+    arena->remote_free = NULL;
+    arena->nr_grown = 0;
+    atomic64_set(&arena->remote_frees, 0);
+
+    write_barrier();
+
+    arena->pool = area;
+
+    spinlock_unlock(&kmalloc_area_lock);
+
+    return area;
+    }
+
+/*
+ * Grow an arena so that it can hold a block of the size. The area is
+ * allocated without any heap lock held, as the page allocator may call
+ * kmalloc_shrink().
+ */
+static int kmalloc_arena_grow(kmalloc_arena_t *arena, size_t size)
+    {
+    tlsf_t *tlsf = (tlsf_t *)arena->pool;
+    size_t grow, need;
+    void *area;
+
+    need = PAGE_ALIGN(ROUNDUP_SIZE(size) + KMALLOC_AREA_OVERHEAD);
+
+    grow = (arena->pool_size * CONFIG_KHEAP_GROW_PERCENT) / 100;
+
+    if (grow < CONFIG_KHEAP_GROW_MIN)
+        grow = CONFIG_KHEAP_GROW_MIN;
+
+    if (grow > CONFIG_KHEAP_GROW_MAX)
+        grow = CONFIG_KHEAP_GROW_MAX;
+
+    if (grow < need)
+        grow = need;
+
+    grow = PAGE_ALIGN(grow);
+
+    if ((grow > CONFIG_KHEAP_GROW_MAX) ||
+        (arena->pool_size + grow > CONFIG_KHEAP_ARENA_MAX))
+        return -1;
+
+    area = page_alloc_contig(grow / PAGE_SIZE);
+
+    if (!area)
+        return -1;
+
+    spinlock_lock(&kmalloc_area_lock);
+
+    if (kmalloc_area_add(arena, area, grow, 1) != 0)
+        {
+        spinlock_unlock(&kmalloc_area_lock);
+
+        page_free(area);
+
+        return -1;
+        }
+
+    spinlock_unlock(&kmalloc_area_lock);
+
+    TLSF_ACQUIRE_LOCK(&tlsf->lock);
+
+    add_new_area_unmerged(area, grow, tlsf);
+
+    arena->pool_size += grow;
+    arena->nr_grown++;
+
+    TLSF_RELEASE_LOCK(&tlsf->lock);
+
+    return 0;
+    }
+
+/* Free the blocks other CPUs freed to the arena, called with its lock held */
+static void kmalloc_arena_drain(kmalloc_arena_t *arena)
     {
+    void *ptr, *next;
+
+    if (!arena->remote_free)
+        return;
+
+    ptr = xchg(&arena->remote_free, NULL);
+
+    while (ptr)
+        {
+        next = *(void **)ptr;
+
+        free_ex(ptr, arena->pool);
+
+        ptr = next;
+        }
+    }
+
+static void kmalloc_remote_free(kmalloc_arena_t *arena, void *ptr)
+    {
+    void *head;
+
+    do
+        {
+        head = arena->remote_free;
+
+        *(void **)ptr = head;
+        } while (cmpxchg(&arena->remote_free, head, ptr) != head);
+
+    atomic64_inc(&arena->remote_frees);
+    }
+
+static void *kmalloc_arena_alloc(kmalloc_arena_t *arena, size_t size)
+    {
+    tlsf_t *tlsf = (tlsf_t *)arena->pool;
     void *ret;
 
-#if USE_MMAP || USE_SBRK
-    if (!mp)
+    TLSF_ACQUIRE_LOCK(&tlsf->lock);
+
+    kmalloc_arena_drain(arena);
+
+    ret = malloc_ex(size, tlsf);
+
+    TLSF_RELEASE_LOCK(&tlsf->lock);
+
+    return ret;
+    }
+
+/* Size of the payload of an allocated block */
+static size_t kmalloc_block_size(void *ptr)
+    {
+    bhdr_t *b = (bhdr_t *) ((char *) ptr - BHDR_OVERHEAD);
+
+    return b->size & BLOCK_SIZE;
+    }
+
+/*
+ * kmalloc_shrink - give the entirely free grown areas of the arenas back
+ * to the page allocator, returns the number of bytes given back
+ *
+ * Busy arenas are skipped rather than waited for, so that this can be
+ * called from the page allocator whatever locks the caller holds.
+ */
+size_t kmalloc_shrink(void)
+    {
+    kmalloc_arena_t *arena;
+    kmalloc_area_t *a;
+    size_t freed = 0;
+    tlsf_t *tlsf;
+    int i;
+
+    if (spinlock_trylock(&kmalloc_area_lock) != 0)
+        return 0;
+
+    for (i = 0; i < kmalloc_nr_areas; i++)
         {
-        size_t area_size;
-        void *area;
+        a = &kmalloc_areas[i];
+        arena = a->arena;
 
-        area_size = sizeof(tlsf_t) + BHDR_OVERHEAD * 8; /* Just a safety constant */
-        area_size = (area_size > DEFAULT_AREA_SIZE) ?
-                    area_size : DEFAULT_AREA_SIZE;
+        if (!arena || !a->grown)
+            continue;
 
-        area = get_new_area(&area_size);
-        if (area == ((void *) ~0))
-            return NULL;        /* Not enough system memory */
+        tlsf = (tlsf_t *)arena->pool;
+
+        if (TLSF_TRY_LOCK(&tlsf->lock) != 0)
+            continue;
+
+        kmalloc_arena_drain(arena);
 
-        init_memory_pool(area_size, area);
+        if (remove_free_area((void *)a->start, tlsf) != 0)
+            {
+            TLSF_RELEASE_LOCK(&tlsf->lock);
+
+            continue;
+            }
+
+        arena->pool_size -= a->end - a->start;
+        arena->nr_grown--;
+
+        TLSF_RELEASE_LOCK(&tlsf->lock);
+
+        /* Retire the slot before its memory can be reused */
+
+        a->arena = NULL;
+
+        write_barrier();
+
+        freed += a->end - a->start;
+
+        page_free((void *)a->start);
         }
-#endif
 
-    TLSF_ACQUIRE_LOCK(&((tlsf_t *)mp)->lock);
+    spinlock_unlock(&kmalloc_area_lock);
 
-    ret = malloc_ex(size, mp);
+    return freed;
+    }
+
+/* kmalloc_init - create the arena of the boot CPU */
+void kmalloc_init(void)
+    {
+    if (!kmalloc_arena_create(&kmalloc_arenas[this_cpu()], CONFIG_KHEAP_SIZE))
+        panic("kmalloc_init: no memory for the kernel heap\n");
+    }
+
+/******************************************************************/
+void *kmalloc(size_t size)
+    {
+    kmalloc_arena_t *arena = &kmalloc_arenas[this_cpu()];
+    void *ret = NULL;
+    int i;
+
+    if (arena->pool ||
+        kmalloc_arena_create(arena, CONFIG_KHEAP_ARENA_SIZE))
+        {
+        ret = kmalloc_arena_alloc(arena, size);
+
+        if (!ret && (kmalloc_arena_grow(arena, size) == 0))
+            ret = kmalloc_arena_alloc(arena, size);
+        }
 
-    TLSF_RELEASE_LOCK(&((tlsf_t *)mp)->lock);
+    /* Fall back to the arenas of the other CPUs */
+
+    for (i = 0; !ret && (i < CONFIG_NR_CPUS); i++)
+        {
+        if ((&kmalloc_arenas[i] == arena) || !kmalloc_arenas[i].pool)
+            continue;
+
+        ret = kmalloc_arena_alloc(&kmalloc_arenas[i], size);
+        }
 
     return ret;
     }
@@ -690,30 +1111,83 @@ void *kmalloc(size_t size)
 /******************************************************************/
 void kfree(void *ptr)
     {
-    TLSF_ACQUIRE_LOCK(&((tlsf_t *)mp)->lock);
+    kmalloc_arena_t *arena;
+    tlsf_t *tlsf;
 
-    free_ex(ptr, mp);
+    if (!ptr)
+        return;
+
+    arena = kmalloc_arena_of(ptr);
+
+    if (!arena)
+        {
+        ERROR_MSG("kfree: %p is not a kmalloc block\n", ptr);
 
-    TLSF_RELEASE_LOCK(&((tlsf_t *)mp)->lock);
+        return;
+        }
+
+    if (arena != &kmalloc_arenas[this_cpu()])
+        {
+        kmalloc_remote_free(arena, ptr);
+
+        return;
+        }
+
+    tlsf = (tlsf_t *)arena->pool;
+
+    TLSF_ACQUIRE_LOCK(&tlsf->lock);
+
+    free_ex(ptr, tlsf);
+
+    TLSF_RELEASE_LOCK(&tlsf->lock);
     }
 
 /******************************************************************/
 void *krealloc(void *ptr, size_t size)
     {
-    void *ret;
+    kmalloc_arena_t *arena;
+    tlsf_t *tlsf;
+    void *ret = NULL;
+    size_t old_size;
 
-#if USE_MMAP || USE_SBRK
-    if (!mp)
-        {
+    if (!ptr)
         return kmalloc(size);
+
+    if (!size)
+        {
+        kfree(ptr);
+
+        return NULL;
         }
-#endif
 
-    TLSF_ACQUIRE_LOCK(&((tlsf_t *)mp)->lock);
+    arena = kmalloc_arena_of(ptr);
+
+    /* Resize in place when the block belongs to this CPU */
+
+    if (arena == &kmalloc_arenas[this_cpu()])
+        {
+        tlsf = (tlsf_t *)arena->pool;
+
+        TLSF_ACQUIRE_LOCK(&tlsf->lock);
+
+        ret = realloc_ex(ptr, size, tlsf);
+
+        TLSF_RELEASE_LOCK(&tlsf->lock);
+
+        if (ret)
+            return ret;
+        }
+
+    ret = kmalloc(size);
+
+    if (!ret)
+        return NULL;
 
-    ret = realloc_ex(ptr, size, mp);
+    old_size = kmalloc_block_size(ptr);
 
-    TLSF_RELEASE_LOCK(&((tlsf_t *)mp)->lock);
+    memcpy(ret, ptr, (old_size < size) ? old_size : size);
+
+    kfree(ptr);
 
     return ret;
     }
@@ -723,15 +1197,48 @@ void *kcalloc(size_t nelem, size_t elem_size)
     {
     void *ret;
 
-    TLSF_ACQUIRE_LOCK(&((tlsf_t *)mp)->lock);
+    if (!nelem || !elem_size)
+        return NULL;
 
-    ret = calloc_ex(nelem, elem_size, mp);
+    ret = kmalloc(nelem * elem_size);
 
-    TLSF_RELEASE_LOCK(&((tlsf_t *)mp)->lock);
+    if (ret)
+        memset(ret, 0, nelem * elem_size);
 
     return ret;
     }
 
+int do_kheap (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    kmalloc_arena_t *arena;
+    int i;
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        arena = &kmalloc_arenas[i];
+
+        if (!arena->pool)
+            continue;
+
+        printk("cpu%d - size %lld (%d grown areas), used %lld, max %lld, "
+            "remote frees %lld\n",
+            i, (long long)arena->pool_size, arena->nr_grown,
+            (long long)get_used_size(arena->pool),
+            (long long)get_max_size(arena->pool),
+            (long long)atomic64_read(&arena->remote_frees));
+        }
+
+    return 0;
+    }
+
+CELL_OS_CMD(
+    kheap,   1,        1,    do_kheap,
+    "show kernel heap arenas",
+    "show the size, the number of grown areas, the bytes in use, the\n"
+    "peak bytes in use and the number of frees from other cpus of the\n"
+    "heap arena of each cpu\n"
+    );
+
 /******************************************************************/
 void *malloc_ex(size_t size, void *mem_pool)
     {
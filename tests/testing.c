@@ -1,6 +1,7 @@
 #include <sys.h>
 #include <arch.h>
 #include <os.h>
+#include <semaphore.h>
 
 #undef LIST_TEST 
 #undef PAGE_FAULT_TEST
@@ -780,3 +781,632 @@ void unit_testing(void)
 #endif
 
     }
+
+/*
+ * Kernel tests run from the shell with the ktest command. Each test
+ * prints OK or NG for each of its checks and returns the number of NG.
+ */
+
+#define KTEST_CHECK(cond, what)                         \
+    do                                                  \
+        {                                               \
+        printk("ktest: %s %s\n", what, (cond) ? "OK" : "NG"); \
+        if (!(cond))                                    \
+            failed++;                                   \
+        } while (0)
+
+#define KTEST_SLAB_OBJS     500
+#define KTEST_SLAB_SIZE     200
+#define KTEST_SLAB_MAGIC    0x5AB5AB5AB5AB5AB5ULL
+
+static void * ktest_slab_objs[KTEST_SLAB_OBJS];
+
+static void ktest_slab_ctor(void * obj)
+    {
+    *(uint64_t *)obj = KTEST_SLAB_MAGIC;
+    }
+
+/* Slab caches: alignment, constructed and distinct objects, accounting */
+static int ktest_slab(void)
+    {
+    kmem_cache_t * cache;
+    BOOL aligned = TRUE, constructed = TRUE, distinct = TRUE;
+    uint64_t * obj;
+    int i, failed = 0;
+
+    cache = kmem_cache_create("ktest", KTEST_SLAB_SIZE, X64_CACHE_LINE_SIZE,
+                              ktest_slab_ctor);
+
+    KTEST_CHECK(cache != NULL, "slab: create");
+
+    if (!cache)
+        return failed;
+
+    for (i = 0; i < KTEST_SLAB_OBJS; i++)
+        {
+        obj = kmem_cache_alloc(cache);
+
+        if (!obj)
+            break;
+
+        if ((ptr_t)obj % X64_CACHE_LINE_SIZE)
+            aligned = FALSE;
+
+        if (obj[0] != KTEST_SLAB_MAGIC)
+            constructed = FALSE;
+
+        /* Tag the whole object, an overlapping one clobbers the tag */
+        memset(obj, i & 0xFF, KTEST_SLAB_SIZE);
+        obj[1] = i;
+
+        ktest_slab_objs[i] = obj;
+        }
+
+    KTEST_CHECK(i == KTEST_SLAB_OBJS, "slab: alloc");
+    KTEST_CHECK(aligned, "slab: alignment");
+    KTEST_CHECK(constructed, "slab: constructor");
+    KTEST_CHECK(cache->nr_active >= (size_t)i, "slab: active count");
+
+    while (i--)
+        {
+        obj = ktest_slab_objs[i];
+
+        if ((obj[1] != (uint64_t)i) || 
+            (((uint8_t *)obj)[KTEST_SLAB_SIZE - 1] != (i & 0xFF)))
+            distinct = FALSE;
+
+        /* Objects go back in their constructed state */
+        obj[0] = KTEST_SLAB_MAGIC;
+
+        kmem_cache_free(cache, obj);
+        }
+
+    KTEST_CHECK(distinct, "slab: distinct objects");
+    KTEST_CHECK(cache->nr_active <= 
+                CONFIG_NR_CPUS * KMEM_CACHE_MAGAZINE_SIZE, "slab: free");
+
+    /* Freed objects come back constructed */
+    obj = kmem_cache_alloc(cache);
+
+    KTEST_CHECK(obj && (obj[0] == KTEST_SLAB_MAGIC), "slab: reuse");
+
+    if (obj)
+        kmem_cache_free(cache, obj);
+
+    kmem_cache_destroy(cache);
+
+    return failed;
+    }
+
+#define KTEST_REMOTE_ROUNDS 512
+#define KTEST_REMOTE_SIZE   (1024 * 1024)
+
+static void * volatile ktest_remote_ptr;
+static volatile int ktest_remote_cpu;
+static volatile BOOL ktest_remote_stop;
+static volatile int ktest_remote_frees;
+
+/* Free the blocks handed over by ktest_kfree_remote() on another CPU */
+static void * ktest_remote_thread(void * param)
+    {
+    void * ptr;
+
+    while (!ktest_remote_stop)
+        {
+        if ((ptr = ktest_remote_ptr) == NULL)
+            {
+            sched_yield();
+            continue;
+            }
+
+        if (this_cpu() != ktest_remote_cpu)
+            ktest_remote_frees++;
+
+        kfree(ptr);
+
+        ktest_remote_ptr = NULL;
+        }
+
+    pthread_exit(NULL);
+
+    return NULL;
+    }
+
+/* Start a thread on another online CPU, FALSE if there is none */
+static BOOL ktest_thread_start_remote
+    (
+    const char *    name,
+    void *          (*entry)(void *),
+    void *          arg
+    )
+    {
+    pthread_attr_t attr;
+    pthread_t thread;
+    int i, ret;
+
+    for (i = 0; i < CONFIG_NR_CPUS; i++)
+        {
+        if ((i != this_cpu()) && (cpus[i].idle_thread != NULL))
+            break;
+        }
+
+    if (i == CONFIG_NR_CPUS)
+        return FALSE;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setname_np(&attr, (char *)name);
+
+    CPU_SET(i, &attr->cpu_set);
+
+    ret = pthread_create(&thread, &attr, entry, arg);
+
+    pthread_attr_destroy(&attr);
+
+    return (ret == OK);
+    }
+
+/*
+ * kfree() on another CPU: the blocks go back to their arena through its
+ * remote free list, or the rounds would exhaust it
+ */
+static int ktest_kfree_remote(void)
+    {
+    uint8_t * ptr = NULL;
+    int i, failed = 0;
+
+    ktest_remote_ptr = NULL;
+    ktest_remote_stop = FALSE;
+    ktest_remote_frees = 0;
+
+    if (!ktest_thread_start_remote("ktest-kfree", ktest_remote_thread, NULL))
+        {
+        printk("ktest: kfree remote skipped, no other CPU\n");
+        return 0;
+        }
+
+    for (i = 0; i < KTEST_REMOTE_ROUNDS; i++)
+        {
+        ktest_remote_cpu = this_cpu();
+
+        if ((ptr = kmalloc(KTEST_REMOTE_SIZE)) == NULL)
+            break;
+
+        memset(ptr, 0xA5, KTEST_REMOTE_SIZE);
+
+        ktest_remote_ptr = ptr;
+
+        while (ktest_remote_ptr != NULL)
+            sched_yield();
+        }
+
+    ktest_remote_stop = TRUE;
+
+    KTEST_CHECK(ptr != NULL, "kfree remote: blocks reused");
+    KTEST_CHECK(ktest_remote_frees > 0, "kfree remote: freed remotely");
+
+    printk("ktest: %d of %d blocks freed remotely\n", 
+        ktest_remote_frees, i);
+
+    return failed;
+    }
+
+#define KTEST_HEAP_BLOCKS   48
+#define KTEST_HEAP_SIZE     (256 * 1024)
+
+static void * ktest_heap_blocks[KTEST_HEAP_BLOCKS];
+
+/* Heap arenas grow past their initial size and shrink back once free */
+static int ktest_heap_grow(void)
+    {
+    BOOL intact = TRUE;
+    size_t freed;
+    int i, j, failed = 0;
+
+    /* Three times the boot arena, wherever this thread runs */
+    for (i = 0; i < KTEST_HEAP_BLOCKS; i++)
+        {
+        if ((ktest_heap_blocks[i] = kmalloc(KTEST_HEAP_SIZE)) == NULL)
+            break;
+
+        memset(ktest_heap_blocks[i], i, KTEST_HEAP_SIZE);
+        }
+
+    KTEST_CHECK(i == KTEST_HEAP_BLOCKS, "heap: grow");
+
+    for (j = 0; j < i; j++)
+        {
+        if ((((uint8_t *)ktest_heap_blocks[j])[0] != j) ||
+            (((uint8_t *)ktest_heap_blocks[j])[KTEST_HEAP_SIZE - 1] != j))
+            intact = FALSE;
+
+        kfree(ktest_heap_blocks[j]);
+        }
+
+    KTEST_CHECK(intact, "heap: blocks intact");
+
+    freed = kmalloc_shrink();
+
+    printk("ktest: heap shrink gave back %lld bytes\n", (long long)freed);
+
+    KTEST_CHECK(freed > 0, "heap: shrink");
+
+    return failed;
+    }
+
+/* Large page tests map this range of a private page map, never touched */
+#define KTEST_PMAP_VIRT     0x40000000UL
+#define KTEST_PMAP_PHYS     0x80000000UL
+#define KTEST_PMAP_SIZE     (2 * PG_PTBL_SIZE)
+
+/* Get the paging structure entry of an address at a level, 0 if none */
+static uint64_t ktest_pmap_entry
+    (
+    pmap_t *    map,
+    ptr_t       virt,
+    int         level
+    )
+    {
+    uint64_t * table = map->pml4v;
+    uint64_t entry;
+    int l;
+
+    for (l = PMAP_PAGE_512G; ; l--)
+        {
+        entry = table[(virt >> (PAGE_SHIFT + 9 * l)) & 511];
+
+        if ((l == level) || !(entry & PG_PRESENT) || (entry & PG_LARGE))
+            return (l == level) ? entry : 0;
+
+        table = (uint64_t *)PA2VA(entry & PAGE_MASK);
+        }
+    }
+
+/* Large pages: mapping, translation, in-place protect and splitting */
+static int ktest_pmap_large(void)
+    {
+    const ptr_t virt = KTEST_PMAP_VIRT;
+    cpu_addr_t phys;
+    uint64_t pde;
+    pmap_t map;
+    ptr_t va;
+    int failed = 0;
+
+    if (pmap_init(&map, TRUE, virt, virt + KTEST_PMAP_SIZE - 1) != 0)
+        {
+        KTEST_CHECK(FALSE, "pmap: init");
+        return failed;
+        }
+
+    KTEST_CHECK(pmap_insert_range(&map, virt, KTEST_PMAP_PHYS, 
+                                  KTEST_PMAP_SIZE, PMAP_READ | PMAP_WRITE, 
+                                  0) == 0, "pmap: insert range");
+
+    pde = ktest_pmap_entry(&map, virt, PMAP_PAGE_2M);
+
+    KTEST_CHECK((pde & PG_LARGE) && (pde & PG_WRITE), "pmap: 2MB page");
+
+    KTEST_CHECK(pmap_find(&map, virt + PG_PTBL_SIZE + 0x12000, &phys) &&
+                (phys == KTEST_PMAP_PHYS + PG_PTBL_SIZE + 0x12000), 
+                "pmap: find in 2MB page");
+
+    /* One 4KB page of the first large page, which gets split */
+    pmap_protect(&map, virt, virt + PAGE_SIZE, PMAP_READ);
+
+    pde = ktest_pmap_entry(&map, virt, PMAP_PAGE_2M);
+
+    KTEST_CHECK((pde & PG_PRESENT) && !(pde & PG_LARGE), 
+                "pmap: protect splits");
+    KTEST_CHECK(!(ktest_pmap_entry(&map, virt, PMAP_PAGE_4K) & PG_WRITE) &&
+                (ktest_pmap_entry(&map, virt + PAGE_SIZE, PMAP_PAGE_4K) & 
+                 PG_WRITE), "pmap: protect one page");
+    KTEST_CHECK(pmap_find(&map, virt + 0x123000, &phys) &&
+                (phys == KTEST_PMAP_PHYS + 0x123000), "pmap: find split");
+
+    /* The whole second large page, changed in place */
+    pmap_protect(&map, virt + PG_PTBL_SIZE, virt + 2 * PG_PTBL_SIZE, 
+                 PMAP_READ);
+
+    pde = ktest_pmap_entry(&map, virt + PG_PTBL_SIZE, PMAP_PAGE_2M);
+
+    KTEST_CHECK((pde & PG_LARGE) && !(pde & PG_WRITE), 
+                "pmap: protect in place");
+
+    /* Unmapping a 4KB page splits the large page around it */
+    KTEST_CHECK(pmap_remove(&map, virt + PG_PTBL_SIZE + PAGE_SIZE, 
+                            NULL) == 0, "pmap: remove");
+    KTEST_CHECK(!pmap_find(&map, virt + PG_PTBL_SIZE + PAGE_SIZE, &phys) &&
+                pmap_find(&map, virt + PG_PTBL_SIZE, &phys) &&
+                (phys == KTEST_PMAP_PHYS + PG_PTBL_SIZE), 
+                "pmap: remove splits");
+
+    /* Unmap all, which frees the page tables */
+    for (va = virt; va < virt + KTEST_PMAP_SIZE; va += PAGE_SIZE)
+        pmap_remove(&map, va, NULL);
+
+    KTEST_CHECK(!pmap_find(&map, virt, &phys) &&
+                !ktest_pmap_entry(&map, virt, PMAP_PAGE_2M), 
+                "pmap: remove all");
+
+    pmap_destroy(&map);
+
+    return failed;
+    }
+
+#define KTEST_TIMERS    8
+
+static const int ktest_timer_ms[KTEST_TIMERS] = 
+    { 250, 30, 700, 10, 1200, 90, 650, 60 };
+
+static ktimer_t ktest_timers[KTEST_TIMERS];
+static abstime_t ktest_timer_fired[KTEST_TIMERS];
+static volatile int ktest_timer_order[KTEST_TIMERS];
+static volatile int ktest_timer_count;
+
+static void ktest_timer_func(void * arg)
+    {
+    int i = (int)(long)arg;
+
+    ktest_timer_fired[i] = get_monotonic_nanosecond();
+
+    if (ktest_timer_count < KTEST_TIMERS)
+        ktest_timer_order[ktest_timer_count++] = i;
+    }
+
+/* Timer wheel: expiry order across levels, and the next expiry */
+static int ktest_timer_wheel(void)
+    {
+    BOOL ordered = TRUE, on_time = TRUE;
+    ktimer_t far, near;
+    abstime_t granule = TIMER_WHEEL_GRANULE_NS;
+    abstime_t now, next;
+    int i, failed = 0;
+    ipl_t ipl;
+
+    ktest_timer_count = 0;
+
+    now = get_monotonic_nanosecond();
+
+    for (i = 0; i < KTEST_TIMERS; i++)
+        {
+        ktimer_init(&ktest_timers[i], ktest_timer_func, (void *)(long)i);
+        ktimer_arm(&ktest_timers[i], now + MSECS2NSECS(ktest_timer_ms[i]));
+        }
+
+    for (i = 0; (i < 40) && (ktest_timer_count < KTEST_TIMERS); i++)
+        sched_thread_sleep_until(get_monotonic_nanosecond() + 
+                                 MSECS2NSECS(50));
+
+    KTEST_CHECK(ktest_timer_count == KTEST_TIMERS, "timer: all fired");
+
+    for (i = 0; i < ktest_timer_count; i++)
+        {
+        if ((i > 0) && (ktest_timer_ms[ktest_timer_order[i]] < 
+                        ktest_timer_ms[ktest_timer_order[i - 1]]))
+            ordered = FALSE;
+
+        if (ktest_timer_fired[ktest_timer_order[i]] < 
+            ktest_timers[ktest_timer_order[i]].expires)
+            on_time = FALSE;
+        }
+
+    KTEST_CHECK(ordered, "timer: expiry order");
+    KTEST_CHECK(on_time, "timer: not early");
+
+    for (i = 0; i < KTEST_TIMERS; i++)
+        ktimer_cancel_sync(&ktest_timers[i]);
+
+    /*
+     * A timer a whole level 1 rotation ahead lands in the current level 1
+     * slot, the earliest one is in a later slot. Keep away from the slot
+     * boundaries so that the wheel is in the same slot as we are.
+     */
+    while (((get_monotonic_nanosecond() / granule) & TIMER_WHEEL_MASK) < 2 ||
+           ((get_monotonic_nanosecond() / granule) & TIMER_WHEEL_MASK) > 60)
+        sched_thread_sleep_until(get_monotonic_nanosecond() + granule);
+
+    ktimer_init(&far, ktest_timer_func, (void *)0);
+    ktimer_init(&near, ktest_timer_func, (void *)0);
+
+    ipl = interrupts_disable();
+
+    now = get_monotonic_nanosecond();
+
+    ktimer_arm(&far, ((now / granule / TIMER_WHEEL_SLOTS) + 
+                      TIMER_WHEEL_SLOTS) * TIMER_WHEEL_SLOTS * granule);
+    ktimer_arm(&near, now + 3 * TIMER_WHEEL_SLOTS * granule);
+
+    next = timer_wheel_next_expiry();
+
+    ktimer_cancel(&far);
+    ktimer_cancel(&near);
+
+    interrupts_restore(ipl);
+
+    KTEST_CHECK(next <= near.expires, "timer: next expiry");
+
+    return failed;
+    }
+
+#define KTEST_SEM_ROUNDS    50
+
+static sem_t ktest_sem;
+static volatile BOOL ktest_sem_post;
+
+/* Post ktest_sem about when the timed wait of ktest_sem_wait() ends */
+static void * ktest_sem_thread(void * param)
+    {
+    abstime_t delay = (abstime_t)(long)param;
+    int i;
+
+    for (i = 0; i < KTEST_SEM_ROUNDS; i++)
+        {
+        while (!ktest_sem_post)
+            sched_yield();
+
+        sched_thread_sleep_until(get_monotonic_nanosecond() + delay);
+
+        sem_post(&ktest_sem);
+
+        ktest_sem_post = FALSE;
+        }
+
+    pthread_exit(NULL);
+
+    return NULL;
+    }
+
+/* Wait on ktest_sem for 'timeout' ns, returns the sem_timedwait result */
+static int ktest_sem_timedwait
+    (
+    abstime_t   timeout,
+    abstime_t * elapsed
+    )
+    {
+    abstime_t start;
+    timespec_t ts;
+    int ret;
+
+    start = get_monotonic_nanosecond();
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    abstime_to_timespec(timespec_to_abstime(&ts) + timeout, &ts);
+
+    ret = sem_timedwait(&ktest_sem, &ts);
+
+    *elapsed = get_monotonic_nanosecond() - start;
+
+    return ret;
+    }
+
+/* sem_timedwait() timeouts and races with sem_post(), and nanosleep() */
+static int ktest_sem_wait(void)
+    {
+    const abstime_t timeout = MSECS2NSECS(20);
+    BOOL counted = TRUE, on_time = TRUE, slept = TRUE;
+    abstime_t start, elapsed;
+    timespec_t ts;
+    BOOL got;
+    int i, posted = 0, failed = 0;
+
+    sem_init(&ktest_sem, 0, 0);
+
+    KTEST_CHECK((ktest_sem_timedwait(timeout, &elapsed) == ERROR) &&
+                (kurrent->err == ETIMEDOUT) && (elapsed >= timeout), 
+                "sem: timeout");
+
+    sem_post(&ktest_sem);
+
+    KTEST_CHECK(ktest_sem_timedwait(timeout, &elapsed) == OK, 
+                "sem: posted");
+
+    /* Post right when the waits time out, a lost race leaves the count */
+    ktest_sem_post = FALSE;
+
+    if (!ktest_thread_start_remote("ktest-sem", ktest_sem_thread, 
+                                   (void *)(long)TIMER_WHEEL_GRANULE_NS))
+        {
+        printk("ktest: sem race skipped, no other CPU\n");
+        }
+    else
+        {
+        for (i = 0; i < KTEST_SEM_ROUNDS; i++)
+            {
+            ktest_sem_post = TRUE;
+
+            got = (ktest_sem_timedwait(TIMER_WHEEL_GRANULE_NS, 
+                                       &elapsed) == OK);
+
+            if (got)
+                posted++;
+            else if (elapsed < TIMER_WHEEL_GRANULE_NS)
+                on_time = FALSE;
+
+            while (ktest_sem_post)
+                sched_yield();
+
+            /* The post is left counted only if the wait timed out */
+            if ((sem_trywait(&ktest_sem) == OK) == got)
+                counted = FALSE;
+            }
+
+        printk("ktest: %d of %d waits got the post\n", 
+            posted, KTEST_SEM_ROUNDS);
+
+        KTEST_CHECK(counted, "sem: post races");
+        KTEST_CHECK(on_time, "sem: no early timeout");
+        }
+
+    /* Nothing left to claim the wakeup of the next wait */
+    KTEST_CHECK((ktest_sem_timedwait(timeout, &elapsed) == ERROR) &&
+                (elapsed >= timeout), "sem: timeout after races");
+
+    sem_destroy(&ktest_sem);
+
+    for (i = 0; i < 5; i++)
+        {
+        start = get_monotonic_nanosecond();
+
+        ts.tv_sec = 0;
+        ts.tv_nsec = timeout;
+
+        nanosleep(&ts, NULL);
+
+        elapsed = get_monotonic_nanosecond() - start;
+
+        if ((elapsed < timeout) || (elapsed > timeout + NSECS_PER_SEC))
+            slept = FALSE;
+        }
+
+    KTEST_CHECK(slept, "nanosleep");
+
+    return failed;
+    }
+
+static const struct
+    {
+    const char *    name;
+    int             (*func)(void);
+    } ktests[] =
+    {
+    { "slab",   ktest_slab },
+    { "kfree",  ktest_kfree_remote },
+    { "heap",   ktest_heap_grow },
+    { "pmap",   ktest_pmap_large },
+    { "timer",  ktest_timer_wheel },
+    { "sem",    ktest_sem_wait },
+    };
+
+int do_ktest (cmd_tbl_t *cmdtp, int flag, int argc, char *argv[])
+    {
+    int i, j, failed = 0;
+
+    for (i = 0; i < NELEMENTS(ktests); i++)
+        {
+        for (j = 1; j < argc; j++)
+            {
+            if (strcmp(argv[j], ktests[i].name) == 0)
+                break;
+            }
+
+        if ((argc > 1) && (j == argc))
+            continue;
+
+        printk("ktest: running %s\n", ktests[i].name);
+
+        failed += ktests[i].func();
+        }
+
+    printk("ktest: %d checks failed\n", failed);
+
+    return failed ? ERROR : OK;
+    }
+
+CELL_OS_CMD(
+    ktest,   8,        1,    do_ktest,
+    "run the kernel tests",
+    "[slab|kfree|heap|pmap|timer|sem...]\n"
+    "    - run the given kernel tests, or all of them: slab caches, remote\n"
+    "      kfree, heap growth, large pages, timer wheel ordering, timed\n"
+    "      semaphore waits and nanosleep\n"
+    );